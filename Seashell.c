@@ -7,325 +7,9364 @@
 */
 
 
+#define _GNU_SOURCE
+
+#include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <spawn.h>
+#include <termios.h>
 #include <stdbool.h>
 #include <stdio.h>
+#include <stdio_ext.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/file.h>
+#include <sys/inotify.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/sendfile.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <sys/wait.h>
 #include <time.h>
 #include <unistd.h>
 
+extern char** environ;
+
+#define REDIR_OPEN 0
+#define REDIR_DUP 1
+#define REDIR_CLOSE 2
+#define REDIR_FD 3
+#define REDIR_KEEP 4
+
+/**
+ * @brief One step of a redirection plan.
+ * @details REDIR_OPEN opens path with flags onto fd, REDIR_DUP makes fd a copy of src_fd, and
+ * REDIR_CLOSE closes fd. REDIR_FD is a REDIR_DUP whose src_fd the shell opened for the command,
+ * such as a here-document; the shell closes it once the command has been started. REDIR_KEEP
+ * lets fd, one of the shell's close-on-exec fds, survive the exec under its own number.
+*/
+typedef struct {
+    int type;
+    int fd;
+    int src_fd;
+    int flags;
+    const char* path;
+} RedirAction;
+
+/**
+ * @brief Describes how a spawned command's file descriptors are wired up.
+ * @details Built by execCmd() from the parsed command line. The pipe ends are connected first,
+ * then the actions are applied in the order they were written, so "> f 2>&1" and "2>&1 > f"
+ * behave as they do in sh. A negative pipe fd means the stream is inherited from the shell.
+ */
+typedef struct {
+    RedirAction* actions;
+    int nactions;
+    int cap;
+    int stdin_fd;
+    int stdout_fd;
+} RedirPlan;
+
+/**
+ * @brief One command of a pipeline together with its VAR=value prefixes, redirections and outcome.
+ * @details A subshell, brace group or background list has a body instead, run by a forked copy of
+ * the shell; its argv then only names it for the job table.
+*/
+typedef struct {
+    char** argv;
+    char** assigns;
+    RedirPlan plan;
+    struct Node* body;
+    pid_t pid;
+    int status;
+    struct rusage usage;
+} PipelineStage;
+
+//Launch strategies for external commands
+#define SPAWN_POSIX 0
+#define SPAWN_FORK 1
+
+int spawn_mode = SPAWN_POSIX;
+
+/**
+ * @brief One remembered command location. A NULL path records that the command was not found.
+*/
+typedef struct PathEntry {
+    char* name;
+    char* path;
+    unsigned long hits;
+    struct PathEntry* next;
+} PathEntry;
+
+#define PATH_CACHE_BUCKETS 256
+
+/**
+ * @brief Command-location cache consulted before every exec, like the hash table in bash.
+ * @details The cache is tied to the PATH value it was filled from and to the mtimes of the
+ * PATH directories, which change whenever an entry is added to or removed from them.
+*/
+typedef struct {
+    PathEntry* buckets[PATH_CACHE_BUCKETS];
+    char* path_value;
+    char** dirs;
+    struct timespec* mtimes;
+    int ndirs;
+    time_t last_check;
+    unsigned long hits;
+    unsigned long misses;
+} PathCache;
+
+PathCache path_cache;
+
+//Variable flags
+#define VAR_EXPORT 1
+#define VAR_UNSET 2
+#define VAR_BORROWED 4
+
+/**
+ * @brief A shell variable.
+ * @details entry holds "NAME=value" in one string, so an exported variable goes into the envp
+ * of commands as it is. Entries are never changed in place: a new value gets a new entry.
+ * VAR_UNSET marks a name that was exported before it had a value, and VAR_BORROWED an entry
+ * that still points into the environment the shell started with, which is not ours to free.
+*/
+typedef struct Variable {
+    char* entry;
+    unsigned int name_len;
+    unsigned int hash;
+    int flags;
+    int env_slot;
+    struct Variable* next;
+} Variable;
+
+//Spare envp slots in front of the cached array, taken by VAR=value prefixes of new names
+#define ENV_OVERLAY_SLOTS 16
+
+/**
+ * @brief Every shell variable, and the envp built from the exported ones.
+ * @details generation changes whenever an exported variable is set, exported or unset, and the
+ * envp is only rebuilt when it no longer matches env_generation, so commands are usually
+ * started with the array that is already there. Entries replaced since the last rebuild stay in
+ * retired until then, as the current envp (which is also environ) may still point at them.
+*/
+typedef struct {
+    Variable** buckets;
+    size_t nbuckets;
+    size_t count;
+    unsigned long generation;
+    char** env_base;
+    char** env;
+    size_t env_count;
+    size_t env_cap;
+    unsigned long env_generation;
+    char** retired;
+    size_t nretired;
+    size_t retired_cap;
+} VarStore;
+
+VarStore vars;
+
+/**
+ * @brief The cached envp slots a command's VAR=value prefixes replaced, to be put back once it
+ * has started.
+*/
+typedef struct {
+    int* slots;
+    char** saved;
+    int count;
+} EnvOverlay;
+
+/**
+ * @brief One executable in the command index: where its name starts in the string table and
+ * the index of the PATH directory it was found in.
+*/
+typedef struct {
+    unsigned int offset;
+    int dir;
+} IndexEntry;
+
+/**
+ * @brief Every executable in the PATH directories, for Tab completion and PATH cache misses.
+ * @details Names are stored back to back in strings and entries is sorted by name, so all the
+ * commands starting with a prefix sit together after one binary search. The index is built on
+ * a background thread, then kept current from inotify events by the main thread. It is partial
+ * when some PATH directory could not be listed, in which case lookups still walk PATH.
+*/
+typedef struct {
+    IndexEntry* entries;
+    size_t count;
+    size_t cap;
+    char* strings;
+    size_t strings_len;
+    size_t strings_cap;
+    char* path_value;
+    char** dirs;
+    int* watches;
+    int ndirs;
+    int partial;
+} CommandIndex;
+
+//The index in use, and one the builder thread has finished but the main thread not yet taken
+CommandIndex* command_index = NULL;
+CommandIndex* index_built = NULL;
+pthread_t index_thread;
+int index_building = 0;
+int index_inotify = -1;
+
+//Exit status of the last foreground pipeline, and of each of its stages
+int last_status = 0;
+int* pipe_status = NULL;
+int pipe_status_len = 0;
+
+//Pipe capacity policy: 0 keeps the kernel default, otherwise bytes requested with F_SETPIPE_SZ
+#define PIPE_SIZE_DEFAULT 65536
+long pipe_capacity = 0;
+int pipe_capacity_auto = 0;
+long pipe_capacity_max = 0;
+
+/**
+ * @brief Learned pipe capacity for pipelines whose producer is the named command.
+*/
+typedef struct {
+    char name[32];
+    long capacity;
+} PipeHint;
+
+#define PIPE_HINT_SLOTS 64
+PipeHint pipe_hints[PIPE_HINT_SLOTS];
+
+//Set by the SIGCHLD handler; children are only reaped at safe points by reapChildren()
+volatile sig_atomic_t child_exited = 0;
+pid_t last_background_pid = 0;
+
+//Job and process states
+#define JOB_RUNNING 0
+#define JOB_STOPPED 1
+#define JOB_DONE 2
+
+/**
+ * @brief What a command, a pipeline or the whole session cost.
+ * @details Times are in seconds and maxrss in KiB. Summed over several processes, maxrss is the
+ * largest of them. A real time below zero means it was not measured, as for a single stage,
+ * whose exit the shell may only notice after the stages before it.
+*/
+typedef struct {
+    double real;
+    double user;
+    double sys;
+    long maxrss;
+    long nvcsw;
+    long nivcsw;
+} ResourceUsage;
+
+/**
+ * @brief One process of a job, with its last reported wait status and resource usage.
+*/
+typedef struct {
+    pid_t pid;
+    int state;
+    int status;
+    struct rusage usage;
+    char* name;
+} JobProc;
+
+/**
+ * @brief A pipeline the shell is still responsible for: running, stopped, or finished but not yet reported.
+*/
+typedef struct Job {
+    int id;
+    pid_t pgid;
+    JobProc* procs;
+    int nprocs;
+    int state;
+    int notified;
+    int timed;
+    struct timespec started;
+    ResourceUsage usage;
+    struct termios tmodes;
+    int has_tmodes;
+    char* cmdline;
+    struct Job* next;
+} Job;
+
+Job* job_list = NULL;
+struct termios shell_tmodes;
+
+//Totals over every pipeline finished in the session, and the last one, kept for the metrics builtin
+ResourceUsage session_usage;
+unsigned long session_pipelines = 0;
+unsigned long session_processes = 0;
+Job* last_job = NULL;
+
+/**
+ * @brief One chunk of arena memory; allocations are carved from data[] in order.
+*/
+typedef struct ArenaBlock {
+    struct ArenaBlock* next;
+    size_t size;
+    size_t used;
+    char data[];
+} ArenaBlock;
+
+/**
+ * @brief Bump allocator for everything that only lives as long as one command line.
+ * @details Nothing allocated from an arena is freed individually; arenaReset() releases it
+ * all at once and keeps the first block for the next line.
+*/
+typedef struct {
+    ArenaBlock* head;
+} Arena;
+
+/**
+ * @brief A point in an arena's allocations that arenaRelease() can go back to.
+*/
+typedef struct {
+    ArenaBlock* block;
+    size_t used;
+} ArenaMark;
+
+#define ARENA_BLOCK_SIZE 65536
+#define ARENA_KEEP_MAX (16 << 20)
+
+/**
+ * @brief A token as a view into the line it was cut from.
+ * @details Words keep their quotes; flags says what expandWord() has to do with them, and a
+ * word with no flags is used as it stands. Operators are told apart by type alone. The fields
+ * are packed into 8 bytes, since the token array is the lexer's main memory traffic on long
+ * lines.
+*/
+typedef struct {
+    unsigned int offset;
+    unsigned int length : 24;
+    unsigned int type : 5;
+    unsigned int flags : 3;
+} Token;
+
+//Longer words are refused; the kernel takes at most 128 KiB for one argument anyway
+#define TOKEN_LENGTH_MAX ((1u << 24) - 1)
+
+//Token types
+#define TOKEN_WORD 0
+#define TOKEN_IO_NUMBER 1
+#define TOKEN_PIPE 2
+#define TOKEN_OR 3
+#define TOKEN_AMP 4
+#define TOKEN_AND 5
+#define TOKEN_SEMI 6
+#define TOKEN_DSEMI 7
+#define TOKEN_LPAREN 8
+#define TOKEN_RPAREN 9
+#define TOKEN_NEWLINE 10
+#define TOKEN_HEREDOC 11
+#define TOKEN_LESS 12
+#define TOKEN_GREAT 13
+#define TOKEN_DGREAT 14
+#define TOKEN_CLOBBER 15
+#define TOKEN_LESSGREAT 16
+#define TOKEN_DLESS 17
+#define TOKEN_DLESSDASH 18
+#define TOKEN_TLESS 19
+#define TOKEN_GREATAND 20
+#define TOKEN_LESSAND 21
+#define TOKEN_ANDGREAT 22
+#define TOKEN_ANDDGREAT 23
+#define TOKEN_IS_REDIR(type) ((type) >= TOKEN_LESS)
+
+//Word flags: quotes or backslashes, expansions, and unquoted pattern characters
+#define WORD_QUOTED 1
+#define WORD_EXPAND 2
+#define WORD_GLOB 4
+
+//Returned by tokenizeLine() when a quote, a trailing backslash or a here-document continues on the next line
+#define TOKENS_INCOMPLETE ((size_t)-1)
+//Returned by tokenizeLine() when a word is longer than TOKEN_LENGTH_MAX, which has been reported
+#define TOKENS_ERROR ((size_t)-2)
+
+//The delimiter of a here-document that ran past the end of the text, for runLine(); NULL if none did
+const char* open_heredoc = NULL;
+size_t open_heredoc_len = 0;
+int open_heredoc_strip = 0;
+
+//How each token type is written, for tokenizeLine() and for messages
+const char* const token_spellings[] = {
+    "", "", "|", "||", "&", "&&", ";", ";;", "(", ")", "newline", "here-document",
+    "<", ">", ">>", ">|", "<>", "<<", "<<-", "<<<", ">&", "<&", "&>", "&>>",
+};
+
+//Byte classes for tokenizeLine(); bytes with no class only continue a word
+#define LEX_BLANK 1
+#define LEX_OPERATOR 2
+#define LEX_QUOTE 3
+#define LEX_DOLLAR 4
+#define LEX_GLOB 5
+#define LEX_NEWLINE 6
+
+const unsigned char lex_class[256] = {
+    ['\0'] = LEX_BLANK, [' '] = LEX_BLANK, ['\t'] = LEX_BLANK, ['\n'] = LEX_NEWLINE,
+    ['|'] = LEX_OPERATOR, ['&'] = LEX_OPERATOR, [';'] = LEX_OPERATOR, ['('] = LEX_OPERATOR,
+    [')'] = LEX_OPERATOR, ['<'] = LEX_OPERATOR, ['>'] = LEX_OPERATOR,
+    ['\''] = LEX_QUOTE, ['"'] = LEX_QUOTE, ['\\'] = LEX_QUOTE,
+    ['$'] = LEX_DOLLAR, ['*'] = LEX_GLOB, ['?'] = LEX_GLOB, ['['] = LEX_GLOB,
+};
+
+//How expandWord() treats a word: split into fields and globbed, kept as one string, only
+//unquoted, kept as one pattern for globMatch() with quoted pattern characters escaped, or
+//kept as one string with only $ and \ special, as for a here-document body
+#define EXPAND_FIELDS 0
+#define EXPAND_STRING 1
+#define EXPAND_UNQUOTE 2
+#define EXPAND_PATTERN 3
+#define EXPAND_HEREDOC 4
+
+//Kinds of text fieldAppend() adds: unquoted text of the word, quoted text, unquoted expansion output
+#define FIELD_LITERAL 0
+#define FIELD_QUOTED 1
+#define FIELD_EXPANDED 2
+
+/**
+ * @brief A word being built up by expandWord().
+ * @details In EXPAND_FIELDS mode text is kept escaped, with a backslash before every quoted
+ * character that would otherwise be special to globbing, until the field is finished.
+*/
+typedef struct {
+    char* text;
+    size_t len;
+    size_t cap;
+    int mode;
+    int have;
+    int pattern;
+    int escaped;
+} Field;
+
+Arena line_arena;
+
+/**
+ * @brief A node of the syntax tree built by parseTokens() for one input unit.
+ * @details A pipeline of simple commands stays a NODE_COMMAND over its tokens, pipes and a
+ * leading "time" included, and goes to execCmd() as it is. Only pipelines with a compound
+ * command in them become NODE_PIPELINE, with one node per stage. Lists are right-leaning. The
+ * tree is only read by compileNode(); a node that runs in a forked shell gets the range of
+ * bytecode that child runs. Nodes are allocated from the arena the unit lives in.
+*/
+typedef struct Node {
+    int type;
+    int flags;
+    char* text;
+    Token* tokens;
+    size_t ntokens;
+    Token* redirs;
+    size_t nredirs;
+    Token* words;
+    size_t nwords;
+    Token* name;
+    struct Node* left;
+    struct Node* right;
+    struct Node* alt;
+    struct Node** stages;
+    int nstages;
+    struct Program* prog;
+    int code_start;
+    int code_end;
+} Node;
+
+//Node types: and_or lists; ( ) and { } with left as the body; a pipeline with compound stages
+#define NODE_COMMAND 0
+#define NODE_LIST 1
+#define NODE_AND 2
+#define NODE_OR 3
+#define NODE_SUBSHELL 4
+#define NODE_GROUP 5
+#define NODE_PIPELINE 6
+//if: left is the condition, right the body and alt the else part, an elif being a nested NODE_IF
+#define NODE_IF 7
+//while and until: left is the condition and right the body
+#define NODE_WHILE 8
+#define NODE_UNTIL 9
+//for: name is the variable, words the list (NULL without "in") and left the body
+#define NODE_FOR 10
+//case: words is the word and stages the NODE_PATTERN items, with their patterns in words and body in left
+#define NODE_CASE 11
+#define NODE_PATTERN 12
+//name() body
+#define NODE_FUNCTION 13
+
+//Node flags
+#define NODE_BACKGROUND 1
+#define NODE_NEGATE 2
+#define NODE_TIMED 4
+
+//Results of parseTokens()
+#define PARSE_OK 0
+#define PARSE_ERROR 1
+#define PARSE_INCOMPLETE 2
+
+/**
+ * @brief The state of a recursive-descent parse over a token array.
+*/
+typedef struct {
+    Arena* arena;
+    char* text;
+    Token* tokens;
+    size_t ntokens;
+    size_t pos;
+    int status;
+} Parser;
+
+//Set when last_status came from a command that -e must ignore, such as the left side of && or ||
+int errexit_exempt = 0;
+
+/**
+ * @brief One bytecode instruction.
+ * @details Commands keep their tokens and are expanded each time they run; nothing is parsed
+ * again. arg is a jump target, or a status for OP_STATUS.
+*/
+typedef struct {
+    unsigned char op;
+    unsigned char flags;
+    int arg;
+    Token* tokens;
+    size_t ntokens;
+    const void* data;
+} Instr;
+
+/**
+ * @brief The bytecode compiled from one input unit or function body.
+ * @details text is what the tokens point into. max_loops and max_redirs size the stacks of
+ * runProgram().
+*/
+typedef struct Program {
+    char* text;
+    Instr* code;
+    int ncode;
+    int cap;
+    int max_loops;
+    int max_redirs;
+    Arena* arena;
+} Program;
+
+/**
+ * @brief The state of compileNode(): the program and how deeply nested the current point is.
+*/
+typedef struct {
+    Program* prog;
+    int loops;
+    int redirs;
+} Compiler;
+
+//Opcodes. Commands: a simple command or pipeline through execCmd(), a builtin called directly,
+//and a job of forked shells through runCompound()
+#define OP_COMMAND 0
+#define OP_BUILTIN 1
+#define OP_SPAWN 2
+//Control: jumps, on last_status for the conditional ones; negation; setting the status
+#define OP_JUMP 3
+#define OP_JUMP_FALSE 4
+#define OP_JUMP_TRUE 5
+#define OP_NOT 6
+#define OP_STATUS 7
+//Redirections of a compound command, applied to the shell until the matching OP_RESTORE
+#define OP_REDIRECT 8
+#define OP_RESTORE 9
+//Loops: OP_LOOP and OP_FOR enter one (arg is its OP_DONE), OP_NEXT takes the next for item or
+//leaves, OP_REPEAT ends an iteration and OP_DONE leaves the loop
+#define OP_LOOP 10
+#define OP_FOR 11
+#define OP_NEXT 12
+#define OP_REPEAT 13
+#define OP_DONE 14
+//case: expand the word, then jump to arg if a pattern matches it
+#define OP_CASE 15
+#define OP_MATCH 16
+//Define a function
+#define OP_DEFINE 17
+
+//Instruction flags
+#define INSTR_BACKGROUND 1
+#define INSTR_EXEMPT 2
+
+/**
+ * @brief A loop being run by runProgram().
+ * @details mark is where the arena stood before the first iteration; each iteration gives back
+ * everything allocated after it. items are the words of a for loop.
+*/
+typedef struct {
+    int done;
+    int next;
+    int status;
+    int redirs;
+    ArenaMark mark;
+    char** items;
+    size_t nitems;
+    size_t item;
+} LoopFrame;
+
+/**
+ * @brief The copies runBuiltin() and OP_REDIRECT keep of the fds a redirection plan touches.
+*/
+typedef struct {
+    struct { int fd; int copy; int flags; }* fds;
+    int count;
+} SavedFds;
+
+//Set by break, continue and return for runProgram() to act on; unwind_count is break's level
+#define UNWIND_BREAK 1
+#define UNWIND_CONTINUE 2
+#define UNWIND_RETURN 3
+int unwind = 0;
+int unwind_count = 0;
+
+//How many loops are running in the current function, or outside any, and how many functions
+int loop_depth = 0;
+int function_depth = 0;
+
+/**
+ * @brief A shell function: its body, compiled once when it is defined, in an arena of its own.
+ * @details A function redefined while it runs is only freed when its last call returns.
+*/
+typedef struct Function {
+    char* name;
+    Arena arena;
+    Program* prog;
+    int calls;
+    int retired;
+    struct Function* next;
+} Function;
+
+Function* functions = NULL;
+
+/**
+ * @brief The entries of one directory, read for glob expansion.
+ * @details names holds every entry as its d_type byte followed by its NUL-terminated name, and
+ * entries points at the names in sorted order, so matches come out sorted as well.
+*/
+typedef struct GlobDir {
+    char* path;
+    char* names;
+    char** entries;
+    size_t count;
+    struct GlobDir* next;
+} GlobDir;
+
+#define GLOB_CACHE_BUCKETS 64
+#define GLOB_READ_SIZE (1 << 20)
+
+//Directories listed for globs on the current line, so repeated patterns read each one only once
+GlobDir* glob_cache[GLOB_CACHE_BUCKETS];
+
+/**
+ * @brief A glob expansion in progress: the path built so far and the matches found.
+*/
+typedef struct {
+    char* path;
+    size_t path_cap;
+    char** found;
+    size_t count;
+    size_t cap;
+} GlobState;
+
+/**
+ * @brief Where command lines come from: the terminal, a script, or a -c string.
+ * @details Mapped scripts and -c strings are read in place from data. Other streams are read
+ * through buf in large chunks. Interactive input is read a line at a time by the line editor (or
+ * getline() when the terminal cannot take escape sequences) into buf, which can hold several
+ * pasted lines that are then returned one by one.
+*/
+typedef struct {
+    const char* data;
+    size_t len;
+    size_t pos;
+    int fd;
+    char* buf;
+    size_t buf_start;
+    size_t buf_len;
+    size_t buf_cap;
+    int interactive;
+    int mapped;
+} InputSource;
+
+#define INPUT_CHUNK (1 << 20)
+
+InputSource* current_input = NULL;
+
+/**
+ * @brief The line being edited at an interactive prompt.
+ * @details cursor is where the terminal cursor is, counted in columns from the start of the
+ * prompt's last line, so with cols columns per row it sits on row cursor / cols at column
+ * cursor % cols. The output for one key press is collected in out and written at once.
+*/
+typedef struct {
+    char* buf;
+    size_t len;
+    size_t cap;
+    size_t pos;
+    const char* prompt;
+    size_t prompt_cols;
+    size_t cols;
+    size_t cursor;
+    char* out;
+    size_t out_len;
+    size_t out_cap;
+    size_t history_pos;
+    char* saved;
+} LineEditor;
+
+//Whether the prompt uses the line editor: stdin and stdout are terminals and TERM is not dumb
+int line_editor = 0;
+
+//Editor input not yet consumed; keys typed ahead stay here for the next prompt
+char editor_in[4096];
+size_t editor_in_pos = 0;
+size_t editor_in_len = 0;
+volatile sig_atomic_t terminal_resized = 0;
+
+//Key codes for escape sequences and the other results of editorReadByte()
+#define EDITOR_EOF -1
+#define EDITOR_TIMEOUT -2
+#define EDITOR_RESIZE -3
+#define EDITOR_KEY_UP 1000
+#define EDITOR_KEY_DOWN 1001
+#define EDITOR_KEY_LEFT 1002
+#define EDITOR_KEY_RIGHT 1003
+#define EDITOR_KEY_HOME 1004
+#define EDITOR_KEY_END 1005
+#define EDITOR_KEY_DELETE 1006
+#define EDITOR_KEY_WORD_LEFT 1007
+#define EDITOR_KEY_WORD_RIGHT 1008
+#define EDITOR_KEY_PASTE 1009
+
+//The history file, shared by every shell that appends to it, and its current mapping
+int history_fd = -1;
+char* history_path = NULL;
+const char* history_map = NULL;
+size_t history_size = 0;
+
+//The shell that compacts the history at exit, so forked children that exit do not
+pid_t history_owner = 0;
+
+//Interactive shells compact the history file at exit past this size, down to half of it
+#define HISTORY_FILE_MAX (64 << 20)
+#define HISTORY_CHUNK (64 * 1024)
+
+//LineEditor.history_pos until Up or Ctrl-R first needs the history mapped
+#define HISTORY_UNMAPPED ((size_t)-1)
+
+//Completions listed under the line at most; the rest are only counted
+#define COMPLETION_LIST_MAX 200
+
+/**
+ * @brief A command implemented inside the shell.
+ * @details Builtins take the same argv an external command would get and return its exit status.
+ * A pure builtin only writes output and leaves the shell's state alone, so $(...) can run it in
+ * the shell process; the others get a forked child there, as a subshell would.
+*/
+typedef int (*BuiltinFn)(char** args);
+
+typedef struct {
+    const char* name;
+    BuiltinFn fn;
+    int pure;
+} Builtin;
+
+#define BUILTIN_NAME_MAX 16
+
+/**
+ * @brief The state of the test builtin's recursive-descent parse over its arguments.
+*/
+typedef struct {
+    char** args;
+    int pos;
+    int end;
+    int error;
+} TestParser;
+
+/**
+ * @brief The output of a $(...) being collected.
+ * @details Each pipeline's last stage writes to a pipe of its own, which the shell reads into buf
+ * while the pipeline runs. Once the memfd spill_fd exists, because output passed CAPTURE_SPILL or
+ * an in-process builtin needed somewhere to write, buf has been moved into it and all further
+ * output is appended there, so the output stays in order.
+*/
+typedef struct {
+    int spill_fd;
+    char* buf;
+    size_t len;
+    size_t cap;
+} Capture;
+
+#define CAPTURE_SPILL (1 << 20)
+
+//The innermost $(...) being run, or NULL
+Capture* capture = NULL;
+//How many $(...) have been run, so a command without a name can tell whether its words had one
+unsigned long captures_run = 0;
+
+/**
+ * @brief A <(...) or >(...) whose pipe end the shell holds until the command using it starts.
+*/
+typedef struct {
+    int fd;
+    pid_t pid;
+    char path[24];
+} ProcSub;
+
+//Open process substitutions, innermost line last
+ProcSub* procsubs = NULL;
+int nprocsubs = 0;
+int procsubs_cap = 0;
+
+//The shell's pid for $$, its process group, whether it owns the controlling terminal, and whether
+//pipelines get process groups of their own (interactive shells only, as in sh)
+pid_t shell_pid = 0;
+pid_t shell_pgid = 0;
+int shell_terminal = 0;
+int job_control = 0;
+
+//Command-line options: -e exits on the first failing command, -q skips the welcome banner
+int errexit = 0;
+int quiet = 0;
+const char* script_name = "seashell";
+char** script_args = NULL;
+int script_argc = 0;
+
 void welcomeMessage();
-void execCmd(char** parsed);
-void inputRedirection(char** parsed, int input_file_pos);
-void outputRedirection(char** parsed, int output_file_pos, int append);
-void pipeCommands(char** parsed, int background, int output_redirection, int append, int input_redirection, int output_file_pos, int input_file_pos, int piped_cmd_pos);
+void openInputFile(InputSource* in, const char* path);
+void openInputFd(InputSource* in, int fd, int interactive);
+void openInputString(InputSource* in, const char* text);
+char* readInputLine(InputSource* in, const char* prompt, size_t* len);
+ssize_t editLine(const char* prompt, char** buf, size_t* cap);
+int openHistory();
+int reopenHistory();
+void mapHistory();
+void historyAdd(const char* line, size_t len);
+size_t encodeHistory(const char* text, size_t len, char* out);
+char* historyEntry(size_t start, size_t* len);
+long historyPrevious(size_t before);
+size_t historyEntryEnd(size_t start);
+size_t historyCount();
+long historySearch(const char* query, size_t before);
+int compactHistory(size_t keep, int wait);
+void compactHistoryAtExit();
+int historyBuiltin(char** args);
+void sigwinchHandler(int sig);
+size_t editorWidth(const char* text, size_t len);
+void editorOut(LineEditor* e, const char* text, size_t len);
+void editorFlush(LineEditor* e);
+void editorOutText(LineEditor* e, const char* text, size_t len);
+void editorMoveTo(LineEditor* e, size_t column);
+void editorDrawFrom(LineEditor* e, size_t from);
+void editorRefresh(LineEditor* e);
+void editorSetLine(LineEditor* e, const char* text, size_t len);
+void editorInsert(LineEditor* e, const char* text, size_t len);
+void editorDelete(LineEditor* e, size_t start, size_t end);
+void editorSetPos(LineEditor* e, size_t pos);
+size_t editorStep(LineEditor* e, size_t pos, int dir);
+size_t editorWord(LineEditor* e, int dir);
+int editorReadByte(int timeout_ms);
+int editorReadEscape();
+void editorPaste(LineEditor* e);
+int editorSearch(LineEditor* e);
+void editorComplete(LineEditor* e);
+size_t completeWord(const char* word, size_t len, int command, char*** matches);
+int compareStrings(const void* a, const void* b);
+void runLine(const char* line, size_t len);
+int exitBuiltin(char** args);
+Builtin* findBuiltin(const char* name);
+int runBuiltin(Builtin* builtin, char** argv, RedirPlan* plan);
+int redirectShell(RedirPlan* plan, SavedFds* saved);
+int restoreShell(SavedFds* saved);
+int cdBuiltin(char** args);
+int pwdBuiltin(char** args);
+int echoBuiltin(char** args);
+int printfBuiltin(char** args);
+int printEscaped(const char* text, size_t len, int octal_needs_zero);
+int trueBuiltin(char** args);
+int falseBuiltin(char** args);
+int testBuiltin(char** args);
+int testOr(TestParser* t);
+int testAnd(TestParser* t);
+int testNot(TestParser* t);
+int testPrimary(TestParser* t);
+int breakBuiltin(char** args);
+int returnBuiltin(char** args);
+int exportBuiltin(char** args);
+int unsetBuiltin(char** args);
+void importEnvironment();
+Variable* findVar(const char* name, size_t name_len);
+const char* getVar(const char* name);
+void setVar(const char* name, size_t name_len, const char* value, int flags);
+void retireEntry(Variable* var);
+void unsetVar(const char* name);
+size_t isAssignment(const char* word);
+void assignVariable(const char* word, int flags);
+char** saveVariables(char** assigns);
+void restoreVariables(char** assigns, char** saved);
+char** currentEnv();
+char** overlayEnv(char** assigns, EnvOverlay* overlay);
+void restoreEnv(EnvOverlay* overlay);
+const char* expandParameter(const char* text, const char** end);
+int parallelBuiltin(char** args);
+char** parallelArgv(char** template, const char* item);
+void flushParallelOutput(int fd);
+void* arenaAlloc(Arena* arena, size_t size);
+void arenaReset(Arena* arena);
+char* arenaCopy(Arena* arena, const char* text, size_t len);
+ArenaMark arenaMark(Arena* arena);
+void arenaRelease(Arena* arena, ArenaMark mark);
+size_t tokenizeLine(Arena* arena, const char* text, size_t len, Token** tokens);
+size_t scanHereDoc(Arena* arena, const char* text, size_t i, size_t len, Token* body);
+size_t skipQuoted(const char* text, size_t i, size_t len);
+size_t skipParens(const char* text, size_t i, size_t len);
+char** expandWord(char** words, size_t* count, size_t* cap, const char* text, int mode);
+char* expandString(const char* text, int mode);
+void fieldAppend(Field* f, const char* text, size_t len, int quoted);
+char** fieldExpansion(char** words, size_t* count, size_t* cap, Field* f, const char* value, size_t len, int quoted);
+char** finishField(char** words, size_t* count, size_t* cap, Field* f);
+void unescapeWord(char* word);
+char** appendWord(char** words, size_t* count, size_t* cap, char* word);
+int hasGlob(const char* word, size_t len);
+size_t expandGlob(const char* pattern, char*** matches);
+void globWalk(GlobState* st, size_t path_len, const char* rest, int exists);
+size_t globAppend(GlobState* st, size_t path_len, const char* text, size_t len);
+GlobDir* globListing(const char* path);
+int globIsDir(GlobDir* dir, size_t i, int follow);
+int globMatch(const char* pattern, size_t len, const char* name);
+void sortWords(char** words, size_t count, size_t depth);
+void clearGlobCache();
+char* captureCommand(const char* text, size_t len, size_t* out_len);
+void drainCapture(Capture* c, int fd);
+int spillCapture(Capture* c);
+char* processSubstitution(const char* text, size_t len, int writer);
+void closeProcSubs(int mark);
+void keepProcSubFds(RedirPlan* plan, char** argv);
+void sigchldHandler(int sig);
+void reapChildren();
+Node* parseTokens(Arena* arena, char* text, Token* tokens, size_t ntokens, int* status);
+Node* parseList(Parser* p);
+Node* parseAndOr(Parser* p);
+Node* parsePipeline(Parser* p);
+Node* parseCommand(Parser* p);
+Node* parseBody(Parser* p, const char* end);
+Node* parseIf(Parser* p);
+Node* parseLoop(Parser* p);
+Node* parseFor(Parser* p);
+Node* parseCase(Parser* p);
+Node* parseFunction(Parser* p);
+int parseRedirectionTarget(Parser* p);
+int parseReserved(Parser* p, const char* word);
+int parseName(Parser* p);
+int parseExpect(Parser* p, const char* word);
+int parseListEnd(Parser* p);
+void parseNewlines(Parser* p);
+void parseError(Parser* p);
+Node* parseNode(Parser* p, int type, Node* left, Node* right);
+void runTree(char* text, Node* tree);
+Program* compileProgram(Arena* arena, char* text, Node* tree);
+int compileEmit(Compiler* c, int op, int flags, Token* tokens, size_t ntokens, const void* data);
+void compileNode(Compiler* c, Node* node, int flags, int exempt);
+void compileCommand(Compiler* c, Node* node, int flags, int instr_flags);
+void compileSpawn(Compiler* c, Node* node, int instr_flags);
+void compileBlock(Compiler* c, Node* node);
+void compileCompound(Compiler* c, Node* node, int exempt);
+void runProgram(Program* prog, int start, int end);
+int defineFunction(const char* name, size_t name_len, const char* body, size_t body_len);
+Function* findFunction(const char* name);
+void freeFunction(Function* fn);
+int callFunction(Function* fn, char** argv);
+int runFunction(Function* fn, char** argv, RedirPlan* plan);
+void runCompound(Node* node);
+pid_t forkNode(Node* node, RedirPlan* plan, pid_t pgid);
+void execCmd(char* text, Token* tokens, size_t ntokens, int background);
+int buildStage(PipelineStage* stage, char* text, Token* tokens, size_t ntokens);
+char** expandToken(char** words, size_t* count, size_t* cap, char* text, Token* t);
+char* tokensText(char* text, Token* tokens, size_t ntokens, int background);
+int tokensOpen(const char* word, size_t len);
+void initRedirPlan(RedirPlan* plan);
+void addRedirAction(RedirPlan* plan, int type, int fd, int src_fd, int flags, const char* path);
+int parseRedirection(RedirPlan* plan, int fd, int type, const char* target);
+int hereDocFd(const char* text, const Token* body, int strip_tabs);
+size_t stripTabs(char* out, const char* in, size_t len, int* line_start);
+int hereStringFd(const char* word);
+int sealedMemfd(const char* name, int fd);
+void releaseRedirPlan(RedirPlan* plan);
+int redirSourcesVisible(RedirPlan* plan);
+void reportRedirError(RedirPlan* plan);
+void runPipeline(PipelineStage* stages, int nstages, int background, int timed, const char* cmdline);
+Job* addJob(PipelineStage* stages, int nstages, pid_t pgid, const char* cmdline);
+void removeJob(Job* job);
+void freeJob(Job* job);
+Job* findJob(const char* spec, const char* builtin);
+Job* currentJob(int which);
+void signalJob(Job* job, int sig);
+void updateJob(pid_t pid, int status, struct rusage* usage);
+void waitForJob(Job* job);
+void foregroundJob(Job* job, int resume);
+int jobExitCode(Job* job);
+void printJob(Job* job, int show_pids);
+void notifyJobs();
+void recordJobUsage(Job* job);
+void usageFromRusage(ResourceUsage* out, const struct rusage* usage);
+void addUsage(ResourceUsage* total, const ResourceUsage* usage);
+void printUsage(FILE* out, const ResourceUsage* usage, const char* label, int header);
+void printJobUsage(FILE* out, Job* job);
+void reportBuiltinTime(const char* name, const struct rusage* before, const struct timespec* started);
+int metricsBuiltin(char** args);
+int jobsBuiltin(char** args);
+int fgBuiltin(char** args);
+int bgBuiltin(char** args);
+int waitBuiltin(char** args);
+int killBuiltin(char** args);
+int waitStatusToCode(int status);
+long pipeCapacityFor(const char* producer);
+void tunePipe(int fd, long capacity);
+void adaptPipeCapacity(PipelineStage* stages, int nstages, double seconds);
+PipeHint* findPipeHint(const char* producer, int create);
+long readPipeMax();
+ssize_t relayFd(int in_fd, int out_fd);
+int pipesizeBuiltin(char** args);
+pid_t spawnCmd(char** argv, char** assigns, RedirPlan* plan, pid_t pgid);
+pid_t posixSpawnCmd(char** argv, char** assigns, RedirPlan* plan, pid_t pgid);
+pid_t forkCmd(char** argv, char** assigns, RedirPlan* plan, pid_t pgid);
+char** scriptArgv(const char* path, char** argv);
+unsigned int hashName(const char* name, size_t len);
+const char* lookupCommand(const char* name);
+void revalidatePathCache();
+void loadPathDirs(const char* path_value);
+void clearPathCache();
+void forgetCommand(const char* name);
+void startCommandIndex(const char* path_value);
+void* buildCommandIndex(void* arg);
+int compareIndexEntries(const void* a, const void* b, void* strings);
+void addIndexEntry(CommandIndex* index, size_t at, const char* name, int dir);
+size_t findIndexEntry(CommandIndex* index, const char* name);
+CommandIndex* commandIndex(int wait);
+void refreshIndexEntry(CommandIndex* index, const char* name);
+void freeCommandIndex(CommandIndex* index);
+int hashBuiltin(char** args);
+int applyRedirAction(const RedirAction* action);
+int applyRedirPlan(RedirPlan* plan);
+
+//Every builtin, sorted by name length so findBuiltin() only compares names of the right length
+Builtin builtins[] = {
+    { ":", trueBuiltin, 1 },
+    { "[", testBuiltin, 1 },
+    { "bg", bgBuiltin, 0 },
+    { "cd", cdBuiltin, 0 },
+    { "fg", fgBuiltin, 0 },
+    { "pwd", pwdBuiltin, 1 },
+    { "echo", echoBuiltin, 1 },
+    { "exit", exitBuiltin, 0 },
+    { "hash", hashBuiltin, 0 },
+    { "jobs", jobsBuiltin, 0 },
+    { "kill", killBuiltin, 0 },
+    { "test", testBuiltin, 1 },
+    { "true", trueBuiltin, 1 },
+    { "wait", waitBuiltin, 0 },
+    { "break", breakBuiltin, 0 },
+    { "false", falseBuiltin, 1 },
+    { "unset", unsetBuiltin, 0 },
+    { "export", exportBuiltin, 0 },
+    { "printf", printfBuiltin, 1 },
+    { "return", returnBuiltin, 0 },
+    { "history", historyBuiltin, 0 },
+    { "metrics", metricsBuiltin, 0 },
+    { "continue", breakBuiltin, 0 },
+    { "pipesize", pipesizeBuiltin, 0 },
+    { "parallel", parallelBuiltin, 0 },
+};
+
+#define BUILTIN_COUNT (int)(sizeof(builtins) / sizeof(builtins[0]))
 
 
 /**
  * @brief Main function for the SeaShell program.
- * @return 0 on success, 1 on failure.
+ * @return The exit status of the last command run.
  * @param argc The number of command-line arguments.
  * @param argv The array of command-line arguments.
- * @details Entry point of the Seashell program. Prints the welcome banner,
- * then enters an infinite loop to read user input, parse it into tokens,
- * and execute commands accordingly.
+ * @details Entry point of the Seashell program. With no arguments and a terminal on stdin, prints
+ * the welcome banner and prompts for commands. "seashell script [args]" runs a script file,
+ * "seashell -c command [name [args]]" runs a command string, and input piped into stdin is run
+ * the same way; none of these print the banner or prompt. "-e" stops at the first command that
+ * fails and "-q" leaves out the banner.
  */
 int main(int argc, char* argv[]) {
-    welcomeMessage();
+    InputSource input;
+    int argi = 1;
+    const char* command_string = NULL;
+
+    for (; argi < argc && argv[argi][0] == '-' && argv[argi][1] != '\0'; argi++) {
+        if (strcmp(argv[argi], "--") == 0) {
+            argi++;
+            break;
+        }
+        for (const char* opt = argv[argi] + 1; *opt; opt++) {
+            if (*opt == 'e') {
+                errexit = 1;
+            }
+            else if (*opt == 'q') {
+                quiet = 1;
+            }
+            else if (*opt == 'c' && argi + 1 < argc) {
+                command_string = argv[++argi];
+            }
+            else {
+                fprintf(stderr, "Usage: %s [-eq] [-c command [name [args...]] | script [args...]]\n", argv[0]);
+                return 2;
+            }
+        }
+    }
+
+    shell_pid = getpid();
+    script_name = argv[0];
+    if (command_string != NULL) {
+        openInputString(&input, command_string);
+        if (argi < argc) {
+            script_name = argv[argi++];
+        }
+    }
+    else if (argi < argc) {
+        script_name = argv[argi++];
+        openInputFile(&input, script_name);
+    }
+    else {
+        openInputFd(&input, STDIN_FILENO, isatty(STDIN_FILENO));
+    }
+    script_args = &argv[argi];
+    script_argc = argc - argi;
+    current_input = &input;
+
+    const char* mode = getVar("SEASHELL_SPAWN");
+    if (mode != NULL && strcmp(mode, "fork") == 0) {
+        spawn_mode = SPAWN_FORK;
+    }
+
+    //Interactive pipelines run in their own process groups, so take the terminal back without being stopped
+    shell_pgid = getpgrp();
+    shell_terminal = isatty(STDIN_FILENO) && tcgetpgrp(STDIN_FILENO) == shell_pgid;
+    job_control = input.interactive && shell_terminal;
+    if (job_control) {
+        signal(SIGTTOU, SIG_IGN);
+        tcgetattr(STDIN_FILENO, &shell_tmodes);
+    }
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = sigchldHandler;
+    sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGCHLD, &sa, NULL);
+
+    if (input.interactive) {
+        const char* term = getVar("TERM");
+        line_editor = isatty(STDOUT_FILENO) && term != NULL && strcmp(term, "dumb") != 0;
+        if (line_editor) {
+            //Starts indexing PATH for completion in the background
+            commandIndex(0);
+        }
+        if (!quiet) {
+            welcomeMessage();
+        }
+    }
+
     while (1) {
-        char command[100];
-        char* args[15];
-        int should_run = 1;
-        int n = 10 * sizeof(int);
-        printf("\nSeaShell> ");
-        fflush(stdout);
+        reapChildren();
+        if (input.interactive) {
+            notifyJobs();
+        }
+        arenaReset(&line_arena);
+        clearGlobCache();
+
+        size_t len;
+        char* line = readInputLine(&input, "\nSeaShell> ", &len);
+        if (line == NULL) {
+            break;
+        }
+
+        runLine(line, len);
+        reapChildren();
+
+        if (errexit && last_status != 0 && !errexit_exempt) {
+            break;
+        }
+    }
+    return last_status;
+}
 
-        if (!fgets(command, sizeof(command), stdin)) {
+/**
+ * @brief Tokenizes and parses one command line and runs it.
+ * @param line The line, without its newline; it does not need to be NUL-terminated.
+ * @param len The length of the line.
+ * @details A quote or backslash left open at the end of the line continues on the next line of
+ * input, as in sh, and so does a list that is not finished yet: after && or |, or inside ( ) or
+ * { }, or inside an if, loop, case or here-document. Everything allocated for the line, syntax
+ * tree and bytecode included, comes from line_arena, which the caller resets. The text grows
+ * by doubling, and the lines of a here-document's body are only collected until its delimiter
+ * line, so a long body is not tokenized again for every line.
+*/
+void runLine(const char* line, size_t len) {
+    //Tokenize the input into views of an arena copy of the line
+    char* text = arenaCopy(&line_arena, line, len);
+    size_t cap = len + 1;
+    Token* tokens;
+    size_t ntokens;
+    Node* tree = NULL;
+    int status = PARSE_INCOMPLETE;
+    while (status == PARSE_INCOMPLETE) {
+        ntokens = tokenizeLine(&line_arena, text, len, &tokens);
+        if (ntokens == TOKENS_ERROR) {
+            status = PARSE_ERROR;
             break;
         }
+        if (ntokens != TOKENS_INCOMPLETE) {
+            tree = parseTokens(&line_arena, text, tokens, ntokens, &status);
+            if (status != PARSE_INCOMPLETE) {
+                break;
+            }
+        }
+
+        int body = ntokens == TOKENS_INCOMPLETE && open_heredoc != NULL;
+        while (1) {
+            size_t more_len;
+            char* more = current_input != NULL ? readInputLine(current_input, "> ", &more_len) : NULL;
+            if (more == NULL) {
+                fprintf(stderr, "Error: unexpected end of input: %s\n", ntokens == TOKENS_INCOMPLETE ? "unterminated quote or here-document" : "unterminated command");
+                last_status = 2;
+                return;
+            }
+            if (len + more_len + 2 > cap) {
+                cap = (len + more_len + 2) * 2;
+                char* grown = arenaAlloc(&line_arena, cap);
+                memcpy(grown, text, len);
+                text = grown;
+            }
+            text[len] = '\n';
+            memcpy(text + len + 1, more, more_len);
+            len += more_len + 1;
+            text[len] = '\0';
+
+            //Until the delimiter line, the line only adds to the body
+            const char* rest = more;
+            while (open_heredoc_strip && rest < more + more_len && *rest == '\t') {
+                rest++;
+            }
+            if (!body || ((size_t)(more + more_len - rest) == open_heredoc_len && memcmp(rest, open_heredoc, open_heredoc_len) == 0)) {
+                break;
+            }
+        }
+    }
+
+    if (status == PARSE_ERROR) {
+        last_status = 2;
+        errexit_exempt = 0;
+    }
+    else if (tree != NULL) {
+        runTree(text, tree);
+        fflush(stdout);
+    }
+}
+
+/**
+ * @brief Implements the exit builtin.
+ * @param args The command-line arguments; args[1] is the optional exit status, which defaults to
+ * the status of the last command.
+ * @return Never returns.
+*/
+int exitBuiltin(char** args) {
+    int code = last_status;
+    fflush(stdout);
+    if (args[1] != NULL) {
+        char* end;
+        code = (int)strtol(args[1], &end, 10);
+        if (*end != '\0') {
+            fprintf(stderr, "exit: %s: numeric argument required\n", args[1]);
+            code = 2;
+        }
+    }
+    exit(code & 0xff);
+}
+
+/**
+ * @brief Finds the builtin with the given name.
+ * @param name The command name.
+ * @return The builtin, or NULL if the name is not a builtin.
+ * @details The table is sorted by name length and builtin_by_length maps each length to its
+ * first entry, so a lookup is a length switch plus a compare against at most a few names.
+*/
+Builtin* findBuiltin(const char* name) {
+    static int builtin_by_length[BUILTIN_NAME_MAX + 2];
+    static int indexed = 0;
+
+    if (!indexed) {
+        int i = 0;
+        for (int len = 0; len <= BUILTIN_NAME_MAX + 1; len++) {
+            while (i < BUILTIN_COUNT && (int)strlen(builtins[i].name) < len) {
+                i++;
+            }
+            builtin_by_length[len] = i;
+        }
+        indexed = 1;
+    }
+
+    size_t len = strnlen(name, BUILTIN_NAME_MAX + 1);
+    if (len == 0 || len > BUILTIN_NAME_MAX) {
+        return NULL;
+    }
+    for (int i = builtin_by_length[len]; i < builtin_by_length[len + 1]; i++) {
+        if (builtins[i].name[0] == name[0] && memcmp(builtins[i].name, name, len) == 0) {
+            return &builtins[i];
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Runs a builtin inside the shell with its redirections applied.
+ * @param builtin The builtin to run.
+ * @param argv The builtin's arguments.
+ * @param plan The redirections; every fd they touch is saved, redirected, and restored afterwards,
+ * including fds that were closed before. A stdout_fd, set for $(...), is connected first.
+ * @return The builtin's exit status, or 1 if a redirection could not be applied.
+*/
+int runBuiltin(Builtin* builtin, char** argv, RedirPlan* plan) {
+    SavedFds saved;
+    int status = 1;
+
+    if (redirectShell(plan, &saved) == 0) {
+        status = builtin->fn(argv);
+    }
+    if (restoreShell(&saved) != 0) {
+        status = status ? status : 1;
+    }
+    return status;
+}
+
+/**
+ * @brief Applies a redirection plan to the shell's own fds, keeping copies to restore.
+ * @param plan The plan.
+ * @param saved Set to the copies, parked above any fd the plan names. It must be handed to
+ * restoreShell() whether or not the plan could be applied.
+ * @return 0, or -1 if a redirection failed, which has been reported.
+*/
+int redirectShell(RedirPlan* plan, SavedFds* saved) {
+    int base = 10;
+    int i;
+
+    saved->fds = arenaAlloc(&line_arena, sizeof(*saved->fds) * (plan->nactions + 2));
+    saved->count = 0;
+    base = plan->stdout_fd >= base ? plan->stdout_fd + 1 : base;
+    for (i = 0; i < plan->nactions; i++) {
+        base = plan->actions[i].fd >= base ? plan->actions[i].fd + 1 : base;
+        base = plan->actions[i].src_fd >= base ? plan->actions[i].src_fd + 1 : base;
+    }
+
+    fflush(stdout);
+    fflush(stderr);
+    if (plan->stdout_fd >= 0) {
+        saved->fds[0].fd = STDOUT_FILENO;
+        saved->fds[0].flags = fcntl(STDOUT_FILENO, F_GETFD);
+        saved->fds[0].copy = saved->fds[0].flags >= 0 ? fcntl(STDOUT_FILENO, F_DUPFD_CLOEXEC, base) : -1;
+        saved->count++;
+        dup2(plan->stdout_fd, STDOUT_FILENO);
+    }
+    for (i = 0; i < plan->nactions; i++) {
+        int fd = plan->actions[i].fd;
+        int known = 0;
+        for (int s = 0; s < saved->count; s++) {
+            known |= saved->fds[s].fd == fd;
+        }
+        if (!known) {
+            int n = saved->count++;
+            saved->fds[n].fd = fd;
+            saved->fds[n].flags = fcntl(fd, F_GETFD);
+            saved->fds[n].copy = saved->fds[n].flags >= 0 ? fcntl(fd, F_DUPFD_CLOEXEC, base) : -1;
+        }
+        if (applyRedirAction(&plan->actions[i]) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Puts back the fds redirectShell() changed.
+ * @param saved The copies it kept.
+ * @return 0, or 1 if output written meanwhile could not be flushed.
+*/
+int restoreShell(SavedFds* saved) {
+    int failed = 0;
+
+    //Output that could not be written (to a closed fd, say) must not leak out after the restore
+    if (fflush(stdout) != 0) {
+        perror("Error: write");
+        __fpurge(stdout);
+        clearerr(stdout);
+        failed = 1;
+    }
+    fflush(stderr);
+    for (int s = saved->count - 1; s >= 0; s--) {
+        if (saved->fds[s].copy >= 0) {
+            dup3(saved->fds[s].copy, saved->fds[s].fd, (saved->fds[s].flags & FD_CLOEXEC) ? O_CLOEXEC : 0);
+            close(saved->fds[s].copy);
+        }
+        else {
+            close(saved->fds[s].fd);
+        }
+    }
+    saved->count = 0;
+    return failed;
+}
+
+/**
+ * @brief Implements the cd builtin.
+ * @param args The command-line arguments; args[1] is the directory, "~" or nothing for HOME,
+ * and "-" for the previous directory.
+ * @return The exit status of the builtin.
+ * @details Keeps PWD and OLDPWD up to date in the environment.
+*/
+int cdBuiltin(char** args) {
+    const char* target = args[1];
+    int to_home = target == NULL || strcmp(target, "~") == 0;
+
+    if (to_home) {
+        target = getVar("HOME");
+        if (target == NULL) {
+            fprintf(stderr, "cd: HOME not set\n");
+            return 1;
+        }
+    }
+    else if (strcmp(target, "-") == 0) {
+        target = getVar("OLDPWD");
+        if (target == NULL) {
+            fprintf(stderr, "cd: OLDPWD not set\n");
+            return 1;
+        }
+        printf("%s\n", target);
+    }
+
+    char* previous = getcwd(NULL, 0);
+    if (chdir(target) != 0) {
+        perror(to_home ? "Error: Failed to change directory to home" : "Error: Failed to change directory");
+        free(previous);
+        return 1;
+    }
+    if (args[1] != NULL && to_home) {
+        printf("Changed directory to home.\n");
+    }
+
+    char* current = getcwd(NULL, 0);
+    if (previous != NULL) {
+        setVar("OLDPWD", 6, previous, VAR_EXPORT);
+    }
+    if (current != NULL) {
+        setVar("PWD", 3, current, VAR_EXPORT);
+    }
+    free(previous);
+    free(current);
+    return 0;
+}
+
+/**
+ * @brief Implements the pwd builtin.
+ * @param args The command-line arguments (unused).
+ * @return The exit status of the builtin.
+*/
+int pwdBuiltin(char** args) {
+    (void)args;
+    char* cwd = getcwd(NULL, 0);
+    if (cwd == NULL) {
+        perror("pwd");
+        return 1;
+    }
+    printf("%s\n", cwd);
+    free(cwd);
+    return 0;
+}
+
+/**
+ * @brief Implements the echo builtin.
+ * @param args The command-line arguments. Leading -n, -e and -E options, alone or combined as
+ * in -ne, suppress the newline and turn backslash escapes on or off.
+ * @return The exit status of the builtin.
+*/
+int echoBuiltin(char** args) {
+    int newline = 1;
+    int escapes = 0;
+    int i = 1;
+
+    for (; args[i] != NULL && args[i][0] == '-' && args[i][1] != '\0'; i++) {
+        if (strspn(args[i] + 1, "neE") != strlen(args[i] + 1)) {
+            break;
+        }
+        for (const char* opt = args[i] + 1; *opt; opt++) {
+            if (*opt == 'n') {
+                newline = 0;
+            }
+            else {
+                escapes = *opt == 'e';
+            }
+        }
+    }
+
+    for (; args[i] != NULL; i++) {
+        if (escapes) {
+            if (printEscaped(args[i], strlen(args[i]), 1)) {
+                return 0;
+            }
+        }
+        else {
+            fputs(args[i], stdout);
+        }
+        if (args[i + 1] != NULL) {
+            putchar(' ');
+        }
+    }
+    if (newline) {
+        putchar('\n');
+    }
+    return 0;
+}
+
+/**
+ * @brief Writes text to stdout, interpreting backslash escapes.
+ * @param text The text.
+ * @param len The number of bytes of text to process.
+ * @param octal_needs_zero Whether octal escapes are written \0nnn, as in echo and %b, rather than
+ * \nnn as in a printf format.
+ * @return 1 if a \c escape asked for all further output to be suppressed, otherwise 0.
+*/
+int printEscaped(const char* text, size_t len, int octal_needs_zero) {
+    for (size_t i = 0; i < len; i++) {
+        if (text[i] != '\\' || i + 1 == len) {
+            putchar(text[i]);
+            continue;
+        }
+
+        char c = text[++i];
+        switch (c) {
+        case 'a': putchar('\a'); break;
+        case 'b': putchar('\b'); break;
+        case 'c': return 1;
+        case 'e': putchar('\033'); break;
+        case 'f': putchar('\f'); break;
+        case 'n': putchar('\n'); break;
+        case 'r': putchar('\r'); break;
+        case 't': putchar('\t'); break;
+        case 'v': putchar('\v'); break;
+        case '\\': putchar('\\'); break;
+        case 'x': {
+            int value = 0;
+            int digits = 0;
+            while (digits < 2 && i + 1 < len && isxdigit((unsigned char)text[i + 1])) {
+                char h = text[++i];
+                value = value * 16 + (isdigit((unsigned char)h) ? h - '0' : tolower((unsigned char)h) - 'a' + 10);
+                digits++;
+            }
+            if (digits == 0) {
+                fputs("\\x", stdout);
+            }
+            else {
+                putchar(value);
+            }
+            break;
+        }
+        default:
+            if (c >= '0' && c <= '7' && (c == '0' || !octal_needs_zero)) {
+                int value = octal_needs_zero ? 0 : c - '0';
+                int max = octal_needs_zero ? 3 : 2;
+                for (int digits = 0; digits < max && i + 1 < len && text[i + 1] >= '0' && text[i + 1] <= '7'; digits++) {
+                    value = value * 8 + (text[++i] - '0');
+                }
+                putchar(value & 0xff);
+            }
+            else {
+                putchar('\\');
+                putchar(c);
+            }
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Parses a printf numeric argument, accepting a leading quote for a character's code.
+ * @param value The argument, or NULL when the arguments have run out.
+ * @param is_signed Whether to parse with strtoll rather than strtoull.
+ * @param ok Cleared if the argument is not entirely a number.
+ * @return The value, as the bits of a long long.
+*/
+static long long printfNumber(const char* value, int is_signed, int* ok) {
+    char* end;
+    long long number;
+
+    if (value == NULL || value[0] == '\0') {
+        return 0;
+    }
+    if (value[0] == '\'' || value[0] == '"') {
+        return (unsigned char)value[1];
+    }
+    number = is_signed ? strtoll(value, &end, 0) : (long long)strtoull(value, &end, 0);
+    if (*end != '\0') {
+        fprintf(stderr, "printf: %s: invalid number\n", value);
+        *ok = 0;
+    }
+    return number;
+}
+
+/**
+ * @brief Implements the printf builtin.
+ * @param args The command-line arguments: format [arguments...].
+ * @return 0, 1 if an argument was not a valid number, or 2 on a usage error.
+ * @details Supports the %s, %b, %c, %d, %i, %u, %o, %x, %X, %e, %E, %f, %F, %g, %G and %%
+ * conversions with flags, width and precision (including *). The format is reused until every
+ * argument has been consumed, as POSIX requires.
+*/
+int printfBuiltin(char** args) {
+    if (args[1] == NULL) {
+        fprintf(stderr, "printf: usage: printf format [arguments]\n");
+        return 2;
+    }
+
+    const char* format = args[1];
+    char** arg = &args[2];
+    int ok = 1;
+
+    do {
+        char** pass_start = arg;
+        for (const char* f = format; *f; f++) {
+            if (*f == '\\') {
+                //Find the end of the escape so printEscaped() sees exactly one
+                const char* end = f + 1;
+                if (*end >= '0' && *end <= '7') {
+                    while (end < f + 4 && *end >= '0' && *end <= '7') {
+                        end++;
+                    }
+                }
+                else if (*end == 'x') {
+                    end++;
+                    while (end < f + 4 && isxdigit((unsigned char)*end)) {
+                        end++;
+                    }
+                }
+                else if (*end != '\0') {
+                    end++;
+                }
+                if (printEscaped(f, end - f, 0)) {
+                    return !ok;
+                }
+                f = end - 1;
+                continue;
+            }
+            if (*f != '%') {
+                putchar(*f);
+                continue;
+            }
+            if (f[1] == '%') {
+                putchar('%');
+                f++;
+                continue;
+            }
+
+            //Rebuild the conversion as a C format, resolving * from the arguments
+            char spec[64];
+            int n = 0;
+            spec[n++] = '%';
+            f++;
+            while (*f != '\0' && strchr("-+ #0", *f) != NULL && n < 8) {
+                spec[n++] = *f++;
+            }
+            for (int part = 0; part < 2; part++) {
+                if (part == 1) {
+                    if (*f != '.') {
+                        break;
+                    }
+                    spec[n++] = *f++;
+                }
+                if (*f == '*') {
+                    n += snprintf(spec + n, 16, "%d", *arg != NULL ? atoi(*arg++) : 0);
+                    f++;
+                }
+                while (isdigit((unsigned char)*f) && n < 40) {
+                    spec[n++] = *f++;
+                }
+            }
+
+            char conv = *f;
+            if (conv == '\0') {
+                fprintf(stderr, "printf: missing conversion\n");
+                return 1;
+            }
+            const char* value = *arg != NULL ? *arg++ : NULL;
+
+            if (conv == 'd' || conv == 'i' || conv == 'u' || conv == 'o' || conv == 'x' || conv == 'X') {
+                long long number = printfNumber(value, conv == 'd' || conv == 'i', &ok);
+                spec[n++] = 'l';
+                spec[n++] = 'l';
+                spec[n++] = conv;
+                spec[n] = '\0';
+                printf(spec, number);
+            }
+            else if (strchr("eEfFgG", conv) != NULL) {
+                char* end = NULL;
+                double number = value != NULL ? strtod(value, &end) : 0;
+                if (end != NULL && *end != '\0') {
+                    fprintf(stderr, "printf: %s: invalid number\n", value);
+                    ok = 0;
+                }
+                spec[n++] = conv;
+                spec[n] = '\0';
+                printf(spec, number);
+            }
+            else if (conv == 'c') {
+                spec[n++] = 'c';
+                spec[n] = '\0';
+                printf(spec, value != NULL ? value[0] : '\0');
+            }
+            else if (conv == 'b') {
+                if (value != NULL && printEscaped(value, strlen(value), 1)) {
+                    return !ok;
+                }
+            }
+            else if (conv == 's') {
+                spec[n++] = 's';
+                spec[n] = '\0';
+                printf(spec, value != NULL ? value : "");
+            }
+            else {
+                fprintf(stderr, "printf: %%%c: invalid conversion\n", conv);
+                return 1;
+            }
+        }
+        //A format without conversions is printed once, whatever arguments are left
+        if (arg == pass_start) {
+            break;
+        }
+    } while (*arg != NULL);
+
+    return !ok;
+}
+
+/**
+ * @brief Implements the true and : builtins.
+ * @param args The command-line arguments (ignored).
+ * @return Always 0.
+*/
+int trueBuiltin(char** args) {
+    (void)args;
+    return 0;
+}
+
+/**
+ * @brief Implements the false builtin.
+ * @param args The command-line arguments (ignored).
+ * @return Always 1.
+*/
+int falseBuiltin(char** args) {
+    (void)args;
+    return 1;
+}
+
+/**
+ * @brief Implements the test and [ builtins.
+ * @param args The command-line arguments; [ needs a closing ] as its last one.
+ * @return 0 if the expression is true, 1 if it is false, and 2 on a syntax error.
+ * @details Understands !, -a, -o and parentheses, the string tests -n, -z, =, !=, < and >, the
+ * integer comparisons -eq, -ne, -lt, -le, -gt and -ge, and the file tests -e, -f, -d, -r, -w,
+ * -x, -s, -h, -L, -p, -S, -b, -c and -t. A lone word is true if it is not empty.
+*/
+int testBuiltin(char** args) {
+    int end = 0;
+    while (args[end] != NULL) {
+        end++;
+    }
+    if (strcmp(args[0], "[") == 0) {
+        if (strcmp(args[end - 1], "]") != 0) {
+            fprintf(stderr, "[: missing ']'\n");
+            return 2;
+        }
+        end--;
+    }
+
+    TestParser t = { args, 1, end, 0 };
+    if (t.pos == t.end) {
+        return 1;
+    }
+    int result = testOr(&t);
+    if (!t.error && t.pos < t.end) {
+        fprintf(stderr, "%s: %s: unexpected argument\n", args[0], args[t.pos]);
+        t.error = 1;
+    }
+    return t.error ? 2 : !result;
+}
+
+/**
+ * @brief Parses and evaluates expressions joined by -o.
+ * @param t The parse.
+ * @return 1 if true, otherwise 0; errors are reported and set t->error.
+*/
+int testOr(TestParser* t) {
+    int result = testAnd(t);
+    while (!t->error && t->pos < t->end && strcmp(t->args[t->pos], "-o") == 0) {
+        t->pos++;
+        int right = testAnd(t);
+        result = result || right;
+    }
+    return result;
+}
+
+/**
+ * @brief Parses and evaluates expressions joined by -a, which binds tighter than -o.
+*/
+int testAnd(TestParser* t) {
+    int result = testNot(t);
+    while (!t->error && t->pos < t->end && strcmp(t->args[t->pos], "-a") == 0) {
+        t->pos++;
+        int right = testNot(t);
+        result = result && right;
+    }
+    return result;
+}
+
+/**
+ * @brief Parses and evaluates an expression with any number of leading !.
+*/
+int testNot(TestParser* t) {
+    if (t->pos + 1 < t->end && strcmp(t->args[t->pos], "!") == 0) {
+        t->pos++;
+        return !testNot(t);
+    }
+    return testPrimary(t);
+}
+
+/**
+ * @brief Parses and evaluates a parenthesized expression, a unary or binary test, or a word.
+ * @details A binary operator in second place wins over a unary one in first, so "-n = -n"
+ * compares two strings.
+*/
+int testPrimary(TestParser* t) {
+    if (t->pos >= t->end) {
+        fprintf(stderr, "%s: argument expected\n", t->args[0]);
+        t->error = 1;
+        return 0;
+    }
+    const char* a = t->args[t->pos];
+
+    if (t->pos + 2 < t->end) {
+        static const char* binary[] = { "=", "!=", "<", ">", "-eq", "-ne", "-lt", "-le", "-gt", "-ge" };
+        const char* op = t->args[t->pos + 1];
+        for (int k = 0; k < (int)(sizeof(binary) / sizeof(binary[0])); k++) {
+            if (strcmp(op, binary[k]) != 0) {
+                continue;
+            }
+            const char* b = t->args[t->pos + 2];
+            t->pos += 3;
+            if (k < 4) {
+                int cmp = strcmp(a, b);
+                return k == 0 ? cmp == 0 : k == 1 ? cmp != 0 : k == 2 ? cmp < 0 : cmp > 0;
+            }
+            char* a_end;
+            char* b_end;
+            long long x = strtoll(a, &a_end, 10);
+            long long y = strtoll(b, &b_end, 10);
+            if (*a == '\0' || *a_end != '\0' || *b == '\0' || *b_end != '\0') {
+                fprintf(stderr, "%s: integer expression expected\n", t->args[0]);
+                t->error = 1;
+                return 0;
+            }
+            switch (k) {
+            case 4: return x == y;
+            case 5: return x != y;
+            case 6: return x < y;
+            case 7: return x <= y;
+            case 8: return x > y;
+            default: return x >= y;
+            }
+        }
+    }
+
+    if (strcmp(a, "(") == 0 && t->pos + 1 < t->end) {
+        t->pos++;
+        int result = testOr(t);
+        if (!t->error && (t->pos >= t->end || strcmp(t->args[t->pos], ")") != 0)) {
+            fprintf(stderr, "%s: missing ')'\n", t->args[0]);
+            t->error = 1;
+        }
+        t->pos++;
+        return result;
+    }
+
+    if (a[0] == '-' && a[1] != '\0' && a[2] == '\0' && t->pos + 1 < t->end && strchr("nzefdrwxshLpSbct", a[1]) != NULL) {
+        const char* b = t->args[t->pos + 1];
+        struct stat st;
+        t->pos += 2;
+        switch (a[1]) {
+        case 'n': return b[0] != '\0';
+        case 'z': return b[0] == '\0';
+        case 'r': return access(b, R_OK) == 0;
+        case 'w': return access(b, W_OK) == 0;
+        case 'x': return access(b, X_OK) == 0;
+        case 't': return isatty(atoi(b));
+        case 'h':
+        case 'L': return lstat(b, &st) == 0 && S_ISLNK(st.st_mode);
+        }
+        if (stat(b, &st) != 0) {
+            return 0;
+        }
+        switch (a[1]) {
+        case 'f': return S_ISREG(st.st_mode);
+        case 'd': return S_ISDIR(st.st_mode);
+        case 's': return st.st_size > 0;
+        case 'p': return S_ISFIFO(st.st_mode);
+        case 'S': return S_ISSOCK(st.st_mode);
+        case 'b': return S_ISBLK(st.st_mode);
+        case 'c': return S_ISCHR(st.st_mode);
+        default: return 1;
+        }
+    }
+
+    t->pos++;
+    return a[0] != '\0';
+}
+
+/**
+ * @brief Implements the break and continue builtins.
+ * @param args The command-line arguments; args[1] is how many enclosing loops to leave, 1 by
+ * default. A count past the outermost loop means the outermost loop.
+ * @return 0, or 1 outside a loop or on a bad count.
+ * @details Only sets unwind; runProgram() leaves or restarts the loop once the builtin returns.
+*/
+int breakBuiltin(char** args) {
+    long count = 1;
+    if (loop_depth == 0) {
+        fprintf(stderr, "%s: only meaningful in a loop\n", args[0]);
+        return 1;
+    }
+    if (args[1] != NULL) {
+        char* end;
+        count = strtol(args[1], &end, 10);
+        if (*args[1] == '\0' || *end != '\0' || count < 1) {
+            fprintf(stderr, "%s: %s: loop count out of range\n", args[0], args[1]);
+            return 1;
+        }
+    }
+    unwind = args[0][0] == 'b' ? UNWIND_BREAK : UNWIND_CONTINUE;
+    unwind_count = count < loop_depth ? (int)count : loop_depth;
+    return 0;
+}
+
+/**
+ * @brief Implements the return builtin.
+ * @param args The command-line arguments; args[1] is the status, which defaults to the status
+ * of the last command.
+ * @return The status, which becomes the function's, or 1 outside a function.
+*/
+int returnBuiltin(char** args) {
+    int code = last_status;
+    if (function_depth == 0) {
+        fprintf(stderr, "return: can only return from a function\n");
+        return 1;
+    }
+    if (args[1] != NULL) {
+        char* end;
+        code = (int)strtol(args[1], &end, 10);
+        if (*args[1] == '\0' || *end != '\0') {
+            fprintf(stderr, "return: %s: numeric argument required\n", args[1]);
+            code = 2;
+        }
+    }
+    unwind = UNWIND_RETURN;
+    return code & 0xff;
+}
+
+/**
+ * @brief Implements the export builtin.
+ * @param args The command-line arguments: NAME=value or NAME. With no names, or with -p, prints
+ * the environment in a form that can be read back.
+ * @return The exit status of the builtin.
+*/
+int exportBuiltin(char** args) {
+    int i = 1;
+    int result = 0;
+
+    if (args[i] != NULL && strcmp(args[i], "-p") == 0) {
+        i++;
+    }
+    if (args[i] == NULL) {
+        char** env = currentEnv();
+        size_t count = 0;
+        while (env[count] != NULL) {
+            count++;
+        }
+        char** sorted = arenaAlloc(&line_arena, sizeof(char*) * (count + 1));
+        memcpy(sorted, env, sizeof(char*) * count);
+        qsort(sorted, count, sizeof(char*), compareStrings);
+        for (size_t e = 0; e < count; e++) {
+            const char* eq = strchr(sorted[e], '=');
+            printf("export %.*s=\"%s\"\n", (int)(eq - sorted[e]), sorted[e], eq + 1);
+        }
+        return 0;
+    }
+
+    for (; args[i] != NULL; i++) {
+        size_t name_len = isAssignment(args[i]);
+        if (name_len > 0) {
+            assignVariable(args[i], VAR_EXPORT);
+            continue;
+        }
+        name_len = strlen(args[i]);
+        int valid = name_len > 0 && !isdigit((unsigned char)args[i][0]);
+        for (size_t c = 0; valid && c < name_len; c++) {
+            valid = isalnum((unsigned char)args[i][c]) || args[i][c] == '_';
+        }
+        if (!valid) {
+            fprintf(stderr, "export: %s: not a valid identifier\n", args[i]);
+            result = 1;
+            continue;
+        }
+        setVar(args[i], name_len, NULL, VAR_EXPORT);
+    }
+    return result;
+}
+
+/**
+ * @brief Implements the unset builtin.
+ * @param args The command-line arguments: [-v] NAME...
+ * @return The exit status of the builtin.
+*/
+int unsetBuiltin(char** args) {
+    int i = 1;
+    if (args[i] != NULL && strcmp(args[i], "-v") == 0) {
+        i++;
+    }
+    for (; args[i] != NULL; i++) {
+        unsetVar(args[i]);
+    }
+    return 0;
+}
+
+/**
+ * @brief Loads the environment the shell started with into the variable store, all exported.
+ * @details The entries are borrowed from environ rather than copied. When a name appears more
+ * than once the first one wins, as it does for getenv().
+*/
+void importEnvironment() {
+    size_t count = 0;
+    while (environ[count] != NULL) {
+        count++;
+    }
+    vars.nbuckets = 64;
+    while (vars.nbuckets < count) {
+        vars.nbuckets *= 2;
+    }
+    vars.buckets = calloc(vars.nbuckets, sizeof(Variable*));
+
+    for (size_t i = 0; i < count; i++) {
+        char* eq = strchr(environ[i], '=');
+        if (eq == NULL || eq == environ[i] || findVar(environ[i], eq - environ[i]) != NULL) {
+            continue;
+        }
+        unsigned int hash = hashName(environ[i], eq - environ[i]);
+        Variable* var = malloc(sizeof(Variable));
+        var->entry = environ[i];
+        var->name_len = eq - environ[i];
+        var->hash = hash;
+        var->flags = VAR_EXPORT | VAR_BORROWED;
+        var->env_slot = -1;
+        var->next = vars.buckets[hash & (vars.nbuckets - 1)];
+        vars.buckets[hash & (vars.nbuckets - 1)] = var;
+        vars.count++;
+    }
+    vars.generation = 1;
+}
+
+/**
+ * @brief Looks a variable up by name.
+ * @param name The name; it does not need to be NUL-terminated.
+ * @param name_len The length of the name.
+ * @return The variable, or NULL if it does not exist.
+*/
+Variable* findVar(const char* name, size_t name_len) {
+    if (vars.buckets == NULL) {
+        importEnvironment();
+    }
+    unsigned int hash = hashName(name, name_len);
+    for (Variable* var = vars.buckets[hash & (vars.nbuckets - 1)]; var != NULL; var = var->next) {
+        if (var->hash == hash && var->name_len == name_len && memcmp(var->entry, name, name_len) == 0) {
+            return var;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Returns the value of a variable.
+ * @param name The NUL-terminated name.
+ * @return The value, or NULL if the variable is not set. It stays valid until the variable is
+ * next set or unset.
+*/
+const char* getVar(const char* name) {
+    Variable* var = findVar(name, strlen(name));
+    if (var == NULL || (var->flags & VAR_UNSET)) {
+        return NULL;
+    }
+    return var->entry + var->name_len + 1;
+}
+
+/**
+ * @brief Sets a variable, creating it if needed.
+ * @param name The name; it does not need to be NUL-terminated.
+ * @param name_len The length of the name.
+ * @param value The new value, or NULL to only add flags (as "export NAME" does).
+ * @param flags Flags to add, such as VAR_EXPORT; existing flags are kept.
+ * @details The cached envp is only invalidated when the variable is, or becomes, exported.
+*/
+void setVar(const char* name, size_t name_len, const char* value, int flags) {
+    Variable* var = findVar(name, name_len);
+    if (var == NULL) {
+        if (vars.count >= vars.nbuckets) {
+            //Grow at a load factor of one, relinking the existing variables by their stored hash
+            size_t nbuckets = vars.nbuckets * 2;
+            Variable** buckets = calloc(nbuckets, sizeof(Variable*));
+            for (size_t b = 0; b < vars.nbuckets; b++) {
+                Variable* next;
+                for (Variable* v = vars.buckets[b]; v != NULL; v = next) {
+                    next = v->next;
+                    v->next = buckets[v->hash & (nbuckets - 1)];
+                    buckets[v->hash & (nbuckets - 1)] = v;
+                }
+            }
+            free(vars.buckets);
+            vars.buckets = buckets;
+            vars.nbuckets = nbuckets;
+        }
+        unsigned int hash = hashName(name, name_len);
+        var = malloc(sizeof(Variable));
+        var->entry = NULL;
+        var->name_len = name_len;
+        var->hash = hash;
+        var->flags = VAR_UNSET;
+        var->env_slot = -1;
+        var->next = vars.buckets[hash & (vars.nbuckets - 1)];
+        vars.buckets[hash & (vars.nbuckets - 1)] = var;
+        vars.count++;
+        if (value == NULL) {
+            var->entry = malloc(name_len + 2);
+            memcpy(var->entry, name, name_len);
+            var->entry[name_len] = '=';
+            var->entry[name_len + 1] = '\0';
+        }
+    }
+
+    if ((flags & ~var->flags) & VAR_EXPORT) {
+        vars.generation++;
+    }
+    var->flags |= flags;
+    if (value == NULL) {
+        return;
+    }
+
+    size_t value_len = strlen(value);
+    char* entry = malloc(name_len + value_len + 2);
+    memcpy(entry, name, name_len);
+    entry[name_len] = '=';
+    memcpy(entry + name_len + 1, value, value_len + 1);
+    retireEntry(var);
+    var->entry = entry;
+    var->flags &= ~(VAR_UNSET | VAR_BORROWED);
+    if (var->flags & VAR_EXPORT) {
+        vars.generation++;
+    }
+}
+
+/**
+ * @brief Lets go of a variable's entry before it is replaced or removed.
+ * @param var The variable.
+ * @details An exported entry may be in the current envp, so it is only freed once that has been
+ * rebuilt.
+*/
+void retireEntry(Variable* var) {
+    if (var->entry == NULL || (var->flags & VAR_BORROWED)) {
+        return;
+    }
+    if (var->env_slot < 0) {
+        free(var->entry);
+        return;
+    }
+    if (vars.nretired == vars.retired_cap) {
+        vars.retired_cap = vars.retired_cap ? vars.retired_cap * 2 : 16;
+        vars.retired = realloc(vars.retired, sizeof(char*) * vars.retired_cap);
+    }
+    vars.retired[vars.nretired++] = var->entry;
+}
+
+/**
+ * @brief Removes a variable.
+ * @param name The NUL-terminated name.
+*/
+void unsetVar(const char* name) {
+    Variable* var = findVar(name, strlen(name));
+    if (var == NULL) {
+        return;
+    }
+    for (Variable** link = &vars.buckets[var->hash & (vars.nbuckets - 1)]; *link != NULL; link = &(*link)->next) {
+        if (*link == var) {
+            *link = var->next;
+            break;
+        }
+    }
+    if (var->flags & VAR_EXPORT) {
+        vars.generation++;
+    }
+    retireEntry(var);
+    free(var);
+    vars.count--;
+}
+
+/**
+ * @brief Checks whether a word is a NAME=value assignment.
+ * @param word The word.
+ * @return The length of the name, or 0 if it is not an assignment.
+*/
+size_t isAssignment(const char* word) {
+    if (!isalpha((unsigned char)word[0]) && word[0] != '_') {
+        return 0;
+    }
+    size_t len = 1;
+    while (isalnum((unsigned char)word[len]) || word[len] == '_') {
+        len++;
+    }
+    return word[len] == '=' ? len : 0;
+}
+
+/**
+ * @brief Carries out a NAME=value word.
+ * @param word The assignment; the caller has checked it with isAssignment().
+ * @param flags Flags to add to the variable.
+*/
+void assignVariable(const char* word, int flags) {
+    size_t name_len = isAssignment(word);
+    setVar(word, name_len, word + name_len + 1, flags);
+}
+
+/**
+ * @brief Sets the VAR=value prefixes of a builtin run in the shell, keeping the old values.
+ * @param assigns The NULL-terminated assignments.
+ * @return The old values in line_arena, NULL for names that were not set, for restoreVariables().
+*/
+char** saveVariables(char** assigns) {
+    int count = 0;
+    while (assigns[count] != NULL) {
+        count++;
+    }
+    char** saved = arenaAlloc(&line_arena, sizeof(char*) * (count + 1));
+    for (int i = 0; i < count; i++) {
+        size_t name_len = isAssignment(assigns[i]);
+        Variable* var = findVar(assigns[i], name_len);
+        saved[i] = NULL;
+        if (var != NULL && !(var->flags & VAR_UNSET)) {
+            saved[i] = arenaCopy(&line_arena, var->entry + name_len + 1, strlen(var->entry + name_len + 1));
+        }
+        setVar(assigns[i], name_len, assigns[i] + name_len + 1, 0);
+    }
+    return saved;
+}
+
+/**
+ * @brief Puts back the variables saveVariables() changed, last assignment first.
+ * @param assigns The assignments.
+ * @param saved The old values.
+*/
+void restoreVariables(char** assigns, char** saved) {
+    int count = 0;
+    while (assigns[count] != NULL) {
+        count++;
+    }
+    for (int i = count - 1; i >= 0; i--) {
+        size_t name_len = isAssignment(assigns[i]);
+        if (saved[i] != NULL) {
+            setVar(assigns[i], name_len, saved[i], 0);
+        }
+        else {
+            char* name = arenaCopy(&line_arena, assigns[i], name_len);
+            unsetVar(name);
+        }
+    }
+}
+
+/**
+ * @brief Returns the envp for starting commands, rebuilding it only if an exported variable has
+ * changed since it was last built.
+ * @return The NULL-terminated array, which environ also points at.
+ * @details The array is built with ENV_OVERLAY_SLOTS free pointers in front of it for
+ * overlayEnv(), and each exported variable remembers its slot.
+*/
+char** currentEnv() {
+    if (vars.buckets == NULL) {
+        importEnvironment();
+    }
+    if (vars.env_generation == vars.generation) {
+        return vars.env;
+    }
+
+    if (vars.count + 1 > vars.env_cap) {
+        vars.env_cap = (vars.count + 1) * 2;
+        free(vars.env_base);
+        vars.env_base = malloc(sizeof(char*) * (ENV_OVERLAY_SLOTS + vars.env_cap));
+    }
+    vars.env = vars.env_base + ENV_OVERLAY_SLOTS;
+    vars.env_count = 0;
+    for (size_t b = 0; b < vars.nbuckets; b++) {
+        for (Variable* var = vars.buckets[b]; var != NULL; var = var->next) {
+            var->env_slot = -1;
+            if ((var->flags & VAR_EXPORT) && !(var->flags & VAR_UNSET)) {
+                var->env_slot = vars.env_count;
+                vars.env[vars.env_count++] = var->entry;
+            }
+        }
+    }
+    vars.env[vars.env_count] = NULL;
+    environ = vars.env;
+    vars.env_generation = vars.generation;
+
+    for (size_t i = 0; i < vars.nretired; i++) {
+        free(vars.retired[i]);
+    }
+    vars.nretired = 0;
+    return vars.env;
+}
+
+/**
+ * @brief Returns an envp with a command's VAR=value prefixes in effect, without copying the
+ * cached one.
+ * @param assigns The NULL-terminated assignments, or NULL.
+ * @param overlay Records the slots that were replaced; restoreEnv() puts them back.
+ * @return The envp to start the command with.
+ * @details A variable that is already exported has its slot in the cached array swapped for the
+ * assignment. Other names go into the free slots in front of the array, later ones first so
+ * that the last assignment to a name is the one getenv() finds. Only when those run out is the
+ * array copied, into line_arena.
+*/
+char** overlayEnv(char** assigns, EnvOverlay* overlay) {
+    char** env = currentEnv();
+    overlay->count = 0;
+    if (assigns == NULL || assigns[0] == NULL) {
+        return env;
+    }
+
+    int nassigns = 0;
+    while (assigns[nassigns] != NULL) {
+        nassigns++;
+    }
+    overlay->slots = arenaAlloc(&line_arena, sizeof(int) * nassigns);
+    overlay->saved = arenaAlloc(&line_arena, sizeof(char*) * nassigns);
+
+    int front = 0;
+    for (int i = 0; i < nassigns; i++) {
+        Variable* var = findVar(assigns[i], isAssignment(assigns[i]));
+        if (var != NULL && var->env_slot >= 0) {
+            overlay->slots[overlay->count] = var->env_slot;
+            overlay->saved[overlay->count++] = env[var->env_slot];
+            env[var->env_slot] = assigns[i];
+        }
+        else if (front < ENV_OVERLAY_SLOTS) {
+            vars.env_base[ENV_OVERLAY_SLOTS - ++front] = assigns[i];
+        }
+        else {
+            //More new names than spare slots: put them in front of a copy
+            char** copy = arenaAlloc(&line_arena, sizeof(char*) * (nassigns + front + vars.env_count + 1));
+            int n = 0;
+            for (int j = nassigns - 1; j >= i; j--) {
+                copy[n++] = assigns[j];
+            }
+            memcpy(copy + n, env - front, sizeof(char*) * (front + vars.env_count + 1));
+            return copy;
+        }
+    }
+    return env - front;
+}
+
+/**
+ * @brief Puts back the cached envp slots an overlayEnv() call replaced.
+ * @param overlay The overlay.
+*/
+void restoreEnv(EnvOverlay* overlay) {
+    while (overlay->count > 0) {
+        overlay->count--;
+        vars.env[overlay->slots[overlay->count]] = overlay->saved[overlay->count];
+    }
+}
+
+/**
+ * @brief Expands the parameter at the start of a word: $NAME, ${NAME}, $1 to $9, ${10}, $0,
+ * $#, $@, $*, $?, $$ or $!.
+ * @param text The expansion, starting at its $.
+ * @param end Set to the last character of the expansion.
+ * @return The value, "" for an unset variable, or NULL if text is not a parameter expansion.
+*/
+const char* expandParameter(const char* text, const char** end) {
+    const char* name = text + 1;
+    size_t len;
+    char* value;
+
+    if (*name == '{') {
+        name++;
+        len = strcspn(name, "}");
+        if (name[len] != '}' || len == 0) {
+            return NULL;
+        }
+        *end = name + len;
+    }
+    else if (isalpha((unsigned char)*name) || *name == '_') {
+        len = 1;
+        while (isalnum((unsigned char)name[len]) || name[len] == '_') {
+            len++;
+        }
+        *end = name + len - 1;
+    }
+    else if (*name != '\0' && strchr("0123456789#@*?$!", *name) != NULL) {
+        len = 1;
+        *end = name;
+    }
+    else {
+        return NULL;
+    }
+
+    if (isdigit((unsigned char)*name)) {
+        int n = atoi(name);
+        if (n == 0) {
+            return script_name;
+        }
+        return n <= script_argc ? script_args[n - 1] : "";
+    }
+    if (len == 1 && strchr("#?$!", *name) != NULL) {
+        long number = *name == '#' ? script_argc : *name == '?' ? last_status : *name == '$' ? shell_pid : last_background_pid;
+        if (*name == '!' && number == 0) {
+            //No background job has been started yet
+            return "";
+        }
+        value = arenaAlloc(&line_arena, 24);
+        snprintf(value, 24, "%ld", number);
+        return value;
+    }
+    if (len == 1 && (*name == '@' || *name == '*')) {
+        size_t total = 1;
+        for (int i = 0; i < script_argc; i++) {
+            total += strlen(script_args[i]) + 1;
+        }
+        //Each argument is appended where the last one ended, so the join stays linear
+        value = arenaAlloc(&line_arena, total);
+        size_t used = 0;
+        for (int i = 0; i < script_argc; i++) {
+            if (i > 0) {
+                value[used++] = ' ';
+            }
+            size_t arg_len = strlen(script_args[i]);
+            memcpy(value + used, script_args[i], arg_len);
+            used += arg_len;
+        }
+        value[used] = '\0';
+        return value;
+    }
+
+    Variable* var = findVar(name, len);
+    if (var == NULL || (var->flags & VAR_UNSET)) {
+        return "";
+    }
+    return var->entry + var->name_len + 1;
+}
+
+/**
+ * @brief Builds the argv of one parallel job by substituting an item into the template.
+ * @param template The command template; every {} in it is replaced by the item.
+ * @param item The item.
+ * @return A malloc'd argv whose strings are malloc'd too; the item is appended as a final
+ * argument when the template has no {}.
+*/
+char** parallelArgv(char** template, const char* item) {
+    int ntemplate = 0;
+    int placeholders = 0;
+    for (; template[ntemplate] != NULL; ntemplate++) {
+        placeholders |= strstr(template[ntemplate], "{}") != NULL;
+    }
+
+    char** argv = malloc(sizeof(char*) * (ntemplate + 2));
+    size_t item_len = strlen(item);
+    for (int i = 0; i < ntemplate; i++) {
+        size_t count = 0;
+        for (const char* p = strstr(template[i], "{}"); p != NULL; p = strstr(p + 2, "{}")) {
+            count++;
+        }
+
+        argv[i] = malloc(strlen(template[i]) + count * item_len + 1);
+        char* out = argv[i];
+        const char* p = template[i];
+        for (const char* hole = strstr(p, "{}"); hole != NULL; hole = strstr(p, "{}")) {
+            memcpy(out, p, hole - p);
+            out += hole - p;
+            memcpy(out, item, item_len);
+            out += item_len;
+            p = hole + 2;
+        }
+        strcpy(out, p);
+    }
+    if (!placeholders) {
+        argv[ntemplate++] = strdup(item);
+    }
+    argv[ntemplate] = NULL;
+    return argv;
+}
+
+/**
+ * @brief Copies a finished job's grouped output to stdout and closes it.
+ * @param fd The memfd holding the output.
+*/
+void flushParallelOutput(int fd) {
+    if (fd < 0) {
+        return;
+    }
+    fflush(stdout);
+    if (lseek(fd, 0, SEEK_SET) == 0) {
+        relayFd(fd, STDOUT_FILENO);
+    }
+    close(fd);
+}
+
+/**
+ * @brief Implements the parallel builtin.
+ * @param args The command-line arguments: [-j N] [-g] [-k] command [args...] [::: items...].
+ * Items come from the arguments after ":::" or, without it, from the lines of stdin. Each {} in
+ * the command is replaced by the item, which is otherwise appended as the last argument.
+ * @return 0 if every job succeeded, otherwise the number of failed jobs, capped at 101.
+ * @details Keeps up to N jobs (by default the number of online CPUs) running at once, each
+ * launched through spawnCmd() like any other command, so no helper process is involved. With
+ * -g each job's output goes to a memfd and is copied out in one piece when the job ends;
+ * -k does the same but in input order. Children that do not belong to the pool are recorded in
+ * the job table as they are waited for, so background jobs keep their statuses.
+*/
+int parallelBuiltin(char** args) {
+    long jobs = sysconf(_SC_NPROCESSORS_ONLN);
+    int group = 0;
+    int keep_order = 0;
+    int i = 1;
+
+    for (; args[i] != NULL && args[i][0] == '-' && args[i][1] != '\0'; i++) {
+        if (strcmp(args[i], "--") == 0) {
+            i++;
+            break;
+        }
+        if (strncmp(args[i], "-j", 2) == 0) {
+            const char* value = args[i][2] != '\0' ? args[i] + 2 : args[++i];
+            if (value == NULL) {
+                break;
+            }
+            jobs = atol(value);
+        }
+        else if (strcmp(args[i], "-g") == 0) {
+            group = 1;
+        }
+        else if (strcmp(args[i], "-k") == 0) {
+            group = 1;
+            keep_order = 1;
+        }
+        else {
+            break;
+        }
+    }
+    if (jobs < 1) {
+        jobs = sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    if (jobs < 1) {
+        jobs = 1;
+    }
+
+    char** template = &args[i];
+    int ntemplate = 0;
+    while (template[ntemplate] != NULL && strcmp(template[ntemplate], ":::") != 0) {
+        ntemplate++;
+    }
+    if (ntemplate == 0) {
+        fprintf(stderr, "parallel: usage: parallel [-j N] [-g] [-k] command [args...] [::: items...]\n");
+        return 2;
+    }
+
+    //Items are the arguments after ::: or the lines of stdin
+    char** items;
+    size_t nitems = 0;
+    int items_owned = template[ntemplate] == NULL;
+    if (!items_owned) {
+        items = &template[ntemplate + 1];
+        while (items[nitems] != NULL) {
+            nitems++;
+        }
+        template[ntemplate] = NULL;
+    }
+    else {
+        size_t cap = 64;
+        char* line = NULL;
+        size_t line_cap = 0;
+        ssize_t n;
+        items = malloc(sizeof(char*) * cap);
+        while ((n = getline(&line, &line_cap, stdin)) >= 0) {
+            if (n > 0 && line[n - 1] == '\n') {
+                line[--n] = '\0';
+            }
+            if (nitems == cap) {
+                cap *= 2;
+                items = realloc(items, sizeof(char*) * cap);
+            }
+            items[nitems++] = strdup(line);
+        }
+        free(line);
+        clearerr(stdin);
+    }
+
+    pid_t* slots = calloc(jobs, sizeof(pid_t));
+    size_t* slot_item = calloc(jobs, sizeof(size_t));
+    int* slot_out = malloc(sizeof(int) * jobs);
+    int* outputs = keep_order ? malloc(sizeof(int) * (nitems + 1)) : NULL;
+    char* finished = keep_order ? calloc(nitems + 1, 1) : NULL;
+    size_t next = 0;
+    size_t next_output = 0;
+    long running = 0;
+    int failed = 0;
+
+    fflush(stdout);
+    while (next < nitems || running > 0) {
+        //Fill every free slot
+        for (long slot = 0; slot < jobs && next < nitems; slot++) {
+            if (slots[slot] != 0) {
+                continue;
+            }
+
+            RedirPlan plan;
+            initRedirPlan(&plan);
+            int out = group ? memfd_create("parallel", MFD_CLOEXEC) : -1;
+            plan.stdout_fd = out;
+
+            char** argv = parallelArgv(template, items[next]);
+            pid_t pid = spawnCmd(argv, NULL, &plan, -1);
+            for (int a = 0; argv[a] != NULL; a++) {
+                free(argv[a]);
+            }
+            free(argv);
+
+            if (pid < 0) {
+                failed++;
+                if (keep_order) {
+                    outputs[next] = out;
+                    finished[next] = 1;
+                }
+                else {
+                    flushParallelOutput(out);
+                }
+                next++;
+                slot--;
+                continue;
+            }
+            slots[slot] = pid;
+            slot_item[slot] = next++;
+            slot_out[slot] = out;
+            running++;
+        }
+
+        //Grouped output goes out in input order as soon as the earliest jobs are done
+        while (keep_order && next_output < nitems && finished[next_output]) {
+            flushParallelOutput(outputs[next_output++]);
+        }
+        if (running == 0) {
+            continue;
+        }
+
+        int status;
+        struct rusage usage;
+        pid_t pid = wait4(-1, &status, 0, &usage);
+        if (pid < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+
+        long slot = 0;
+        while (slot < jobs && slots[slot] != pid) {
+            slot++;
+        }
+        if (slot == jobs) {
+            updateJob(pid, status, &usage);
+            continue;
+        }
+
+        slots[slot] = 0;
+        running--;
+        failed += waitStatusToCode(status) != 0;
+        if (keep_order) {
+            outputs[slot_item[slot]] = slot_out[slot];
+            finished[slot_item[slot]] = 1;
+        }
+        else {
+            flushParallelOutput(slot_out[slot]);
+        }
+    }
+    while (keep_order && next_output < nitems) {
+        flushParallelOutput(outputs[next_output++]);
+    }
+
+    if (items_owned) {
+        for (size_t item = 0; item < nitems; item++) {
+            free(items[item]);
+        }
+        free(items);
+    }
+    free(slots);
+    free(slot_item);
+    free(slot_out);
+    free(outputs);
+    free(finished);
+    return failed > 101 ? 101 : failed;
+}
+
+/**
+ * @brief Reads a script file, mapping it into memory when it is a regular file.
+ * @param in The input source to initialize.
+ * @param path The script's path. The shell exits with status 127 if it cannot be opened.
+*/
+void openInputFile(InputSource* in, const char* path) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+
+    if (fd < 0) {
+        fprintf(stderr, "seashell: %s: %s\n", path, strerror(errno));
+        exit(127);
+    }
+
+    openInputFd(in, fd, 0);
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        void* data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data != MAP_FAILED) {
+            madvise(data, st.st_size, MADV_SEQUENTIAL);
+            in->data = data;
+            in->len = st.st_size;
+            in->mapped = 1;
+            close(fd);
+            in->fd = -1;
+        }
+    }
+}
+
+/**
+ * @brief Reads commands from an already open file descriptor.
+ * @param in The input source to initialize.
+ * @param fd The descriptor to read.
+ * @param interactive Whether to prompt and read one line at a time from a terminal.
+*/
+void openInputFd(InputSource* in, int fd, int interactive) {
+    memset(in, 0, sizeof(InputSource));
+    in->fd = fd;
+    in->interactive = interactive;
+}
+
+/**
+ * @brief Reads commands from a string, as given to -c.
+ * @param in The input source to initialize.
+ * @param text The commands; it must outlive the input source.
+*/
+void openInputString(InputSource* in, const char* text) {
+    memset(in, 0, sizeof(InputSource));
+    in->fd = -1;
+    in->data = text;
+    in->len = strlen(text);
+}
+
+/**
+ * @brief Returns the next line of input, without its newline.
+ * @param in The input source.
+ * @param prompt Printed first when the input is interactive.
+ * @param len Set to the length of the line.
+ * @return The line, valid until the next call, or NULL at end of input.
+ * @details In-memory input is returned in place. Streams are read INPUT_CHUNK bytes at a time
+ * and lines are cut out of the buffer with memchr(), as are the lines of a multi-line paste.
+*/
+char* readInputLine(InputSource* in, const char* prompt, size_t* len) {
+    if (in->interactive) {
+        //Lines pasted together are returned one at a time without prompting again
+        if (in->buf_start >= in->buf_len) {
+            ssize_t n;
+            if (line_editor) {
+                n = editLine(prompt, &in->buf, &in->buf_cap);
+            }
+            else {
+                printf("%s", prompt);
+                fflush(stdout);
+                n = getline(&in->buf, &in->buf_cap, stdin);
+                if (n > 0 && in->buf[n - 1] == '\n') {
+                    in->buf[--n] = '\0';
+                }
+            }
+            if (n < 0) {
+                return NULL;
+            }
+            in->buf_start = 0;
+            in->buf_len = n;
+        }
+
+        char* start = in->buf + in->buf_start;
+        char* end = memchr(start, '\n', in->buf_len - in->buf_start);
+        *len = end != NULL ? (size_t)(end - start) : in->buf_len - in->buf_start;
+        start[*len] = '\0';
+        in->buf_start += *len + 1;
+        return start;
+    }
+
+    if (in->fd < 0) {
+        if (in->pos >= in->len) {
+            return NULL;
+        }
+        const char* start = in->data + in->pos;
+        const char* end = memchr(start, '\n', in->len - in->pos);
+        size_t n = end != NULL ? (size_t)(end - start) : in->len - in->pos;
+        in->pos += n + (end != NULL);
+        *len = n;
+        return (char*)start;
+    }
+
+    while (1) {
+        char* start = in->buf + in->buf_start;
+        char* end = in->buf_len > in->buf_start ? memchr(start, '\n', in->buf_len - in->buf_start) : NULL;
+        if (end != NULL) {
+            *len = end - start;
+            in->buf_start += *len + 1;
+            return start;
+        }
+
+        //Move the partial line to the front and refill, growing for lines longer than the buffer
+        size_t partial = in->buf_len - in->buf_start;
+        if (in->buf_cap - partial < INPUT_CHUNK) {
+            in->buf_cap = partial + INPUT_CHUNK;
+            char* grown = malloc(in->buf_cap);
+            memcpy(grown, start, partial);
+            free(in->buf);
+            in->buf = grown;
+        }
+        else {
+            memmove(in->buf, start, partial);
+        }
+        in->buf_start = 0;
+        in->buf_len = partial;
+
+        ssize_t n = read(in->fd, in->buf + partial, in->buf_cap - partial);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            if (partial == 0) {
+                return NULL;
+            }
+            *len = partial;
+            in->buf_start = partial;
+            return in->buf;
+        }
+        in->buf_len += n;
+    }
+}
+
+/**
+ * @brief Opens the history file on first use.
+ * @return The descriptor, or -1 if history cannot be kept at all.
+ * @details The file is $HISTFILE, or ~/.seashell_history. When HISTFILE is set but empty, or
+ * the file cannot be opened, history goes to a memfd instead and lasts only for the session.
+ * Interactive shells compact the file at exit once it grows past HISTORY_FILE_MAX.
+*/
+int openHistory() {
+    if (history_fd >= 0) {
+        return history_fd;
+    }
+
+    const char* path = getVar("HISTFILE");
+    const char* home = getVar("HOME");
+    if (path == NULL && home != NULL) {
+        history_path = malloc(strlen(home) + sizeof("/.seashell_history"));
+        sprintf(history_path, "%s/.seashell_history", home);
+    }
+    else if (path != NULL && path[0] != '\0') {
+        history_path = strdup(path);
+    }
+
+    if (history_path != NULL) {
+        history_fd = open(history_path, O_RDWR | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+    }
+    if (history_fd < 0) {
+        free(history_path);
+        history_path = NULL;
+        history_fd = memfd_create("history", MFD_CLOEXEC);
+    }
+    if (history_fd >= 0 && history_path != NULL && current_input != NULL && current_input->interactive) {
+        history_owner = getpid();
+        atexit(compactHistoryAtExit);
+    }
+    return history_fd;
+}
+
+/**
+ * @brief Switches to the current history file if another shell has replaced it by compacting.
+ * @return Whether the descriptor was reopened.
+*/
+int reopenHistory() {
+    struct stat by_path;
+    struct stat by_fd;
+    if (history_path == NULL || stat(history_path, &by_path) != 0 || fstat(history_fd, &by_fd) != 0) {
+        return 0;
+    }
+    if (by_path.st_ino == by_fd.st_ino && by_path.st_dev == by_fd.st_dev) {
+        return 0;
+    }
+
+    int fd = open(history_path, O_RDWR | O_APPEND | O_CLOEXEC);
+    if (fd < 0) {
+        return 0;
+    }
+    close(history_fd);
+    history_fd = fd;
+    return 1;
+}
+
+/**
+ * @brief Maps the history file, remapping when it has grown or been replaced.
+ * @details Entries appended by other shells show up here too, so every session searches the
+ * same history.
+*/
+void mapHistory() {
+    struct stat st;
+    if (openHistory() < 0) {
+        return;
+    }
+    int replaced = reopenHistory();
+    if (fstat(history_fd, &st) != 0) {
+        return;
+    }
+    if (!replaced && (size_t)st.st_size == history_size) {
+        return;
+    }
+
+    if (history_map != NULL) {
+        munmap((void*)history_map, history_size);
+    }
+    history_map = NULL;
+    history_size = 0;
+    if (st.st_size > 0) {
+        void* map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, history_fd, 0);
+        if (map != MAP_FAILED) {
+            history_map = map;
+            history_size = st.st_size;
+        }
+    }
+
+    //A record cut short by a crash is ignored rather than glued to the next one
+    while (history_size > 0 && history_map[history_size - 1] != '\n') {
+        history_size--;
+    }
+}
+
+/**
+ * @brief Appends a line to the history, skipping blank lines and repeats of the newest entry.
+ * @param line The line.
+ * @param len Its length.
+ * @details Each entry is one line of the file, with newlines and backslashes escaped, and is
+ * added with a single write() to a descriptor opened with O_APPEND, so shells appending at the
+ * same time never interleave. The shared lock only keeps the write from landing in a file that
+ * a compaction is replacing.
+*/
+void historyAdd(const char* line, size_t len) {
+    if (len == 0 || strspn(line, " \t") == len) {
+        return;
+    }
+    mapHistory();
+    if (history_fd < 0) {
+        return;
+    }
+
+    char* record = malloc(len * 2 + 1);
+    size_t n = encodeHistory(line, len, record);
+    record[n++] = '\n';
+
+    long last = historyPrevious(history_size);
+    if (last >= 0 && history_size - last == n && memcmp(history_map + last, record, n) == 0) {
+        free(record);
+        return;
+    }
+
+    while (1) {
+        flock(history_fd, LOCK_SH);
+        if (!reopenHistory()) {
+            break;
+        }
+    }
+    if (write(history_fd, record, n) != (ssize_t)n) {
+        perror("Error: history");
+    }
+    flock(history_fd, LOCK_UN);
+    free(record);
+}
+
+/**
+ * @brief Escapes text for the history file, which holds one entry per line.
+ * @param text The text.
+ * @param len Its length.
+ * @param out Receives the escaped text; it must have room for 2 * len bytes.
+ * @return The length of the escaped text.
+*/
+size_t encodeHistory(const char* text, size_t len, char* out) {
+    size_t n = 0;
+    for (size_t i = 0; i < len; i++) {
+        if (text[i] == '\n' || text[i] == '\\') {
+            out[n++] = '\\';
+            out[n++] = text[i] == '\n' ? 'n' : '\\';
+        }
+        else {
+            out[n++] = text[i];
+        }
+    }
+    return n;
+}
+
+/**
+ * @brief Returns a history entry with its escapes undone.
+ * @param start The offset of the entry in the mapped file.
+ * @param len Set to the length of the entry.
+ * @return The NUL-terminated entry, valid until the next call.
+*/
+char* historyEntry(size_t start, size_t* len) {
+    static char* entry = NULL;
+    static size_t entry_cap = 0;
+    size_t end = historyEntryEnd(start) - 1;
+
+    if (end - start + 1 > entry_cap) {
+        entry_cap = (end - start + 1) * 2;
+        entry = realloc(entry, entry_cap);
+    }
+    size_t n = 0;
+    for (size_t i = start; i < end; i++) {
+        char c = history_map[i];
+        if (c == '\\' && i + 1 < end) {
+            c = history_map[++i] == 'n' ? '\n' : history_map[i];
+        }
+        entry[n++] = c;
+    }
+    entry[n] = '\0';
+    if (len != NULL) {
+        *len = n;
+    }
+    return entry;
+}
+
+/**
+ * @brief Finds the entry before another one.
+ * @param before The offset of an entry, or history_size for the end of the history.
+ * @return The offset of the entry before it, or -1 if there is none.
+*/
+long historyPrevious(size_t before) {
+    if (before == 0) {
+        return -1;
+    }
+    const char* newline = before > 1 ? memrchr(history_map, '\n', before - 1) : NULL;
+    return newline != NULL ? newline - history_map + 1 : 0;
+}
+
+/**
+ * @brief Finds the offset just past an entry's newline, which is where the next entry starts.
+ * @param start The offset of the entry.
+ * @return The offset of the next entry, or history_size.
+*/
+size_t historyEntryEnd(size_t start) {
+    const char* newline = memchr(history_map + start, '\n', history_size - start);
+    return newline != NULL ? (size_t)(newline - history_map) + 1 : history_size;
+}
+
+/**
+ * @brief Counts the entries in the mapped history.
+ * @return The number of entries.
+*/
+size_t historyCount() {
+    size_t count = 0;
+    for (const char* p = history_map; p != NULL && p < history_map + history_size; p++) {
+        p = memchr(p, '\n', history_map + history_size - p);
+        count++;
+    }
+    return count;
+}
+
+/**
+ * @brief Finds the newest entry before an offset that contains a string.
+ * @param query The string to look for.
+ * @param before Only entries that end before this offset are searched.
+ * @return The offset of the matching entry, or -1.
+ * @details Scans the mapped file backwards with memmem() over blocks that start at 4 KiB and
+ * double up to 1 MiB, so recent matches are found after touching a page or two and a miss
+ * costs one vectorized pass over the file, a few milliseconds for a million entries. Blocks
+ * overlap by the length of the query, so no match is lost at a block boundary.
+*/
+long historySearch(const char* query, size_t before) {
+    size_t query_len = strlen(query);
+    if (query_len == 0 || history_map == NULL) {
+        return -1;
+    }
+    char* needle = malloc(query_len * 2);
+    size_t needle_len = encodeHistory(query, query_len, needle);
+    size_t block = 4096;
+    size_t end = before < history_size ? before : history_size;
+    long found = -1;
+
+    while (end >= needle_len && found < 0) {
+        size_t start = end > block ? end - block : 0;
+        const char* last = NULL;
+        const char* p = memmem(history_map + start, end - start, needle, needle_len);
+        while (p != NULL) {
+            last = p;
+            p = memmem(p + 1, history_map + end - (p + 1), needle, needle_len);
+        }
+        if (last != NULL) {
+            found = historyPrevious(last - history_map + 1);
+        }
+        if (start == 0) {
+            break;
+        }
+        end = start + needle_len - 1;
+        block = block < (1 << 20) ? block * 2 : block;
+    }
+    free(needle);
+    return found;
+}
+
+/**
+ * @brief Rewrites the history file without duplicates and, oldest first, without entries past
+ * a size limit.
+ * @param keep The most bytes of history to keep.
+ * @param wait Whether to wait for the exclusive lock rather than give up if another shell has
+ * the file.
+ * @return 0 on success, -1 if the history could not be compacted.
+ * @details Only the newest copy of each entry is kept. The new file is written next to the old
+ * one and renamed over it while the old file is locked, and shells appending to the old file
+ * notice the rename under their lock and move to the new one, so no entry is lost.
+*/
+int compactHistory(size_t keep, int wait) {
+    if (openHistory() < 0 || history_path == NULL) {
+        return -1;
+    }
+    while (1) {
+        if (flock(history_fd, LOCK_EX | (wait ? 0 : LOCK_NB)) != 0) {
+            return -1;
+        }
+        if (!reopenHistory()) {
+            break;
+        }
+    }
+    mapHistory();
+
+    //Newest entries first; the table remembers which entries have been kept already
+    size_t entries = historyCount();
+    size_t slots = 16;
+    while (slots < entries * 2) {
+        slots *= 2;
+    }
+    unsigned int* table = calloc(slots, sizeof(unsigned int) * 2);
+    unsigned int* kept = malloc(sizeof(unsigned int) * 2 * (entries + 1));
+    size_t nkept = 0;
+    size_t kept_bytes = 0;
+
+    for (long start = historyPrevious(history_size); start >= 0; start = historyPrevious(start)) {
+        size_t len = historyEntryEnd(start) - start;
+        unsigned long hash = 14695981039346656037ul;
+        for (size_t i = 0; i < len; i++) {
+            hash = (hash ^ (unsigned char)history_map[start + i]) * 1099511628211ul;
+        }
+        size_t slot = hash & (slots - 1);
+        int seen = 0;
+        while (table[slot * 2 + 1] != 0) {
+            if (table[slot * 2 + 1] == len && memcmp(history_map + table[slot * 2], history_map + start, len) == 0) {
+                seen = 1;
+                break;
+            }
+            slot = (slot + 1) & (slots - 1);
+        }
+        if (seen) {
+            continue;
+        }
+        if (kept_bytes + len > keep) {
+            break;
+        }
+        table[slot * 2] = start;
+        table[slot * 2 + 1] = len;
+        kept[nkept * 2] = start;
+        kept[nkept * 2 + 1] = len;
+        nkept++;
+        kept_bytes += len;
+    }
+    free(table);
+
+    //Written oldest first through a staging buffer, then renamed over the old file
+    size_t temp_size = strlen(history_path) + sizeof(".XXXXXX");
+    char* temp = malloc(temp_size);
+    int fd = -1;
+    if (temp != NULL) {
+        snprintf(temp, temp_size, "%s.XXXXXX", history_path);
+        fd = mkostemp(temp, O_CLOEXEC);
+    }
+    char* out = malloc(HISTORY_CHUNK);
+    int result = fd >= 0 && out != NULL ? 0 : -1;
+    size_t out_len = 0;
+
+    for (size_t i = nkept; i-- > 0 && result == 0;) {
+        const char* entry = history_map + kept[i * 2];
+        size_t len = kept[i * 2 + 1];
+        if (out_len + len > HISTORY_CHUNK) {
+            result = write(fd, out, out_len) == (ssize_t)out_len ? 0 : -1;
+            out_len = 0;
+        }
+        if (len > HISTORY_CHUNK) {
+            result = write(fd, entry, len) == (ssize_t)len ? result : -1;
+        }
+        else {
+            memcpy(out + out_len, entry, len);
+            out_len += len;
+        }
+    }
+    if (result == 0 && out_len > 0 && write(fd, out, out_len) != (ssize_t)out_len) {
+        result = -1;
+    }
+    if (fd >= 0) {
+        result = fsync(fd) == 0 && result == 0 ? 0 : -1;
+        close(fd);
+        if (result == 0 && rename(temp, history_path) != 0) {
+            result = -1;
+        }
+        if (result != 0) {
+            unlink(temp);
+        }
+    }
+    flock(history_fd, LOCK_UN);
+    mapHistory();
+
+    free(out);
+    free(kept);
+    free(temp);
+    return result;
+}
+
+/**
+ * @brief Compacts the history file when an interactive shell exits, if it has grown too large.
+ * @details Forked children that call exit() skip this, and a shell that finds another one
+ * compacting does not wait for it.
+*/
+void compactHistoryAtExit() {
+    struct stat st;
+    if (getpid() != history_owner || fstat(history_fd, &st) != 0 || st.st_size <= HISTORY_FILE_MAX) {
+        return;
+    }
+    compactHistory(HISTORY_FILE_MAX / 2, 0);
+}
+
+/**
+ * @brief Implements the history builtin.
+ * @param args The command-line arguments: [n] lists the newest n entries (all by default),
+ * -c clears the history and -k compacts it now.
+ * @return The exit status of the builtin.
+*/
+int historyBuiltin(char** args) {
+    mapHistory();
+    if (history_fd < 0) {
+        fprintf(stderr, "history: history is not available\n");
+        return 1;
+    }
+
+    if (args[1] != NULL && strcmp(args[1], "-c") == 0) {
+        //The file is replaced rather than truncated, since other shells may have it mapped
+        int failed = history_path != NULL ? compactHistory(0, 1) != 0 : ftruncate(history_fd, 0) != 0;
+        mapHistory();
+        if (failed) {
+            perror("history");
+        }
+        return failed;
+    }
+    if (args[1] != NULL && strcmp(args[1], "-k") == 0) {
+        if (compactHistory(HISTORY_FILE_MAX / 2, 1) != 0) {
+            perror("history");
+            return 1;
+        }
+        return 0;
+    }
+
+    size_t total = historyCount();
+    size_t count = total;
+    if (args[1] != NULL) {
+        char* end;
+        long n = strtol(args[1], &end, 10);
+        if (*end != '\0' || n < 0) {
+            fprintf(stderr, "history: usage: history [-c | -k | n]\n");
+            return 2;
+        }
+        count = (size_t)n < total ? (size_t)n : total;
+    }
+
+    size_t start = history_size;
+    for (size_t i = 0; i < count; i++) {
+        start = historyPrevious(start);
+    }
+    for (size_t number = total - count + 1; start < history_size; number++) {
+        printf("%5zu  %s\n", number, historyEntry(start, NULL));
+        start = historyEntryEnd(start);
+    }
+    return 0;
+}
+
+/**
+ * @brief Records that the terminal was resized so the editor redraws at the new width.
+ * @param sig The signal number (always SIGWINCH).
+*/
+void sigwinchHandler(int sig) {
+    (void)sig;
+    terminal_resized = 1;
+}
+
+/**
+ * @brief Returns the number of terminal columns a run of line bytes takes up.
+ * @param text The bytes.
+ * @param len The number of bytes.
+ * @return The width; UTF-8 continuation bytes take no column and control bytes, shown as ^X,
+ * take two.
+*/
+size_t editorWidth(const char* text, size_t len) {
+    size_t width = 0;
+    for (size_t i = 0; i < len; i++) {
+        unsigned char c = text[i];
+        width += (c & 0xc0) == 0x80 ? 0 : (c < 32 || c == 127) ? 2 : 1;
+    }
+    return width;
+}
+
+/**
+ * @brief Queues bytes for the next write to the terminal.
+ * @param e The editor.
+ * @param text The bytes.
+ * @param len The number of bytes.
+*/
+void editorOut(LineEditor* e, const char* text, size_t len) {
+    if (e->out_len + len > e->out_cap) {
+        e->out_cap = (e->out_len + len) * 2;
+        e->out = realloc(e->out, e->out_cap);
+    }
+    memcpy(e->out + e->out_len, text, len);
+    e->out_len += len;
+}
+
+/**
+ * @brief Sends everything queued by editorOut() to the terminal in a single write.
+ * @param e The editor.
+*/
+void editorFlush(LineEditor* e) {
+    size_t done = 0;
+    while (done < e->out_len) {
+        ssize_t n = write(STDOUT_FILENO, e->out + done, e->out_len - done);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            break;
+        }
+        done += n;
+    }
+    e->out_len = 0;
+}
+
+/**
+ * @brief Queues a run of line bytes, showing control bytes as ^X.
+ * @param e The editor.
+ * @param text The bytes.
+ * @param len The number of bytes.
+*/
+void editorOutText(LineEditor* e, const char* text, size_t len) {
+    size_t start = 0;
+    for (size_t i = 0; i < len; i++) {
+        unsigned char c = text[i];
+        if (c < 32 || c == 127) {
+            char caret[2] = { '^', c == 127 ? '?' : c + 64 };
+            editorOut(e, text + start, i - start);
+            editorOut(e, caret, 2);
+            start = i + 1;
+        }
+    }
+    editorOut(e, text + start, len - start);
+}
+
+/**
+ * @brief Moves the terminal cursor to a column of the (possibly wrapped) line.
+ * @param e The editor.
+ * @param column The target, counted in columns from the start of the prompt's last line.
+ * @details Uses relative cursor motions only, so nothing already on screen is redrawn.
+*/
+void editorMoveTo(LineEditor* e, size_t column) {
+    char seq[32];
+    long from_row = e->cursor / e->cols;
+    long to_row = column / e->cols;
+    long from_col = e->cursor % e->cols;
+    long to_col = column % e->cols;
+
+    if (to_row < from_row) {
+        editorOut(e, seq, snprintf(seq, sizeof(seq), "\x1b[%ldA", from_row - to_row));
+    }
+    else if (to_row > from_row) {
+        editorOut(e, seq, snprintf(seq, sizeof(seq), "\x1b[%ldB", to_row - from_row));
+    }
+    if (to_col < from_col) {
+        editorOut(e, seq, snprintf(seq, sizeof(seq), "\x1b[%ldD", from_col - to_col));
+    }
+    else if (to_col > from_col) {
+        editorOut(e, seq, snprintf(seq, sizeof(seq), "\x1b[%ldC", to_col - from_col));
+    }
+    e->cursor = column;
+}
+
+/**
+ * @brief Redraws the line from a byte offset to its end and puts the cursor back at pos.
+ * @param e The editor; the terminal cursor must be at the column of byte from.
+ * @param from The first byte that changed.
+ * @details Everything before from is left alone, so typing or deleting in the middle of a
+ * long line sends only its tail. A line ending exactly at the right margin gets an explicit
+ * CR LF, so the terminal's pending-wrap state never has to be guessed.
+*/
+void editorDrawFrom(LineEditor* e, size_t from) {
+    editorOut(e, "\x1b[J", 3);
+    editorOutText(e, e->buf + from, e->len - from);
+    e->cursor = e->prompt_cols + editorWidth(e->buf, e->len);
+    if (e->cursor > 0 && e->cursor % e->cols == 0) {
+        editorOut(e, "\r\n", 2);
+    }
+    editorMoveTo(e, e->prompt_cols + editorWidth(e->buf, e->pos));
+}
+
+/**
+ * @brief Redraws the prompt and the whole line, for history recall, resizes and Ctrl-L.
+ * @param e The editor.
+*/
+void editorRefresh(LineEditor* e) {
+    editorMoveTo(e, 0);
+    editorOut(e, "\r", 1);
+    editorOut(e, e->prompt, strlen(e->prompt));
+    e->cursor = e->prompt_cols;
+    editorDrawFrom(e, 0);
+}
+
+/**
+ * @brief Replaces the line being edited, with the cursor at its end.
+ * @param e The editor.
+ * @param text The new contents.
+ * @param len Their length.
+*/
+void editorSetLine(LineEditor* e, const char* text, size_t len) {
+    editorMoveTo(e, e->prompt_cols);
+    if (len + 1 > e->cap) {
+        e->cap = len + 64;
+        e->buf = realloc(e->buf, e->cap);
+    }
+    memmove(e->buf, text, len);
+    e->len = len;
+    e->pos = len;
+    e->buf[len] = '\0';
+    editorDrawFrom(e, 0);
+}
+
+/**
+ * @brief Inserts bytes at the cursor.
+ * @param e The editor.
+ * @param text The bytes.
+ * @param len The number of bytes.
+ * @details Typing at the end of the line echoes just the new bytes.
+*/
+void editorInsert(LineEditor* e, const char* text, size_t len) {
+    if (e->len + len + 1 > e->cap) {
+        e->cap = (e->len + len + 1) * 2;
+        e->buf = realloc(e->buf, e->cap);
+    }
+    memmove(e->buf + e->pos + len, e->buf + e->pos, e->len - e->pos);
+    memcpy(e->buf + e->pos, text, len);
+    e->len += len;
+    e->buf[e->len] = '\0';
+
+    size_t from = e->pos;
+    e->pos += len;
+    if (e->pos == e->len) {
+        editorOutText(e, text, len);
+        e->cursor = e->prompt_cols + editorWidth(e->buf, e->len);
+        if (e->cursor > 0 && e->cursor % e->cols == 0) {
+            editorOut(e, "\r\n", 2);
+        }
+        return;
+    }
+    editorDrawFrom(e, from);
+}
+
+/**
+ * @brief Deletes a range of bytes and redraws what follows it.
+ * @param e The editor.
+ * @param start The first byte to delete.
+ * @param end One past the last byte to delete.
+*/
+void editorDelete(LineEditor* e, size_t start, size_t end) {
+    if (start >= end) {
+        return;
+    }
+    editorMoveTo(e, e->prompt_cols + editorWidth(e->buf, start));
+    memmove(e->buf + start, e->buf + end, e->len - end);
+    e->len -= end - start;
+    e->buf[e->len] = '\0';
+    e->pos = start;
+    editorDrawFrom(e, start);
+}
+
+/**
+ * @brief Moves the cursor to a byte offset of the line.
+ * @param e The editor.
+ * @param pos The offset.
+*/
+void editorSetPos(LineEditor* e, size_t pos) {
+    e->pos = pos;
+    editorMoveTo(e, e->prompt_cols + editorWidth(e->buf, pos));
+}
+
+/**
+ * @brief Finds the start of the previous or next UTF-8 character.
+ * @param e The editor.
+ * @param pos The offset to start from.
+ * @param dir -1 for the previous character and 1 for the next.
+ * @return The offset.
+*/
+size_t editorStep(LineEditor* e, size_t pos, int dir) {
+    if (dir < 0) {
+        while (pos > 0 && (e->buf[--pos] & 0xc0) == 0x80) {
+        }
+        return pos;
+    }
+    while (pos < e->len && (e->buf[++pos] & 0xc0) == 0x80) {
+    }
+    return pos;
+}
+
+/**
+ * @brief Finds the start of the previous word or the end of the next one.
+ * @param e The editor.
+ * @param dir -1 to go back and 1 to go forward.
+ * @return The offset.
+*/
+size_t editorWord(LineEditor* e, int dir) {
+    size_t pos = e->pos;
+    if (dir < 0) {
+        while (pos > 0 && isspace((unsigned char)e->buf[pos - 1])) {
+            pos--;
+        }
+        while (pos > 0 && !isspace((unsigned char)e->buf[pos - 1])) {
+            pos--;
+        }
+        return pos;
+    }
+    while (pos < e->len && isspace((unsigned char)e->buf[pos])) {
+        pos++;
+    }
+    while (pos < e->len && !isspace((unsigned char)e->buf[pos])) {
+        pos++;
+    }
+    return pos;
+}
+
+/**
+ * @brief Reads one byte of terminal input.
+ * @param timeout_ms How long to wait, or -1 to wait for ever.
+ * @return The byte, EDITOR_TIMEOUT, EDITOR_RESIZE if a SIGWINCH interrupted the wait, or
+ * EDITOR_EOF.
+ * @details Reads whatever is available in one go, so a paste costs a few reads rather than one
+ * per byte. Bytes typed ahead past the end of a line are kept for the next prompt.
+*/
+int editorReadByte(int timeout_ms) {
+    while (editor_in_pos == editor_in_len) {
+        if (timeout_ms >= 0) {
+            struct pollfd pfd = { STDIN_FILENO, POLLIN, 0 };
+            int ready = poll(&pfd, 1, timeout_ms);
+            if (ready == 0) {
+                return EDITOR_TIMEOUT;
+            }
+            if (ready < 0 && errno == EINTR) {
+                continue;
+            }
+        }
+        ssize_t n = read(STDIN_FILENO, editor_in, sizeof(editor_in));
+        if (n < 0 && errno == EINTR) {
+            if (terminal_resized) {
+                return EDITOR_RESIZE;
+            }
+            continue;
+        }
+        if (n <= 0) {
+            return EDITOR_EOF;
+        }
+        editor_in_pos = 0;
+        editor_in_len = n;
+    }
+    return (unsigned char)editor_in[editor_in_pos++];
+}
+
+/**
+ * @brief Decodes the rest of an escape sequence after ESC.
+ * @return One of the EDITOR_KEY_* codes, or EDITOR_TIMEOUT for a lone or unknown sequence.
+*/
+int editorReadEscape() {
+    int c = editorReadByte(50);
+    if (c == 'b' || c == 'f') {
+        return c == 'b' ? EDITOR_KEY_WORD_LEFT : EDITOR_KEY_WORD_RIGHT;
+    }
+    if (c != '[' && c != 'O') {
+        return EDITOR_TIMEOUT;
+    }
+
+    //CSI parameters, then a final byte
+    char params[16];
+    size_t n = 0;
+    int final;
+    while ((final = editorReadByte(50)) >= 0 && ((final >= '0' && final <= '9') || final == ';')) {
+        if (n < sizeof(params) - 1) {
+            params[n++] = final;
+        }
+    }
+    params[n] = '\0';
+
+    switch (final) {
+    case 'A': return EDITOR_KEY_UP;
+    case 'B': return EDITOR_KEY_DOWN;
+    case 'C': return strchr(params, ';') != NULL ? EDITOR_KEY_WORD_RIGHT : EDITOR_KEY_RIGHT;
+    case 'D': return strchr(params, ';') != NULL ? EDITOR_KEY_WORD_LEFT : EDITOR_KEY_LEFT;
+    case 'H': return EDITOR_KEY_HOME;
+    case 'F': return EDITOR_KEY_END;
+    case '~':
+        switch (atoi(params)) {
+        case 1: case 7: return EDITOR_KEY_HOME;
+        case 4: case 8: return EDITOR_KEY_END;
+        case 3: return EDITOR_KEY_DELETE;
+        case 200: return EDITOR_KEY_PASTE;
+        }
+    }
+    return EDITOR_TIMEOUT;
+}
+
+/**
+ * @brief Inserts a bracketed paste verbatim, up to the ESC [ 201 ~ that ends it.
+ * @param e The editor.
+ * @details Nothing in the paste is treated as a key, so pasted newlines do not run anything;
+ * they are shown as ^J and each pasted line runs in turn once Enter is pressed.
+*/
+void editorPaste(LineEditor* e) {
+    static const char end[] = "\x1b[201~";
+    char chunk[256];
+    size_t n = 0;
+    size_t matched = 0;
+
+    while (1) {
+        int c = editorReadByte(-1);
+        if (c == EDITOR_RESIZE) {
+            continue;
+        }
+        if (c < 0) {
+            break;
+        }
+        if (c == end[matched]) {
+            if (++matched == sizeof(end) - 1) {
+                break;
+            }
+            continue;
+        }
+        //A partial match of the end marker was pasted text after all
+        for (size_t i = 0; i < matched; i++) {
+            chunk[n++] = end[i];
+        }
+        matched = 0;
+        chunk[n++] = c == '\r' ? '\n' : c;
+        if (n + sizeof(end) >= sizeof(chunk)) {
+            editorInsert(e, chunk, n);
+            n = 0;
+        }
+    }
+    editorInsert(e, chunk, n);
+}
+
+/**
+ * @brief Runs Ctrl-R incremental reverse search over the history.
+ * @param e The editor.
+ * @return The key that ended the search and still needs handling (Enter accepts the match,
+ * any other key is applied to it), or 0 if the search was cancelled.
+*/
+int editorSearch(LineEditor* e) {
+    char query[256];
+    size_t qlen = 0;
+    long match = -1;
+    char* original = strdup(e->buf);
+    size_t original_pos = e->pos;
+    int result = 0;
+
+    //Recalling a line may already have mapped the history; otherwise this is its first use
+    if (e->history_pos == HISTORY_UNMAPPED) {
+        mapHistory();
+    }
+
+    query[0] = '\0';
+    while (1) {
+        //The search line replaces the prompt while it is active
+        editorMoveTo(e, 0);
+        editorOut(e, "\r\x1b[J", 4);
+        const char* shown = match >= 0 ? historyEntry(match, NULL) : (qlen == 0 ? e->buf : "");
+        char head[300];
+        int head_len = snprintf(head, sizeof(head), "(%sreverse-i-search)`%s': ", match < 0 && qlen > 0 ? "failing " : "", query);
+        editorOut(e, head, head_len);
+        editorOutText(e, shown, strlen(shown));
+        e->cursor = editorWidth(head, head_len) + editorWidth(shown, strlen(shown));
+        if (e->cursor % e->cols == 0) {
+            editorOut(e, "\r\n", 2);
+        }
+        editorFlush(e);
+
+        int c = editorReadByte(-1);
+        if (c == EDITOR_RESIZE) {
+            continue;
+        }
+        if (c == 18) {
+            //Ctrl-R again: the next older match
+            if (qlen > 0) {
+                long older = historySearch(query, match >= 0 ? (size_t)match : history_size);
+                match = older >= 0 ? older : match;
+            }
+            continue;
+        }
+        if ((c == 127 || c == 8) && qlen > 0) {
+            query[--qlen] = '\0';
+            match = historySearch(query, history_size);
+            continue;
+        }
+        if (c >= 32 && c != 127 && qlen < sizeof(query) - 1) {
+            query[qlen++] = c;
+            query[qlen] = '\0';
+            match = historySearch(query, match >= 0 ? historyEntryEnd(match) : history_size);
+            continue;
+        }
+
+        if (c == 7 || c == 3 || c < 0) {
+            //Ctrl-G or Ctrl-C puts the line back as it was
+            result = c < 0 ? c : 0;
+            shown = original;
+        }
+        else {
+            result = c;
+            shown = match >= 0 ? historyEntry(match, NULL) : original;
+        }
+        editorMoveTo(e, 0);
+        editorOut(e, "\r\x1b[J", 4);
+        editorOut(e, e->prompt, strlen(e->prompt));
+        e->cursor = e->prompt_cols;
+        size_t len = strlen(shown);
+        editorSetLine(e, shown, len);
+        if (shown == original) {
+            editorSetPos(e, original_pos < len ? original_pos : len);
+        }
+        break;
+    }
+    free(original);
+    return result;
+}
+
+/**
+ * @brief Reads one line from the terminal with editing, history and paste support.
+ * @param prompt The prompt; only its last line is redrawn.
+ * @param buf The line buffer, grown as needed; on return it holds the NUL-terminated line.
+ * @param cap The capacity of buf.
+ * @return The length of the line, or -1 at end of input (Ctrl-D on an empty line).
+ * @details The terminal is in raw mode with bracketed paste on only while the line is being
+ * edited. Keys: Left/Right/Ctrl-B/Ctrl-F, Alt-B/Alt-F and Ctrl-Left/Right by word,
+ * Home/End/Ctrl-A/Ctrl-E, Backspace, Delete/Ctrl-D, Ctrl-W, Ctrl-U, Ctrl-K, Up/Down/Ctrl-P/Ctrl-N
+ * for history, Ctrl-R for reverse search, Ctrl-L to clear the screen and Ctrl-C to abandon the
+ * line. Output for each key is sent in one write, and only the part of the line that changed
+ * is redrawn.
+*/
+ssize_t editLine(const char* prompt, char** buf, size_t* cap) {
+    struct termios cooked;
+    struct termios raw;
+    struct winsize ws;
+    struct sigaction sa;
+    struct sigaction old_winch;
+    LineEditor e;
+
+    memset(&e, 0, sizeof(e));
+    e.buf = *buf;
+    e.cap = *cap;
+    if (e.cap < 64) {
+        e.cap = 64;
+        e.buf = realloc(e.buf, e.cap);
+    }
+    e.buf[0] = '\0';
+    const char* last_line = strrchr(prompt, '\n');
+    e.prompt = last_line != NULL ? last_line + 1 : prompt;
+    e.prompt_cols = editorWidth(e.prompt, strlen(e.prompt));
+    e.cols = ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0 && ws.ws_col > 0 ? ws.ws_col : 80;
+    e.history_pos = HISTORY_UNMAPPED;
+
+    //SIGWINCH interrupts the read below, so it is only caught while a line is being edited
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = sigwinchHandler;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGWINCH, &sa, &old_winch);
+    terminal_resized = 0;
+
+    tcgetattr(STDIN_FILENO, &cooked);
+    raw = cooked;
+    raw.c_iflag &= ~(BRKINT | ICRNL | INPCK | ISTRIP | IXON);
+    raw.c_cflag |= CS8;
+    raw.c_lflag &= ~(ECHO | ICANON | IEXTEN | ISIG);
+    raw.c_cc[VMIN] = 1;
+    raw.c_cc[VTIME] = 0;
+    tcsetattr(STDIN_FILENO, TCSADRAIN, &raw);
+
+    fflush(stdout);
+    editorOut(&e, "\x1b[?2004h", 8);
+    editorOut(&e, prompt, strlen(prompt));
+    e.cursor = e.prompt_cols;
+
+    ssize_t result = -2;
+    while (result == -2) {
+        editorFlush(&e);
+        int c = editorReadByte(-1);
+
+        if (c == 18) {
+            c = editorSearch(&e);
+        }
+        if (c == 27) {
+            c = editorReadEscape();
+        }
+        if (c == EDITOR_RESIZE) {
+            terminal_resized = 0;
+            e.cols = ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0 && ws.ws_col > 0 ? ws.ws_col : 80;
+            //The terminal has reflowed the old text, so start again on a fresh row
+            e.cursor = 0;
+            editorOut(&e, "\r\x1b[J", 4);
+            editorRefresh(&e);
+            continue;
+        }
+
+        switch (c) {
+        case EDITOR_EOF:
+            result = e.len > 0 ? (ssize_t)e.len : -1;
+            break;
+        case 13:
+        case 10:
+            result = e.len;
+            break;
+        case 3:
+            //Ctrl-C abandons the line
+            editorSetPos(&e, e.len);
+            editorOut(&e, "^C", 2);
+            e.cursor += 2;
+            e.len = 0;
+            e.pos = 0;
+            e.buf[0] = '\0';
+            result = 0;
+            break;
+        case 4:
+            if (e.len == 0) {
+                result = -1;
+            }
+            else {
+                editorDelete(&e, e.pos, editorStep(&e, e.pos, 1));
+            }
+            break;
+        case EDITOR_KEY_DELETE:
+            editorDelete(&e, e.pos, editorStep(&e, e.pos, 1));
+            break;
+        case 127:
+        case 8:
+            editorDelete(&e, editorStep(&e, e.pos, -1), e.pos);
+            break;
+        case 23:
+            editorDelete(&e, editorWord(&e, -1), e.pos);
+            break;
+        case 21:
+            editorDelete(&e, 0, e.pos);
+            break;
+        case 11:
+            editorDelete(&e, e.pos, e.len);
+            break;
+        case 2:
+        case EDITOR_KEY_LEFT:
+            editorSetPos(&e, editorStep(&e, e.pos, -1));
+            break;
+        case 6:
+        case EDITOR_KEY_RIGHT:
+            editorSetPos(&e, editorStep(&e, e.pos, 1));
+            break;
+        case EDITOR_KEY_WORD_LEFT:
+            editorSetPos(&e, editorWord(&e, -1));
+            break;
+        case EDITOR_KEY_WORD_RIGHT:
+            editorSetPos(&e, editorWord(&e, 1));
+            break;
+        case 1:
+        case EDITOR_KEY_HOME:
+            editorSetPos(&e, 0);
+            break;
+        case 5:
+        case EDITOR_KEY_END:
+            editorSetPos(&e, e.len);
+            break;
+        case 12:
+            editorOut(&e, "\x1b[H\x1b[2J", 7);
+            e.cursor = 0;
+            editorRefresh(&e);
+            break;
+        case 16:
+        case 14:
+        case EDITOR_KEY_UP:
+        case EDITOR_KEY_DOWN: {
+            int older = c == 16 || c == EDITOR_KEY_UP;
+            if (e.history_pos == HISTORY_UNMAPPED) {
+                mapHistory();
+                e.history_pos = history_size;
+            }
+            long previous = historyPrevious(e.history_pos);
+            if ((older && previous < 0) || (!older && e.history_pos >= history_size)) {
+                break;
+            }
+            //Keep what was being typed so Down can bring it back
+            if (e.history_pos == history_size) {
+                free(e.saved);
+                e.saved = strdup(e.buf);
+            }
+            e.history_pos = older ? (size_t)previous : historyEntryEnd(e.history_pos);
+            size_t len;
+            const char* entry = e.history_pos < history_size ? historyEntry(e.history_pos, &len) : e.saved;
+            editorSetLine(&e, entry, e.history_pos < history_size ? len : strlen(entry));
+            break;
+        }
+        case EDITOR_KEY_PASTE:
+            editorPaste(&e);
+            break;
+        case 9:
+            editorComplete(&e);
+            break;
+        default:
+            if (c >= 32 && c < 256 && c != 127) {
+                char byte = c;
+                editorInsert(&e, &byte, 1);
+            }
+        }
+    }
+
+    //Leave the cursor after the line so command output starts on a fresh row
+    size_t end = e.prompt_cols + editorWidth(e.buf, e.len);
+    editorMoveTo(&e, e.cursor > end ? e.cursor : end);
+    editorOut(&e, "\x1b[?2004l", 8);
+    if (e.cursor == 0 || e.cursor % e.cols != 0) {
+        editorOut(&e, "\r\n", 2);
+    }
+    editorFlush(&e);
+    tcsetattr(STDIN_FILENO, TCSADRAIN, &cooked);
+    sigaction(SIGWINCH, &old_winch, NULL);
+
+    if (result > 0) {
+        historyAdd(e.buf, e.len);
+    }
+    free(e.saved);
+    free(e.out);
+    *buf = e.buf;
+    *cap = e.cap;
+    return result;
+}
+
+/**
+ * @brief Completes the word before the cursor when Tab is pressed.
+ * @param e The editor.
+ * @details A single match is inserted with a space after it (or the / of a directory). Several
+ * matches are extended to their longest common prefix, and when that adds nothing they are
+ * listed below the line, which is then drawn again. No match rings the bell.
+*/
+void editorComplete(LineEditor* e) {
+    size_t start = e->pos;
+    while (start > 0 && !isspace((unsigned char)e->buf[start - 1]) && strchr("|;&<>(", e->buf[start - 1]) == NULL) {
+        start--;
+    }
+    size_t before = start;
+    while (before > 0 && isspace((unsigned char)e->buf[before - 1])) {
+        before--;
+    }
+    int command = before == 0 || strchr("|;&(", e->buf[before - 1]) != NULL;
+
+    char** matches;
+    size_t word_len = e->pos - start;
+    size_t count = completeWord(e->buf + start, word_len, command, &matches);
+    if (count == 0) {
+        editorOut(e, "\a", 1);
+        return;
+    }
+
+    size_t common = strlen(matches[0]);
+    for (size_t i = 1; i < count; i++) {
+        size_t j = word_len;
+        while (j < common && matches[i][j] == matches[0][j]) {
+            j++;
+        }
+        common = j;
+    }
+    if (count == 1) {
+        editorInsert(e, matches[0] + word_len, common - word_len);
+        if (common == 0 || matches[0][common - 1] != '/') {
+            editorInsert(e, " ", 1);
+        }
+        return;
+    }
+    if (common > word_len) {
+        editorInsert(e, matches[0] + word_len, common - word_len);
+        return;
+    }
+
+    //Nothing more in common: list the matches in columns under the line
+    size_t width = 0;
+    for (size_t i = 0; i < count; i++) {
+        size_t len = strlen(matches[i]);
+        width = len > width ? len : width;
+    }
+    width += 2;
+    size_t per_row = e->cols > width ? e->cols / width : 1;
+    size_t shown = count < COMPLETION_LIST_MAX ? count : COMPLETION_LIST_MAX;
+
+    editorMoveTo(e, e->prompt_cols + editorWidth(e->buf, e->len));
+    if (e->cursor == 0 || e->cursor % e->cols != 0) {
+        editorOut(e, "\r\n", 2);
+    }
+    for (size_t i = 0; i < shown; i++) {
+        size_t len = strlen(matches[i]);
+        editorOut(e, matches[i], len);
+        if ((i + 1) % per_row == 0 || i + 1 == shown) {
+            editorOut(e, "\r\n", 2);
+        }
+        else {
+            editorOut(e, "                                ", width - len < 32 ? width - len : 32);
+        }
+    }
+    if (shown < count) {
+        char more[48];
+        editorOut(e, more, snprintf(more, sizeof(more), "(%zu more)\r\n", count - shown));
+    }
+    e->cursor = 0;
+    editorRefresh(e);
+}
+
+/**
+ * @brief Lists the completions of a word.
+ * @param word The word; it does not need to be NUL-terminated.
+ * @param len The length of the word up to the cursor.
+ * @param command Whether the word is where a command name goes.
+ * @param matches Set to the matches, sorted and without duplicates, in line_arena.
+ * @return The number of matches.
+ * @details Command names come from the builtins and the command index, so completing one costs
+ * a binary search rather than a scan of PATH. Any other word, or a command containing a slash,
+ * completes to file names, with a / after directories.
+*/
+size_t completeWord(const char* word, size_t len, int command, char*** matches) {
+    char* prefix = arenaCopy(&line_arena, word, len);
+    size_t cap = 64;
+    size_t count = 0;
+    char** found = arenaAlloc(&line_arena, sizeof(char*) * cap);
+
+    if (command && strchr(prefix, '/') == NULL) {
+        for (int i = 0; i < BUILTIN_COUNT; i++) {
+            if (strncmp(builtins[i].name, prefix, len) == 0) {
+                found = appendWord(found, &count, &cap, (char*)builtins[i].name);
+            }
+        }
+        CommandIndex* index = commandIndex(1);
+        if (index != NULL) {
+            for (size_t i = findIndexEntry(index, prefix); i < index->count; i++) {
+                char* name = index->strings + index->entries[i].offset;
+                if (strncmp(name, prefix, len) != 0) {
+                    break;
+                }
+                found = appendWord(found, &count, &cap, arenaCopy(&line_arena, name, strlen(name)));
+            }
+        }
+    }
+    else {
+        char* slash = strrchr(prefix, '/');
+        size_t dir_len = slash != NULL ? (size_t)(slash - prefix) + 1 : 0;
+        const char* base = prefix + dir_len;
+        size_t base_len = len - dir_len;
+        char* dir_name = dir_len > 0 ? arenaCopy(&line_arena, prefix, dir_len) : ".";
+        DIR* dir = opendir(dir_name);
+        struct dirent* ent;
+
+        while (dir != NULL && (ent = readdir(dir)) != NULL) {
+            if (strncmp(ent->d_name, base, base_len) != 0 || (ent->d_name[0] == '.' && base[0] != '.')) {
+                continue;
+            }
+            if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0) {
+                continue;
+            }
+            struct stat st;
+            int is_dir = ent->d_type == DT_DIR;
+            if ((ent->d_type == DT_LNK || ent->d_type == DT_UNKNOWN) && fstatat(dirfd(dir), ent->d_name, &st, 0) == 0) {
+                is_dir = S_ISDIR(st.st_mode);
+            }
+            size_t name_len = strlen(ent->d_name);
+            char* match = arenaAlloc(&line_arena, dir_len + name_len + 2);
+            memcpy(match, prefix, dir_len);
+            memcpy(match + dir_len, ent->d_name, name_len);
+            match[dir_len + name_len] = '/';
+            match[dir_len + name_len + is_dir] = '\0';
+            found = appendWord(found, &count, &cap, match);
+        }
+        if (dir != NULL) {
+            closedir(dir);
+        }
+    }
+
+    qsort(found, count, sizeof(char*), compareStrings);
+    size_t kept = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (kept == 0 || strcmp(found[kept - 1], found[i]) != 0) {
+            found[kept++] = found[i];
+        }
+    }
+    *matches = found;
+    return kept;
+}
+
+/**
+ * @brief qsort comparator for an array of strings.
+*/
+int compareStrings(const void* a, const void* b) {
+    return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+/**
+ * @brief Prints a welcome message with the current date and time.
+ * @details Only interactive shells started without -q print it, so scripts and -c never load
+ * the timezone data localtime() needs.
+ */
+void welcomeMessage() {
+    time_t t;
+    struct tm* tm_info;
+    char dateBuffer[20];
+    char timeBuffer[20];
+    time(&t);
+    tm_info = localtime(&t);
+    strftime(dateBuffer, sizeof(dateBuffer), "%m/%d/%Y", tm_info);
+    strftime(timeBuffer, sizeof(timeBuffer), "%H:%M:%S", tm_info);
+    printf("**************************************************\n"
+        "*             Welcome to SeaShell                *\n"
+        "*                  Created by                    *\n"
+        "*                Jacob Leonardo                  *\n"
+        "*                                                *\n"
+        "*                 Date: %s               *\n"
+        "*                 Time: %s                 *\n"
+        "**************************************************\n\n", dateBuffer, timeBuffer);
+}
+
+/**
+ * @brief Allocates memory that lives until the arena is next reset.
+ * @param arena The arena to allocate from.
+ * @param size The number of bytes needed.
+ * @return Pointer-aligned memory; never NULL (the shell exits if memory runs out).
+ * @details Requests larger than a block get a block of their own, so a single line can be
+ * arbitrarily long.
+*/
+void* arenaAlloc(Arena* arena, size_t size) {
+    size = (size + sizeof(void*) - 1) & ~(sizeof(void*) - 1);
+
+    ArenaBlock* block = arena->head;
+    if (block == NULL || block->size - block->used < size) {
+        size_t block_size = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+        block = malloc(sizeof(ArenaBlock) + block_size);
+        if (block == NULL) {
+            perror("Error: Out of memory");
+            exit(1);
+        }
+        block->size = block_size;
+        block->used = 0;
+        block->next = arena->head;
+        arena->head = block;
+    }
+
+    void* ptr = block->data + block->used;
+    block->used += size;
+    return ptr;
+}
+
+/**
+ * @brief Releases everything allocated from an arena in one step.
+ * @param arena The arena to reset.
+ * @details If the last line needed several blocks, they are replaced by one block big enough
+ * for all of them (up to ARENA_KEEP_MAX), so a run of similar long lines stops hitting malloc.
+*/
+void arenaReset(Arena* arena) {
+    ArenaBlock* block = arena->head;
+    if (block == NULL) {
+        return;
+    }
+    if (block->next == NULL) {
+        block->used = 0;
+        return;
+    }
+
+    size_t total = 0;
+    while (block != NULL) {
+        ArenaBlock* next = block->next;
+        total += block->size;
+        free(block);
+        block = next;
+    }
+    if (total > ARENA_KEEP_MAX) {
+        total = ARENA_KEEP_MAX;
+    }
+
+    arena->head = NULL;
+    arenaAlloc(arena, total);
+    arena->head->used = 0;
+}
+
+/**
+ * @brief Copies a string into an arena.
+ * @param arena The arena.
+ * @param text The bytes to copy; they do not need to be NUL-terminated.
+ * @param len The number of bytes.
+ * @return The NUL-terminated copy.
+*/
+char* arenaCopy(Arena* arena, const char* text, size_t len) {
+    char* copy = arenaAlloc(arena, len + 1);
+    memcpy(copy, text, len);
+    copy[len] = '\0';
+    return copy;
+}
+
+/**
+ * @brief Records how far an arena has been allocated.
+ * @param arena The arena.
+ * @return The mark, for arenaRelease().
+*/
+ArenaMark arenaMark(Arena* arena) {
+    ArenaMark mark = { arena->head, arena->head != NULL ? arena->head->used : 0 };
+    return mark;
+}
+
+/**
+ * @brief Releases everything allocated from an arena since a mark was taken.
+ * @param arena The arena.
+ * @param mark The mark; an empty mark, { NULL, 0 }, releases every block.
+ * @details Lets a loop give back what each iteration allocated, so a long loop runs in the
+ * memory of one iteration. Blocks added after the mark are freed.
+*/
+void arenaRelease(Arena* arena, ArenaMark mark) {
+    while (arena->head != mark.block) {
+        ArenaBlock* next = arena->head->next;
+        free(arena->head);
+        arena->head = next;
+    }
+    if (arena->head != NULL) {
+        arena->head->used = mark.used;
+    }
+}
+
+/**
+ * @brief Splits a command line into words and operators.
+ * @param arena The arena the token array is allocated from.
+ * @param text The NUL-terminated line; it is not modified.
+ * @param len The length of the line.
+ * @param tokens Set to the array of token views.
+ * @return The number of tokens, or TOKENS_INCOMPLETE if a quote, $(...) or trailing backslash
+ * is still open at the end of the line, or a here-document has not reached its delimiter, or
+ * TOKENS_ERROR if a word is too long.
+ * @details Makes one pass over the line and never calls malloc per token: the view array lives
+ * in the arena and doubles when full, leaving the old copy to be released with the arena.
+ * Words end at a blank, a newline or an operator, so "a>b" and "x|y" are three tokens each, but
+ * quotes, backslashes, $(...), <(...) and >(...) keep everything inside them in the word. Digits
+ * right before a < or > are an IO_NUMBER, and a # at the start of a word begins a comment that
+ * runs to the next newline. The delimiter word of << and <<- is followed by two TOKEN_HEREDOC
+ * tokens, at the start of the body and at its delimiter line, so a body is not limited to
+ * TOKEN_LENGTH_MAX. The body is taken from the lines after the next newline, so a command in a
+ * loop or function reads its here-document once, with the rest of its text.
+*/
+size_t tokenizeLine(Arena* arena, const char* text, size_t len, Token** tokens) {
+    size_t cap = 16;
+    size_t count = 0;
+    Token* views = arenaAlloc(arena, sizeof(Token) * cap);
+    size_t i = 0;
+    //Indexes of the TOKEN_HEREDOC pairs whose bodies start after the next newline
+    size_t* pending = NULL;
+    size_t npending = 0;
+    size_t pending_cap = 0;
+
+    open_heredoc = NULL;
+    while (i < len) {
+        while (i < len && lex_class[(unsigned char)text[i]] == LEX_BLANK) {
+            i++;
+        }
+        if (i >= len) {
+            break;
+        }
+        if (text[i] == '#') {
+            const char* newline = memchr(text + i, '\n', len - i);
+            i = newline != NULL ? (size_t)(newline - text) : len;
+            continue;
+        }
+
+        size_t start = i;
+        int type = TOKEN_WORD;
+        int flags = 0;
+        if (text[i] == '\n') {
+            type = TOKEN_NEWLINE;
+            i++;
+        }
+        else if (lex_class[(unsigned char)text[i]] == LEX_OPERATOR && !((text[i] == '<' || text[i] == '>') && text[i + 1] == '(')) {
+            //The longest operator that fits
+            size_t best = 0;
+            for (int t = TOKEN_PIPE; t <= TOKEN_ANDDGREAT; t++) {
+                if (t == TOKEN_NEWLINE || t == TOKEN_HEREDOC) {
+                    continue;
+                }
+                size_t op_len = strlen(token_spellings[t]);
+                if (op_len > best && op_len <= len - i && memcmp(text + i, token_spellings[t], op_len) == 0) {
+                    best = op_len;
+                    type = t;
+                }
+            }
+            i += best;
+        }
+        else {
+            while (i < len) {
+                //The NUL after the line is a blank, so ordinary bytes need no bounds check
+                while (lex_class[(unsigned char)text[i]] == 0) {
+                    i++;
+                }
+                int cls = lex_class[(unsigned char)text[i]];
+                if (cls == LEX_BLANK || cls == LEX_NEWLINE || (cls == LEX_OPERATOR && !((text[i] == '<' || text[i] == '>') && text[i + 1] == '('))) {
+                    break;
+                }
+                if (cls == LEX_GLOB) {
+                    flags |= WORD_GLOB;
+                    i++;
+                    continue;
+                }
+
+                size_t end;
+                if (cls == LEX_OPERATOR || (cls == LEX_DOLLAR && text[i + 1] == '(')) {
+                    flags |= WORD_EXPAND;
+                    end = skipParens(text, i + 1, len);
+                    end += end != TOKENS_INCOMPLETE;
+                }
+                else if (cls == LEX_DOLLAR) {
+                    flags |= WORD_EXPAND;
+                    end = i + 1;
+                }
+                else {
+                    flags |= WORD_QUOTED;
+                    end = skipQuoted(text, i, len);
+                    if (text[i] == '"' && end != TOKENS_INCOMPLETE && memchr(text + i, '$', end - i) != NULL) {
+                        flags |= WORD_EXPAND;
+                    }
+                }
+                if (end == TOKENS_INCOMPLETE) {
+                    return TOKENS_INCOMPLETE;
+                }
+                i = end;
+            }
+
+            if (flags == 0 && i < len && (text[i] == '<' || text[i] == '>') && text[i + 1] != '(') {
+                size_t digits = start;
+                while (digits < i && isdigit((unsigned char)text[digits])) {
+                    digits++;
+                }
+                type = digits == i ? TOKEN_IO_NUMBER : TOKEN_WORD;
+            }
+        }
+
+        if (i - start > TOKEN_LENGTH_MAX) {
+            fprintf(stderr, "Error: word longer than %u bytes\n", TOKEN_LENGTH_MAX);
+            return TOKENS_ERROR;
+        }
+        if (count == cap) {
+            Token* grown = arenaAlloc(arena, sizeof(Token) * cap * 2);
+            memcpy(grown, views, sizeof(Token) * cap);
+            views = grown;
+            cap *= 2;
+        }
+        views[count].offset = start;
+        views[count].length = i - start;
+        views[count].type = type;
+        views[count].flags = flags;
+        count++;
+
+        if (type == TOKEN_WORD && count >= 2 && (views[count - 2].type == TOKEN_DLESS || views[count - 2].type == TOKEN_DLESSDASH)) {
+            //Placeholders for the body, filled in at the end of the line
+            if (count + 2 > cap) {
+                Token* grown = arenaAlloc(arena, sizeof(Token) * cap * 2);
+                memcpy(grown, views, sizeof(Token) * count);
+                views = grown;
+                cap *= 2;
+            }
+            for (int k = 0; k < 2; k++) {
+                views[count + k].offset = 0;
+                views[count + k].length = 0;
+                views[count + k].type = TOKEN_HEREDOC;
+                views[count + k].flags = 0;
+            }
+            if (npending == pending_cap) {
+                size_t* grown = arenaAlloc(arena, sizeof(size_t) * (pending_cap * 2 + 4));
+                if (npending > 0) {
+                    memcpy(grown, pending, sizeof(size_t) * npending);
+                }
+                pending = grown;
+                pending_cap = pending_cap * 2 + 4;
+            }
+            pending[npending++] = count;
+            count += 2;
+        }
+        else if (type == TOKEN_NEWLINE && npending > 0) {
+            for (size_t h = 0; h < npending; h++) {
+                i = scanHereDoc(arena, text, i, len, &views[pending[h]]);
+                if (i == TOKENS_INCOMPLETE) {
+                    return TOKENS_INCOMPLETE;
+                }
+            }
+            npending = 0;
+        }
+    }
+
+    if (npending > 0) {
+        return TOKENS_INCOMPLETE;
+    }
+    *tokens = views;
+    return count;
+}
+
+/**
+ * @brief Finds the body of a here-document.
+ * @param arena The arena for the unquoted delimiter.
+ * @param text The line.
+ * @param i Where the body starts: just after the newline that ends its command.
+ * @param len The length of the line.
+ * @param body The first of the two TOKEN_HEREDOC tokens after the delimiter word and that
+ * word's << or <<-. Its offset is set to the start of the body and the second one's to the start
+ * of the delimiter line, so the body, trailing newline included, lies between the two. Its flags
+ * are set to WORD_EXPAND if the delimiter was not quoted and the body has a $ or \ in it.
+ * @return Where the text after the delimiter line starts, or TOKENS_INCOMPLETE if the delimiter
+ * line has not been read yet.
+*/
+size_t scanHereDoc(Arena* arena, const char* text, size_t i, size_t len, Token* body) {
+    Token* word = body - 1;
+    int strip_tabs = (body - 2)->type == TOKEN_DLESSDASH;
+
+    //The delimiter only loses its quotes
+    char* delimiter = arenaAlloc(arena, word->length + 1);
+    size_t delim_len = 0;
+    for (size_t k = word->offset; k < word->offset + word->length; k++) {
+        if (text[k] == '\\' && k + 1 < word->offset + word->length) {
+            delimiter[delim_len++] = text[++k];
+        }
+        else if (text[k] != '\'' && text[k] != '"') {
+            delimiter[delim_len++] = text[k];
+        }
+    }
+
+    size_t start = i;
+    while (1) {
+        if (i >= len) {
+            open_heredoc = delimiter;
+            open_heredoc_len = delim_len;
+            open_heredoc_strip = strip_tabs;
+            return TOKENS_INCOMPLETE;
+        }
+        const char* newline = memchr(text + i, '\n', len - i);
+        size_t end = newline != NULL ? (size_t)(newline - text) : len;
+        size_t line = i;
+        while (strip_tabs && line < end && text[line] == '\t') {
+            line++;
+        }
+        if (end - line == delim_len && memcmp(text + line, delimiter, delim_len) == 0) {
+            break;
+        }
+        i = end + 1;
+    }
+
+    body[0].offset = start;
+    body[1].offset = i;
+    if (!(word->flags & WORD_QUOTED) && (memchr(text + start, '$', i - start) != NULL || memchr(text + start, '\\', i - start) != NULL)) {
+        body[0].flags = WORD_EXPAND;
+    }
+    const char* newline = memchr(text + i, '\n', len - i);
+    return newline != NULL ? (size_t)(newline - text) + 1 : len;
+}
+
+/**
+ * @brief Skips a quoted part of a word.
+ * @param text The line.
+ * @param i The position of the opening ', " or of a backslash.
+ * @param len The length of the line.
+ * @return The position just after the quoted part, or TOKENS_INCOMPLETE if it is not closed.
+ * @details Inside double quotes a backslash escapes the next character and $(...) may hold
+ * quotes of its own.
+*/
+size_t skipQuoted(const char* text, size_t i, size_t len) {
+    if (text[i] == '\\') {
+        return i + 1 < len ? i + 2 : TOKENS_INCOMPLETE;
+    }
+    if (text[i] == '\'') {
+        const char* close = memchr(text + i + 1, '\'', len - i - 1);
+        return close != NULL ? (size_t)(close - text) + 1 : TOKENS_INCOMPLETE;
+    }
+
+    for (size_t j = i + 1; j < len; j++) {
+        if (text[j] == '"') {
+            return j + 1;
+        }
+        if (text[j] == '\\') {
+            j++;
+        }
+        else if (text[j] == '$' && text[j + 1] == '(') {
+            j = skipParens(text, j + 1, len);
+            if (j == TOKENS_INCOMPLETE) {
+                break;
+            }
+        }
+    }
+    return TOKENS_INCOMPLETE;
+}
+
+/**
+ * @brief Finds the parenthesis that closes a $(, <( or >(.
+ * @param text The line.
+ * @param i The position of the opening parenthesis.
+ * @param len The length of the line.
+ * @return The position of the closing parenthesis, or TOKENS_INCOMPLETE if there is none.
+ * @details Parentheses inside quotes do not count.
+*/
+size_t skipParens(const char* text, size_t i, size_t len) {
+    int depth = 0;
+    while (i < len) {
+        char c = text[i];
+        if (c == '\'' || c == '"' || c == '\\') {
+            i = skipQuoted(text, i, len);
+            if (i == TOKENS_INCOMPLETE) {
+                break;
+            }
+            continue;
+        }
+        depth += c == '(' ? 1 : c == ')' ? -1 : 0;
+        if (depth == 0) {
+            return i;
+        }
+        i++;
+    }
+    return TOKENS_INCOMPLETE;
+}
+
+/**
+ * @brief Expands one word as typed: removes its quotes and replaces its parameters such as $NAME
+ * or $1, every $(...) with the output of the command inside it, and every <(...) or >(...) with
+ * the /dev/fd path of a pipe to the command inside it.
+ * @param words The argv the results are appended to, in line_arena.
+ * @param count The number of words so far; updated.
+ * @param cap The capacity of words; updated when it grows.
+ * @param text The word, NUL-terminated, quotes and all.
+ * @param mode EXPAND_FIELDS to split unquoted expansions and expand patterns, as for a command's
+ * arguments; EXPAND_STRING to keep the result as one string, as for NAME=value or a redirection
+ * target; EXPAND_UNQUOTE to only remove quotes, as for a here-document delimiter;
+ * EXPAND_PATTERN to keep one string with quoted pattern characters escaped, as for a case pattern;
+ * EXPAND_HEREDOC to keep one string in which quotes are ordinary characters, as for the body of
+ * a here-document whose delimiter was not quoted.
+ * @return The argv, which moves when it grows.
+ * @details As in sh, $(...) output loses its trailing newlines, and unquoted output and parameter
+ * values are split into separate fields at blanks and newlines, with text around the expansion
+ * joining the first and last fields. Nothing inside single quotes is special; inside double
+ * quotes expansions still happen but are not split, and "$@" gives one field per positional
+ * parameter. Quoted pattern characters match only themselves. A word that expands to nothing
+ * unquoted disappears.
+*/
+char** expandWord(char** words, size_t* count, size_t* cap, const char* text, int mode) {
+    Field f = { NULL, 0, 0, mode, 0, 0, 0 };
+    //A here-document body is expanded as if in double quotes that never close
+    int heredoc = mode == EXPAND_HEREDOC;
+    int quoted = heredoc;
+    const char* p = text;
+
+    while (*p != '\0') {
+        if (*p == '\'' && !quoted) {
+            const char* close = strchrnul(p + 1, '\'');
+            fieldAppend(&f, p + 1, close - (p + 1), FIELD_QUOTED);
+            f.have = 1;
+            p = *close != '\0' ? close + 1 : close;
+            continue;
+        }
+        if (*p == '"' && !heredoc) {
+            f.have |= !quoted;
+            quoted = !quoted;
+            p++;
+            continue;
+        }
+        if (*p == '\\') {
+            if (p[1] == '\n') {
+                //A line continuation disappears
+                p += 2;
+            }
+            else if (p[1] == '\0' || (quoted && strchr(heredoc ? "$`\\" : "$`\"\\", p[1]) == NULL)) {
+                fieldAppend(&f, p, 1, FIELD_QUOTED);
+                p++;
+            }
+            else {
+                fieldAppend(&f, p + 1, 1, FIELD_QUOTED);
+                p += 2;
+            }
+            continue;
+        }
+
+        int procsub = !quoted && (*p == '<' || *p == '>') && p[1] == '(';
+        if (mode == EXPAND_UNQUOTE || (*p != '$' && !procsub)) {
+            //A run of ordinary characters
+            size_t run = 1 + strcspn(p + 1, heredoc ? "\\$" : quoted ? "\"\\$" : "'\"\\$<>");
+            fieldAppend(&f, p, run, quoted ? FIELD_QUOTED : FIELD_LITERAL);
+            p += run;
+            continue;
+        }
+
+        if (procsub || p[1] == '(') {
+            size_t close = skipParens(p, 1, strlen(p));
+            if (close == TOKENS_INCOMPLETE) {
+                fieldAppend(&f, p, 1, quoted ? FIELD_QUOTED : FIELD_LITERAL);
+                p++;
+                continue;
+            }
+            if (procsub) {
+                //A process substitution is one path, never split
+                char* path = processSubstitution(p + 2, close - 2, *p == '>');
+                fieldAppend(&f, path, strlen(path), FIELD_QUOTED);
+            }
+            else {
+                size_t output_len;
+                char* output = captureCommand(p + 2, close - 2, &output_len);
+                words = fieldExpansion(words, count, cap, &f, output, output_len, quoted);
+            }
+            p += close + 1;
+            continue;
+        }
+
+        if (quoted && !heredoc && (strncmp(p, "$@", 2) == 0 || strncmp(p, "${@}", 4) == 0)) {
+            //Each positional parameter is a field of its own
+            for (int i = 0; i < script_argc; i++) {
+                if (i > 0) {
+                    words = finishField(words, count, cap, &f);
+                    f.have = 1;
+                }
+                fieldAppend(&f, script_args[i], strlen(script_args[i]), FIELD_QUOTED);
+            }
+            f.have = script_argc > 0 || f.len > 0;
+            p += p[1] == '@' ? 2 : 4;
+            continue;
+        }
+
+        const char* end;
+        const char* value = expandParameter(p, &end);
+        if (value == NULL) {
+            //Not an expansion after all, such as a lone $ or ${ with no closing brace
+            fieldAppend(&f, p, 1, quoted ? FIELD_QUOTED : FIELD_LITERAL);
+            p++;
+            continue;
+        }
+        words = fieldExpansion(words, count, cap, &f, value, strlen(value), quoted);
+        p = end + 1;
+    }
+
+    if (mode != EXPAND_FIELDS) {
+        //There is always exactly one result, even an empty one
+        f.have = 1;
+    }
+    words = finishField(words, count, cap, &f);
+    free(f.text);
+    return words;
+}
+
+/**
+ * @brief Expands a word into a single string.
+ * @param text The word, NUL-terminated, quotes and all.
+ * @param mode EXPAND_STRING, EXPAND_UNQUOTE or EXPAND_PATTERN, as for expandWord().
+ * @return The result, in line_arena.
+*/
+char* expandString(const char* text, int mode) {
+    size_t count = 0;
+    size_t cap = 2;
+    char** words = arenaAlloc(&line_arena, sizeof(char*) * cap);
+    words = expandWord(words, &count, &cap, text, mode);
+    return words[0];
+}
+
+/**
+ * @brief Adds the output of an expansion to the word being built.
+ * @param words The argv finished fields are appended to.
+ * @param count The number of words so far; updated.
+ * @param cap The capacity of words; updated when it grows.
+ * @param f The field.
+ * @param value The output; it may hold NUL bytes, which cannot be passed on and are dropped.
+ * @param len The length of the output.
+ * @param quoted Whether the expansion was inside double quotes.
+ * @return The argv.
+ * @details Unquoted output in EXPAND_FIELDS mode is split at blanks and newlines, each one
+ * finishing the field so far.
+*/
+char** fieldExpansion(char** words, size_t* count, size_t* cap, Field* f, const char* value, size_t len, int quoted) {
+    int split = !quoted && f->mode == EXPAND_FIELDS;
+    for (size_t k = 0; k < len;) {
+        size_t run = split ? strcspn(value + k, " \t\n") : strlen(value + k);
+        if (run == 0) {
+            if (split && value[k] != '\0') {
+                words = finishField(words, count, cap, f);
+            }
+            k++;
+            continue;
+        }
+        fieldAppend(f, value + k, run, quoted ? FIELD_QUOTED : FIELD_EXPANDED);
+        k += run;
+    }
+    return words;
+}
+
+/**
+ * @brief Appends text to the word being built.
+ * @param f The field.
+ * @param text The text.
+ * @param len Its length.
+ * @param kind FIELD_LITERAL for unquoted text of the word, FIELD_QUOTED for quoted text, or
+ * FIELD_EXPANDED for unquoted expansion output.
+ * @details In EXPAND_FIELDS and EXPAND_PATTERN mode a backslash goes before every backslash,
+ * and before every quoted *, ?, [ and ], so that globbing sees them as escaped. Unquoted pattern
+ * characters mark the field as a possible pattern.
+*/
+void fieldAppend(Field* f, const char* text, size_t len, int kind) {
+    if (f->len + len * 2 + 1 > f->cap) {
+        f->cap = (f->len + len * 2 + 1) * 2;
+        f->text = realloc(f->text, f->cap);
+    }
+    f->have |= len > 0;
+    if (f->mode != EXPAND_FIELDS && f->mode != EXPAND_PATTERN) {
+        memcpy(f->text + f->len, text, len);
+        f->len += len;
+        return;
+    }
+
+    for (size_t i = 0; i < len; i++) {
+        char c = text[i];
+        int special = c == '*' || c == '?' || c == '[' || c == ']';
+        if (c == '\\' || (special && kind == FIELD_QUOTED)) {
+            f->text[f->len++] = '\\';
+            f->escaped = 1;
+        }
+        else if (special) {
+            f->pattern = 1;
+        }
+        f->text[f->len++] = c;
+    }
+}
+
+/**
+ * @brief Ends the word being built and appends it, or the paths it matches, to an argv.
+ * @param words The argv.
+ * @param count The number of words so far; updated.
+ * @param cap The capacity of words; updated when it grows.
+ * @param f The field; it is emptied for the next word.
+ * @return The argv.
+ * @details A pattern that matches nothing is kept as it is, as in sh, less its escapes. In
+ * EXPAND_PATTERN mode the field is kept as it is, escapes and all.
+*/
+char** finishField(char** words, size_t* count, size_t* cap, Field* f) {
+    if (!f->have) {
+        return words;
+    }
+    char* word = arenaCopy(&line_arena, f->text != NULL ? f->text : "", f->len);
+    int pattern = f->pattern;
+    int escaped = f->escaped;
+    f->len = 0;
+    f->have = 0;
+    f->pattern = 0;
+    f->escaped = 0;
+
+    if (f->mode == EXPAND_PATTERN) {
+        return appendWord(words, count, cap, word);
+    }
+    char** matches;
+    size_t nmatches = pattern && hasGlob(word, (size_t)-1) ? expandGlob(word, &matches) : 0;
+    for (size_t m = 0; m < nmatches; m++) {
+        words = appendWord(words, count, cap, matches[m]);
+    }
+    if (nmatches == 0) {
+        if (escaped) {
+            unescapeWord(word);
+        }
+        words = appendWord(words, count, cap, word);
+    }
+    return words;
+}
+
+/**
+ * @brief Removes the backslashes that escape characters in a word, in place.
+ * @param word The word.
+*/
+void unescapeWord(char* word) {
+    char* out = word;
+    for (char* in = word; *in != '\0'; in++) {
+        if (*in == '\\' && in[1] != '\0') {
+            in++;
+        }
+        *out++ = *in;
+    }
+    *out = '\0';
+}
+
+/**
+ * @brief Appends a word to an argv being built in line_arena.
+ * @param words The argv.
+ * @param count The number of words so far; incremented.
+ * @param cap The capacity of words; updated when it grows.
+ * @param word The word to append.
+ * @return The argv, which moves when it grows. There is always room for a terminating NULL.
+*/
+char** appendWord(char** words, size_t* count, size_t* cap, char* word) {
+    if (*count + 1 >= *cap) {
+        char** grown = arenaAlloc(&line_arena, sizeof(char*) * *cap * 2);
+        memcpy(grown, words, sizeof(char*) * *count);
+        words = grown;
+        *cap *= 2;
+    }
+    words[(*count)++] = word;
+    return words;
+}
+
+/**
+ * @brief Checks whether a word has an unescaped *, ? or [...] in it.
+ * @param word The word.
+ * @param len How much of the word to look at; it stops at a NUL in any case.
+ * @return 1 if the word is a pattern, otherwise 0.
+*/
+int hasGlob(const char* word, size_t len) {
+    for (size_t i = 0; i < len && word[i] != '\0'; i++) {
+        if (word[i] == '\\' && i + 1 < len && word[i + 1] != '\0') {
+            i++;
+        }
+        else if (word[i] == '*' || word[i] == '?') {
+            return 1;
+        }
+        else if (word[i] == '[') {
+            //A ] straight after the [ (or its !) is part of the set, not its end
+            size_t j = i + 1;
+            j += j < len && (word[j] == '!' || word[j] == '^');
+            j += j < len && word[j] == ']';
+            while (j < len && word[j] != '\0' && word[j] != ']' && word[j] != '/') {
+                j++;
+            }
+            if (j < len && word[j] == ']') {
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Lists the paths that match a pattern.
+ * @param pattern The pattern: *, ? and [...] match within one path component, and a component
+ * that is just ** matches any number of directories, or at the end everything below.
+ * @param matches Set to the matches, sorted, in line_arena.
+ * @return The number of matches.
+ * @details Names starting with a dot only match a component that starts with one, and . and ..
+ * never do. Directories are read through globListing(), so a directory named by several
+ * patterns on one line is read once.
+*/
+size_t expandGlob(const char* pattern, char*** matches) {
+    GlobState st;
+    st.path_cap = 256;
+    st.path = malloc(st.path_cap);
+    st.cap = 16;
+    st.count = 0;
+    st.found = arenaAlloc(&line_arena, sizeof(char*) * st.cap);
+
+    globWalk(&st, 0, pattern, 0);
+    free(st.path);
+
+    //Listings are sorted, so only patterns spanning several directories can need a sort
+    for (size_t i = 1; i < st.count; i++) {
+        if (strcmp(st.found[i - 1], st.found[i]) > 0) {
+            sortWords(st.found, st.count, 0);
+            break;
+        }
+    }
+    *matches = st.found;
+    return st.count;
+}
+
+/**
+ * @brief Matches the rest of a pattern below the path built so far.
+ * @param st The expansion.
+ * @param path_len The length of the path in st->path; it ends in / unless it is empty.
+ * @param rest The components still to match.
+ * @param exists Whether the path is known to exist, having come from a directory listing.
+*/
+void globWalk(GlobState* st, size_t path_len, const char* rest, int exists) {
+    size_t slashes = strspn(rest, "/");
+    path_len = globAppend(st, path_len, rest, slashes);
+    rest += slashes;
+
+    if (*rest == '\0') {
+        struct stat sb;
+        if (exists || (path_len > 0 && (st->path[path_len - 1] == '/' ? stat(st->path, &sb) : lstat(st->path, &sb)) == 0)) {
+            st->found = appendWord(st->found, &st->count, &st->cap, arenaCopy(&line_arena, st->path, path_len));
+        }
+        return;
+    }
+
+    const char* end = strchrnul(rest, '/');
+    size_t comp_len = end - rest;
+
+    if (!hasGlob(rest, comp_len)) {
+        //A literal component is taken as it is, without its backslashes
+        size_t len = path_len;
+        for (const char* c = rest; c < end; c++) {
+            c += *c == '\\' && c + 1 < end;
+            len = globAppend(st, len, c, 1);
+        }
+        globWalk(st, len, end, 0);
+        return;
+    }
+
+    GlobDir* dir = globListing(st->path);
+    if (comp_len == 2 && rest[0] == '*' && rest[1] == '*') {
+        //Zero directories first, then every directory below, without following symlinks
+        if (*end != '\0') {
+            globWalk(st, path_len, end + strspn(end, "/"), exists);
+        }
+        for (size_t i = 0; i < dir->count; i++) {
+            const char* name = dir->entries[i];
+            if (name[0] == '.') {
+                continue;
+            }
+            size_t len = globAppend(st, path_len, name, strlen(name));
+            if (*end == '\0') {
+                st->found = appendWord(st->found, &st->count, &st->cap, arenaCopy(&line_arena, st->path, len));
+            }
+            if (globIsDir(dir, i, 0)) {
+                globWalk(st, globAppend(st, len, "/", 1), rest, 1);
+            }
+        }
+        return;
+    }
+
+    for (size_t i = 0; i < dir->count; i++) {
+        const char* name = dir->entries[i];
+        if (name[0] == '.' && (rest[0] != '.' || name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) {
+            continue;
+        }
+        if (!globMatch(rest, comp_len, name)) {
+            continue;
+        }
+        //Only a directory can have more components matched below it
+        if (*end != '\0' && !globIsDir(dir, i, 1)) {
+            continue;
+        }
+        globWalk(st, globAppend(st, path_len, name, strlen(name)), end, 1);
+    }
+}
+
+/**
+ * @brief Appends text to the path of a glob expansion.
+ * @param st The expansion.
+ * @param path_len Where to append.
+ * @param text The text.
+ * @param len Its length.
+ * @return The new length of the path, which is left NUL-terminated.
+*/
+size_t globAppend(GlobState* st, size_t path_len, const char* text, size_t len) {
+    if (path_len + len + 1 > st->path_cap) {
+        st->path_cap = (path_len + len + 1) * 2;
+        st->path = realloc(st->path, st->path_cap);
+    }
+    memcpy(st->path + path_len, text, len);
+    st->path[path_len + len] = '\0';
+    return path_len + len;
+}
+
+/**
+ * @brief Returns the entries of a directory, reading it only the first time it is asked for on
+ * the current line.
+ * @param path The directory, ending in /, or "" for the current directory.
+ * @return The listing, which is empty if the directory cannot be read.
+ * @details Entries are read with getdents64() into a 1 MiB buffer, so a directory of a million
+ * entries takes a few dozen system calls, and their d_type is kept so that most entries never
+ * need a stat(). The listing is sorted once, here.
+*/
+GlobDir* globListing(const char* path) {
+    static char* buf = NULL;
+    unsigned int bucket = hashName(path, strlen(path)) % GLOB_CACHE_BUCKETS;
+
+    for (GlobDir* dir = glob_cache[bucket]; dir != NULL; dir = dir->next) {
+        if (strcmp(dir->path, path) == 0) {
+            return dir;
+        }
+    }
+
+    GlobDir* dir = calloc(1, sizeof(GlobDir));
+    dir->path = strdup(path);
+    dir->next = glob_cache[bucket];
+    glob_cache[bucket] = dir;
+
+    int fd = open(path[0] != '\0' ? path : ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) {
+        return dir;
+    }
+    if (buf == NULL) {
+        buf = malloc(GLOB_READ_SIZE);
+    }
+
+    size_t names_len = 0;
+    size_t names_cap = 0;
+    ssize_t n;
+    while ((n = getdents64(fd, buf, GLOB_READ_SIZE)) > 0) {
+        for (ssize_t off = 0; off < n;) {
+            struct dirent64* ent = (struct dirent64*)(buf + off);
+            off += ent->d_reclen;
+            size_t len = strlen(ent->d_name) + 1;
+            if (names_len + len + 1 > names_cap) {
+                names_cap = names_cap ? names_cap * 2 : 4096;
+                names_cap = names_cap < names_len + len + 1 ? names_len + len + 1 : names_cap;
+                dir->names = realloc(dir->names, names_cap);
+            }
+            dir->names[names_len] = ent->d_type;
+            memcpy(dir->names + names_len + 1, ent->d_name, len);
+            names_len += len + 1;
+            dir->count++;
+        }
+    }
+    close(fd);
+
+    //The names have stopped moving, so they can be pointed at now
+    dir->entries = malloc(sizeof(char*) * (dir->count + 1));
+    for (size_t i = 0, off = 0; i < dir->count; i++) {
+        dir->entries[i] = dir->names + off + 1;
+        off += strlen(dir->entries[i]) + 2;
+    }
+    sortWords(dir->entries, dir->count, 0);
+    return dir;
+}
+
+/**
+ * @brief Checks whether an entry of a listed directory is a directory.
+ * @param dir The listing.
+ * @param i The entry.
+ * @param follow Whether a symlink to a directory counts.
+ * @return 1 if it is a directory, otherwise 0.
+ * @details d_type answers this for almost every entry; only symlinks, and entries on file
+ * systems that do not fill d_type in, cost a stat().
+*/
+int globIsDir(GlobDir* dir, size_t i, int follow) {
+    unsigned char type = dir->entries[i][-1];
+    if (type == DT_DIR) {
+        return 1;
+    }
+    if (type != DT_UNKNOWN && (type != DT_LNK || !follow)) {
+        return 0;
+    }
+    struct stat sb;
+    char path[PATH_MAX];
+    if (snprintf(path, sizeof(path), "%s%s", dir->path, dir->entries[i]) >= (int)sizeof(path)) {
+        return 0;
+    }
+    return fstatat(AT_FDCWD, path, &sb, follow ? 0 : AT_SYMLINK_NOFOLLOW) == 0 && S_ISDIR(sb.st_mode);
+}
+
+/**
+ * @brief Matches one path component against a pattern component.
+ * @param pattern The pattern; it does not need to be NUL-terminated.
+ * @param len The length of the pattern.
+ * @param name The NUL-terminated name.
+ * @return 1 if the name matches, otherwise 0.
+ * @details * matches any run of characters, ? any one, and [...] one from a set, which may hold
+ * ranges such as a-z and be negated with ! or ^. A backslash makes the next character literal.
+ * A * is resolved by backtracking to the last one seen, so matching never takes more than
+ * pattern length times name length steps.
+*/
+int globMatch(const char* pattern, size_t len, const char* name) {
+    size_t p = 0;
+    const char* n = name;
+    size_t star_p = 0;
+    const char* star_n = NULL;
+
+    while (*n != '\0') {
+        if (p < len && pattern[p] == '*') {
+            star_p = ++p;
+            star_n = n;
+            continue;
+        }
+
+        int matched = 0;
+        size_t next = p + 1;
+        if (p < len && pattern[p] == '?') {
+            matched = 1;
+        }
+        else if (p < len && pattern[p] == '[') {
+            size_t q = p + 1;
+            int negate = q < len && (pattern[q] == '!' || pattern[q] == '^');
+            q += negate;
+            size_t first = q;
+            int in_set = 0;
+            while (q < len && (pattern[q] != ']' || q == first)) {
+                unsigned char low = pattern[q];
+                unsigned char high = low;
+                if (q + 2 < len && pattern[q + 1] == '-' && pattern[q + 2] != ']') {
+                    high = pattern[q + 2];
+                    q += 2;
+                }
+                in_set |= (unsigned char)*n >= low && (unsigned char)*n <= high;
+                q++;
+            }
+            if (q < len) {
+                matched = in_set != negate;
+                next = q + 1;
+            }
+            else {
+                //No closing bracket: the [ is an ordinary character
+                matched = *n == '[';
+            }
+        }
+        else if (p < len) {
+            if (pattern[p] == '\\' && p + 1 < len) {
+                p++;
+                next = p + 1;
+            }
+            matched = pattern[p] == *n;
+        }
+
+        if (matched) {
+            p = next;
+            n++;
+            continue;
+        }
+        if (star_n == NULL) {
+            return 0;
+        }
+        p = star_p;
+        n = ++star_n;
+    }
+
+    while (p < len && pattern[p] == '*') {
+        p++;
+    }
+    return p == len;
+}
+
+/**
+ * @brief Sorts strings in byte order.
+ * @param words The strings.
+ * @param count The number of strings.
+ * @param depth How many leading bytes they are already known to share.
+ * @details A three-way radix quicksort: the strings are split on one byte at a time around a
+ * pivot, so the long common prefixes of names like file0000001 are compared once per split
+ * rather than once per comparison, as strcmp() through qsort() would. Small runs finish with an
+ * insertion sort.
+*/
+void sortWords(char** words, size_t count, size_t depth) {
+    while (count > 1) {
+        if (count < 16) {
+            for (size_t i = 1; i < count; i++) {
+                for (size_t j = i; j > 0 && strcmp(words[j - 1] + depth, words[j] + depth) > 0; j--) {
+                    char* swap = words[j];
+                    words[j] = words[j - 1];
+                    words[j - 1] = swap;
+                }
+            }
+            return;
+        }
+
+        //Median of three bytes as the pivot
+        unsigned char x = words[0][depth];
+        unsigned char y = words[count / 2][depth];
+        unsigned char z = words[count - 1][depth];
+        unsigned char pivot = x < y ? (y < z ? y : (x < z ? z : x)) : (x < z ? x : (y < z ? z : y));
+
+        size_t less = 0;
+        size_t greater = count;
+        size_t i = 0;
+        while (i < greater) {
+            unsigned char c = words[i][depth];
+            char* swap = words[i];
+            if (c < pivot) {
+                words[i++] = words[less];
+                words[less++] = swap;
+            }
+            else if (c > pivot) {
+                words[i] = words[--greater];
+                words[greater] = swap;
+            }
+            else {
+                i++;
+            }
+        }
+
+        sortWords(words, less, depth);
+        if (pivot != '\0') {
+            sortWords(words + less, greater - less, depth + 1);
+        }
+        words += greater;
+        count -= greater;
+    }
+}
+
+/**
+ * @brief Forgets the directories listed for globs on the last line.
+*/
+void clearGlobCache() {
+    for (int b = 0; b < GLOB_CACHE_BUCKETS; b++) {
+        GlobDir* dir = glob_cache[b];
+        while (dir != NULL) {
+            GlobDir* next = dir->next;
+            free(dir->path);
+            free(dir->names);
+            free(dir->entries);
+            free(dir);
+            dir = next;
+        }
+        glob_cache[b] = NULL;
+    }
+}
+
+/**
+ * @brief Starts a <(...) or >(...) and returns the path the command using it should open.
+ * @param text The command inside the parentheses; it does not need to be NUL-terminated.
+ * @param len The length of the command.
+ * @param writer Whether this is >(...), whose command reads what the outer command writes.
+ * @return "/dev/fd/N" in line_arena, or an empty string if the substitution could not start.
+ * @details The inner command runs in a forked copy of the shell with the far end of a pipe on
+ * its stdout (or stdin for >(...)), so pipelines and builtins work inside it. The shell keeps
+ * the near end, close-on-exec, in procsubs until the line's command has started; execCmd()
+ * passes it only to the stage that names it, and closeProcSubs() then drops the shell's copy
+ * so EOF and SIGPIPE reach each side as soon as the other exits. The child is not a job; it is
+ * reaped by reapChildren() like any other stray child.
+*/
+char* processSubstitution(const char* text, size_t len, int writer) {
+    int fds[2];
+
+    if (pipe2(fds, O_CLOEXEC) < 0) {
+        perror("Pipe creation failed");
+        return "";
+    }
+    int near = writer ? fds[1] : fds[0];
+    int far = writer ? fds[0] : fds[1];
+    char* line = arenaCopy(&line_arena, text, len);
+
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("Error: fork");
+        close(near);
+        close(far);
+        return "";
+    }
+    if (pid == 0) {
+        //The substitution runs like a non-interactive subshell
+        signal(SIGTTOU, SIG_DFL);
+        job_control = 0;
+        for (int i = 0; i < nprocsubs; i++) {
+            close(procsubs[i].fd);
+        }
+        nprocsubs = 0;
+        close(near);
+        dup2(far, writer ? STDIN_FILENO : STDOUT_FILENO);
+        close(far);
+        runLine(line, len);
+        fflush(stdout);
+        _exit(last_status);
+    }
+    close(far);
+
+    if (nprocsubs == procsubs_cap) {
+        procsubs_cap = procsubs_cap ? procsubs_cap * 2 : 8;
+        procsubs = realloc(procsubs, sizeof(ProcSub) * procsubs_cap);
+    }
+    ProcSub* sub = &procsubs[nprocsubs++];
+    sub->fd = near;
+    sub->pid = pid;
+    snprintf(sub->path, sizeof(sub->path), "/dev/fd/%d", near);
+    return arenaCopy(&line_arena, sub->path, strlen(sub->path));
+}
+
+/**
+ * @brief Drops the shell's ends of the process substitutions opened since a mark.
+ * @param mark The value nprocsubs had before the line was expanded.
+*/
+void closeProcSubs(int mark) {
+    while (nprocsubs > mark) {
+        close(procsubs[--nprocsubs].fd);
+    }
+}
+
+/**
+ * @brief Adds a REDIR_KEEP step for every process substitution a stage's arguments name.
+ * @param plan The stage's plan.
+ * @param argv The stage's arguments.
+ * @details Redirections to /dev/fd/N need nothing, since they are opened before the exec
+ * closes the shell's fds, but a path passed as an argument is opened by the command itself.
+*/
+void keepProcSubFds(RedirPlan* plan, char** argv) {
+    for (int i = 0; argv[i] != NULL; i++) {
+        for (const char* p = strstr(argv[i], "/dev/fd/"); p != NULL; p = strstr(p + 1, "/dev/fd/")) {
+            for (int j = 0; j < nprocsubs; j++) {
+                size_t len = strlen(procsubs[j].path);
+                if (strncmp(p, procsubs[j].path, len) == 0 && !isdigit((unsigned char)p[len])) {
+                    addRedirAction(plan, REDIR_KEEP, procsubs[j].fd, -1, 0, NULL);
+                }
+            }
+        }
+    }
+}
+
+/**
+ * @brief Runs a command and returns its standard output.
+ * @param text The command, as written inside $(...); it does not need to be NUL-terminated.
+ * @param len The length of the command.
+ * @param out_len Set to the length of the output.
+ * @return The output without its trailing newlines, NUL-terminated, in line_arena.
+ * @details External commands and pipelines write into a pipe that the shell drains while they
+ * run, one pipe per pipeline. A pure builtin runs in the shell, writing to a memfd, so no process
+ * is created at all.
+ * Either way last_status is left holding the command's exit status.
+*/
+char* captureCommand(const char* text, size_t len, size_t* out_len) {
+    Capture c = { -1, NULL, 0, 0 };
+    Capture* outer = capture;
+
+    *out_len = 0;
+    captures_run++;
+
+    //Nested substitutions are expanded first, each into its own capture
+    char* line = arenaCopy(&line_arena, text, len);
+    Token* tokens;
+    size_t ntokens = tokenizeLine(&line_arena, line, len, &tokens);
+    int mark = nprocsubs;
+
+    int status = PARSE_ERROR;
+    Node* tree = ntokens != TOKENS_INCOMPLETE && ntokens != TOKENS_ERROR ? parseTokens(&line_arena, line, tokens, ntokens, &status) : NULL;
+    if (tree != NULL) {
+        capture = &c;
+        runTree(line, tree);
+        capture = outer;
+    }
+    else if (status != PARSE_OK) {
+        if (status == PARSE_INCOMPLETE) {
+            fprintf(stderr, "Error: unexpected end of command substitution\n");
+        }
+        last_status = 2;
+    }
+    closeProcSubs(mark);
+
+    //Spilled output is read back once, at its final size
+    char* result;
+    size_t total = c.len;
+    if (c.spill_fd >= 0) {
+        off_t size = lseek(c.spill_fd, 0, SEEK_END);
+        total = size > 0 ? (size_t)size : 0;
+        result = arenaAlloc(&line_arena, total + 1);
+        size_t got = 0;
+        while (got < total) {
+            ssize_t n = pread(c.spill_fd, result + got, total - got, got);
+            if (n <= 0) {
+                break;
+            }
+            got += n;
+        }
+        total = got;
+        close(c.spill_fd);
+    }
+    else {
+        result = arenaAlloc(&line_arena, total + 1);
+        if (total > 0) {
+            memcpy(result, c.buf, total);
+        }
+    }
+    free(c.buf);
+
+    while (total > 0 && result[total - 1] == '\n') {
+        total--;
+    }
+    result[total] = '\0';
+    *out_len = total;
+    return result;
+}
+
+/**
+ * @brief Reads a pipeline's output into a command substitution until every writer has exited.
+ * @param c The capture.
+ * @param fd The read end of the pipeline's pipe; the shell's write end must already be closed.
+ * @details Output is gathered in a buffer that doubles up to CAPTURE_SPILL. Anything beyond
+ * that, and everything once the capture has spilled, is relayed from the pipe into the memfd,
+ * so very large output is never reallocated.
+*/
+void drainCapture(Capture* c, int fd) {
+    while (c->spill_fd < 0) {
+        if (c->len == c->cap) {
+            if (c->cap >= CAPTURE_SPILL) {
+                break;
+            }
+            c->cap = c->cap ? c->cap * 2 : 4096;
+            c->buf = realloc(c->buf, c->cap);
+        }
+        ssize_t n = read(fd, c->buf + c->len, c->cap - c->len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return;
+        }
+        c->len += n;
+    }
+
+    if (spillCapture(c) < 0 || relayFd(fd, c->spill_fd) < 0) {
+        perror("Error: command substitution");
+    }
+}
+
+/**
+ * @brief Moves a command substitution's buffered output into its memfd, creating it if needed.
+ * @param c The capture.
+ * @return The memfd, which later output is appended to, or -1 on error.
+*/
+int spillCapture(Capture* c) {
+    if (c->spill_fd < 0) {
+        c->spill_fd = memfd_create("capture", MFD_CLOEXEC);
+        if (c->spill_fd < 0) {
+            return -1;
+        }
+    }
+    if (c->len > 0 && write(c->spill_fd, c->buf, c->len) != (ssize_t)c->len) {
+        return -1;
+    }
+    c->len = 0;
+    return c->spill_fd;
+}
+
+/**
+ * @brief Records that a child changed state so the main loop reaps it.
+ * @param sig The signal number (always SIGCHLD).
+*/
+void sigchldHandler(int sig) {
+    (void)sig;
+    child_exited = 1;
+}
+
+/**
+ * @brief Collects every pending child state change, without blocking, into the job table.
+ * @details Called only at safe points between commands, never while a foreground pipeline is
+ * being waited for, so it cannot steal a foreground child's status. Foreground jobs are
+ * always waited for through their own process group in waitForJob().
+*/
+void reapChildren() {
+    if (!child_exited) {
+        return;
+    }
+    child_exited = 0;
+
+    int status;
+    struct rusage usage;
+    pid_t pid;
+    while ((pid = wait4(-1, &status, WNOHANG | WUNTRACED | WCONTINUED, &usage)) > 0) {
+        updateJob(pid, status, &usage);
+    }
+}
+
+/**
+ * @brief Parses the tokens of one input unit into a syntax tree.
+ * @param arena The arena the nodes are allocated from.
+ * @param text The text the tokens were cut from.
+ * @param tokens The tokens.
+ * @param ntokens The number of tokens.
+ * @param status Set to PARSE_OK, PARSE_ERROR once the error has been reported, or
+ * PARSE_INCOMPLETE when the tokens end where more is needed, such as after && or inside ( ).
+ * @return The tree, or NULL if there is nothing to run.
+ * @details The grammar is sh's:
+ *   list     : and_or ((';' | '&' | newline) and_or)* [';' | '&']
+ *   and_or   : pipeline (('&&' | '||') newline* pipeline)*
+ *   pipeline : ['!'] ['time'] command ('|' newline* command)*
+ *   command  : simple command | compound redirection* | name '(' ')' newline* compound
+ *   compound : '(' list ')' | '{' list '}' | if | while | until | for | case
+ * Reserved words are only recognized unquoted and where a command can start.
+*/
+Node* parseTokens(Arena* arena, char* text, Token* tokens, size_t ntokens, int* status) {
+    Parser p = { arena, text, tokens, ntokens, 0, PARSE_OK };
+    Node* tree = parseList(&p);
+    if (p.status == PARSE_OK && p.pos < p.ntokens) {
+        //A ) or } with nothing open
+        parseError(&p);
+    }
+    *status = p.status;
+    return p.status == PARSE_OK ? tree : NULL;
+}
+
+/**
+ * @brief Parses commands separated by ;, & or newlines, up to the end of the tokens or the ) or }
+ * that closes the list.
+ * @param p The parser.
+ * @return The list, or NULL if it is empty or there was an error.
+*/
+Node* parseList(Parser* p) {
+    Node* list = NULL;
+    Node** tail = &list;
+
+    parseNewlines(p);
+    while (p->status == PARSE_OK && !parseListEnd(p)) {
+        Node* item = parseAndOr(p);
+        if (item == NULL) {
+            return NULL;
+        }
+        int type = p->pos < p->ntokens ? p->tokens[p->pos].type : -1;
+        if (type == TOKEN_AMP || type == TOKEN_SEMI) {
+            item->flags |= type == TOKEN_AMP ? NODE_BACKGROUND : 0;
+            p->pos++;
+        }
+        else if (type != TOKEN_NEWLINE && !parseListEnd(p)) {
+            parseError(p);
+            return NULL;
+        }
+        parseNewlines(p);
+
+        //Each item but the last hangs off a NODE_LIST, so the list compiles in a loop
+        if (*tail != NULL) {
+            *tail = parseNode(p, NODE_LIST, *tail, item);
+            tail = &(*tail)->right;
+        }
+        else {
+            *tail = item;
+        }
+    }
+    return p->status == PARSE_OK ? list : NULL;
+}
+
+/**
+ * @brief Parses pipelines joined by && and ||, which group from the left.
+ * @param p The parser.
+ * @return The node, or NULL on an error.
+*/
+Node* parseAndOr(Parser* p) {
+    size_t start = p->pos;
+    Node* left = parsePipeline(p);
+    while (left != NULL && p->pos < p->ntokens && (p->tokens[p->pos].type == TOKEN_AND || p->tokens[p->pos].type == TOKEN_OR)) {
+        int type = p->tokens[p->pos++].type == TOKEN_AND ? NODE_AND : NODE_OR;
+        parseNewlines(p);
+        Node* right = parsePipeline(p);
+        left = right != NULL ? parseNode(p, type, left, right) : NULL;
+        if (left != NULL) {
+            //The whole span names the job if the list is put in the background
+            left->tokens = p->tokens + start;
+            left->ntokens = p->pos - start;
+        }
+    }
+    return left;
+}
+
+/**
+ * @brief Parses a pipeline with its optional ! and time prefixes.
+ * @param p The parser.
+ * @return A NODE_COMMAND when every stage is a simple command, otherwise a NODE_PIPELINE (or the
+ * single compound command itself); NULL on an error.
+*/
+Node* parsePipeline(Parser* p) {
+    int flags = 0;
+    if (parseReserved(p, "!")) {
+        flags |= NODE_NEGATE;
+        p->pos++;
+    }
+    size_t start = p->pos;
+    if (parseReserved(p, "time")) {
+        flags |= NODE_TIMED;
+        p->pos++;
+        int type = p->pos < p->ntokens ? p->tokens[p->pos].type : TOKEN_NEWLINE;
+        if (type != TOKEN_WORD && type != TOKEN_IO_NUMBER && type != TOKEN_LPAREN && !TOKEN_IS_REDIR(type)) {
+            //"time" alone is left to execCmd(), which reports zero usage
+            Node* node = parseNode(p, NODE_COMMAND, NULL, NULL);
+            node->tokens = p->tokens + start;
+            node->ntokens = 1;
+            node->flags = flags & ~NODE_TIMED;
+            return node;
+        }
+    }
+
+    size_t body = p->pos;
+    size_t cap = 4;
+    int nstages = 0;
+    int simple = 1;
+    Node** stages = arenaAlloc(p->arena, sizeof(Node*) * cap);
+    while (1) {
+        Node* stage = parseCommand(p);
+        if (stage == NULL) {
+            return NULL;
+        }
+        if ((size_t)nstages == cap) {
+            Node** grown = arenaAlloc(p->arena, sizeof(Node*) * cap * 2);
+            memcpy(grown, stages, sizeof(Node*) * cap);
+            stages = grown;
+            cap *= 2;
+        }
+        stages[nstages++] = stage;
+        simple &= stage->type == NODE_COMMAND;
+        if (p->pos >= p->ntokens || p->tokens[p->pos].type != TOKEN_PIPE) {
+            break;
+        }
+        p->pos++;
+        parseNewlines(p);
+    }
+
+    Node* node;
+    if (simple) {
+        //execCmd() takes the whole pipeline, time and all, straight from the tokens
+        node = parseNode(p, NODE_COMMAND, NULL, NULL);
+        flags &= ~NODE_TIMED;
+    }
+    else if (nstages == 1 && !(flags & NODE_TIMED)) {
+        node = stages[0];
+    }
+    else {
+        node = parseNode(p, NODE_PIPELINE, NULL, NULL);
+        node->stages = stages;
+        node->nstages = nstages;
+        start = body;
+    }
+    node->tokens = p->tokens + start;
+    node->ntokens = p->pos - start;
+    node->flags |= flags;
+    return node;
+}
+
+/**
+ * @brief Parses one stage of a pipeline: a simple command, a compound command with its
+ * redirections, or a function definition.
+ * @param p The parser.
+ * @return The node, or NULL on an error.
+*/
+Node* parseCommand(Parser* p) {
+    size_t start = p->pos;
+    if (p->pos >= p->ntokens) {
+        p->status = PARSE_INCOMPLETE;
+        return NULL;
+    }
+
+    Node* node = NULL;
+    if (p->tokens[p->pos].type == TOKEN_LPAREN || parseReserved(p, "{")) {
+        int subshell = p->tokens[p->pos++].type == TOKEN_LPAREN;
+        Node* body = parseBody(p, subshell ? ")" : "}");
+        node = body != NULL ? parseNode(p, subshell ? NODE_SUBSHELL : NODE_GROUP, body, NULL) : NULL;
+    }
+    else if (parseReserved(p, "if")) {
+        node = parseIf(p);
+    }
+    else if (parseReserved(p, "while") || parseReserved(p, "until")) {
+        node = parseLoop(p);
+    }
+    else if (parseReserved(p, "for")) {
+        node = parseFor(p);
+    }
+    else if (parseReserved(p, "case")) {
+        node = parseCase(p);
+    }
+    else if (parseName(p) && p->pos + 1 < p->ntokens && p->tokens[p->pos + 1].type == TOKEN_LPAREN) {
+        return parseFunction(p);
+    }
+    else {
+        while (p->pos < p->ntokens) {
+            int type = p->tokens[p->pos].type;
+            if (type == TOKEN_WORD) {
+                p->pos++;
+            }
+            else if (type == TOKEN_IO_NUMBER || TOKEN_IS_REDIR(type)) {
+                p->pos += type == TOKEN_IO_NUMBER;
+                if (!parseRedirectionTarget(p)) {
+                    return NULL;
+                }
+            }
+            else {
+                break;
+            }
+        }
+        if (p->pos == start) {
+            parseError(p);
+            return NULL;
+        }
+        node = parseNode(p, NODE_COMMAND, NULL, NULL);
+        node->tokens = p->tokens + start;
+        node->ntokens = p->pos - start;
+        return node;
+    }
+    if (node == NULL) {
+        return NULL;
+    }
+
+    node->redirs = p->tokens + p->pos;
+    while (p->pos < p->ntokens && (p->tokens[p->pos].type == TOKEN_IO_NUMBER || TOKEN_IS_REDIR(p->tokens[p->pos].type))) {
+        p->pos += p->tokens[p->pos].type == TOKEN_IO_NUMBER;
+        if (!parseRedirectionTarget(p)) {
+            return NULL;
+        }
+    }
+    node->nredirs = p->tokens + p->pos - node->redirs;
+    node->tokens = p->tokens + start;
+    node->ntokens = p->pos - start;
+    return node;
+}
+
+/**
+ * @brief Parses a list that must not be empty, followed by the reserved word that ends it.
+ * @param p The parser.
+ * @param end The reserved word, or ")".
+ * @return The list, or NULL on an error.
+*/
+Node* parseBody(Parser* p, const char* end) {
+    Node* body = parseList(p);
+    if (body == NULL) {
+        parseError(p);
+        return NULL;
+    }
+    return parseExpect(p, end) ? body : NULL;
+}
+
+/**
+ * @brief Parses if list then list [elif list then list]... [else list] fi.
+ * @param p The parser, at the if or elif.
+ * @return The node, or NULL on an error; an elif is the else part of the if before it.
+*/
+Node* parseIf(Parser* p) {
+    p->pos++;
+    Node* cond = parseBody(p, "then");
+    Node* body = cond != NULL ? parseList(p) : NULL;
+    if (body == NULL) {
+        parseError(p);
+        return NULL;
+    }
+
+    Node* node = parseNode(p, NODE_IF, cond, body);
+    if (parseReserved(p, "elif")) {
+        node->alt = parseIf(p);
+        return node->alt != NULL ? node : NULL;
+    }
+    if (parseReserved(p, "else")) {
+        p->pos++;
+        node->alt = parseList(p);
+        if (node->alt == NULL) {
+            parseError(p);
+            return NULL;
+        }
+    }
+    return parseExpect(p, "fi") ? node : NULL;
+}
+
+/**
+ * @brief Parses while list do list done, or the same with until.
+ * @param p The parser, at the while or until.
+ * @return The node, or NULL on an error.
+*/
+Node* parseLoop(Parser* p) {
+    int type = parseReserved(p, "while") ? NODE_WHILE : NODE_UNTIL;
+    p->pos++;
+    Node* cond = parseBody(p, "do");
+    Node* body = cond != NULL ? parseBody(p, "done") : NULL;
+    return body != NULL ? parseNode(p, type, cond, body) : NULL;
+}
+
+/**
+ * @brief Parses for name [in word...] do list done; without "in" the loop goes over "$@".
+ * @param p The parser, at the for.
+ * @return The node, or NULL on an error.
+*/
+Node* parseFor(Parser* p) {
+    p->pos++;
+    if (!parseName(p)) {
+        parseError(p);
+        return NULL;
+    }
+    Node* node = parseNode(p, NODE_FOR, NULL, NULL);
+    node->name = &p->tokens[p->pos++];
+    parseNewlines(p);
+
+    if (parseReserved(p, "in")) {
+        node->words = &p->tokens[++p->pos];
+        while (p->pos < p->ntokens && p->tokens[p->pos].type == TOKEN_WORD) {
+            p->pos++;
+        }
+        node->nwords = &p->tokens[p->pos] - node->words;
+        if (p->pos < p->ntokens && p->tokens[p->pos].type != TOKEN_SEMI && p->tokens[p->pos].type != TOKEN_NEWLINE) {
+            parseError(p);
+            return NULL;
+        }
+    }
+    p->pos += p->pos < p->ntokens && p->tokens[p->pos].type == TOKEN_SEMI;
+    parseNewlines(p);
+
+    if (!parseExpect(p, "do")) {
+        return NULL;
+    }
+    node->left = parseBody(p, "done");
+    return node->left != NULL ? node : NULL;
+}
+
+/**
+ * @brief Parses case word in [(] pattern [| pattern]... ) [list] ;; ... esac.
+ * @param p The parser, at the case.
+ * @return The node, or NULL on an error. The last item may leave out its ;;.
+*/
+Node* parseCase(Parser* p) {
+    p->pos++;
+    if (p->pos >= p->ntokens || p->tokens[p->pos].type != TOKEN_WORD) {
+        parseError(p);
+        return NULL;
+    }
+    Node* node = parseNode(p, NODE_CASE, NULL, NULL);
+    node->words = &p->tokens[p->pos++];
+    node->nwords = 1;
+    parseNewlines(p);
+    if (!parseExpect(p, "in")) {
+        return NULL;
+    }
+    parseNewlines(p);
+
+    int cap = 4;
+    node->stages = arenaAlloc(p->arena, sizeof(Node*) * cap);
+    while (!parseReserved(p, "esac")) {
+        p->pos += p->pos < p->ntokens && p->tokens[p->pos].type == TOKEN_LPAREN;
+        Node* item = parseNode(p, NODE_PATTERN, NULL, NULL);
+        item->words = &p->tokens[p->pos];
+        while (1) {
+            if (p->pos >= p->ntokens || p->tokens[p->pos].type != TOKEN_WORD) {
+                parseError(p);
+                return NULL;
+            }
+            p->pos++;
+            if (p->pos >= p->ntokens || p->tokens[p->pos].type != TOKEN_PIPE) {
+                break;
+            }
+            p->pos++;
+        }
+        item->nwords = &p->tokens[p->pos] - item->words;
+        if (!parseExpect(p, ")")) {
+            return NULL;
+        }
+        item->left = parseList(p);
+        if (p->status != PARSE_OK) {
+            return NULL;
+        }
+
+        if (node->nstages == cap) {
+            Node** grown = arenaAlloc(p->arena, sizeof(Node*) * cap * 2);
+            memcpy(grown, node->stages, sizeof(Node*) * cap);
+            node->stages = grown;
+            cap *= 2;
+        }
+        node->stages[node->nstages++] = item;
+
+        if (p->pos < p->ntokens && p->tokens[p->pos].type == TOKEN_DSEMI) {
+            p->pos++;
+            parseNewlines(p);
+        }
+        else if (!parseReserved(p, "esac")) {
+            parseError(p);
+            return NULL;
+        }
+    }
+    p->pos++;
+    return node;
+}
+
+/**
+ * @brief Parses name() followed by the compound command that is the function's body.
+ * @param p The parser, at the name.
+ * @return The node, or NULL on an error.
+*/
+Node* parseFunction(Parser* p) {
+    Node* node = parseNode(p, NODE_FUNCTION, NULL, NULL);
+    size_t start = p->pos;
+    node->name = &p->tokens[p->pos];
+    p->pos += 2;
+    if (!parseExpect(p, ")")) {
+        return NULL;
+    }
+    parseNewlines(p);
+
+    static const char* const compound[] = { "{", "if", "while", "until", "for", "case" };
+    int is_compound = p->pos < p->ntokens && p->tokens[p->pos].type == TOKEN_LPAREN;
+    for (size_t i = 0; i < sizeof(compound) / sizeof(compound[0]); i++) {
+        is_compound |= parseReserved(p, compound[i]);
+    }
+    if (!is_compound) {
+        parseError(p);
+        return NULL;
+    }
+    node->left = parseCommand(p);
+    node->tokens = p->tokens + start;
+    node->ntokens = p->pos - start;
+    return node->left != NULL ? node : NULL;
+}
+
+/**
+ * @brief Steps over a redirection operator and the word after it, and a here-document's body.
+ * @param p The parser, at the operator.
+ * @return 1, or 0 if the word is missing, which has been reported.
+*/
+int parseRedirectionTarget(Parser* p) {
+    p->pos++;
+    if (p->pos >= p->ntokens || p->tokens[p->pos].type != TOKEN_WORD) {
+        parseError(p);
+        return 0;
+    }
+    p->pos++;
+    //A here-document's body comes with its delimiter, as the two tokens around it
+    p->pos += p->pos < p->ntokens && p->tokens[p->pos].type == TOKEN_HEREDOC ? 2 : 0;
+    return 1;
+}
+
+/**
+ * @brief Checks whether the parser is at a reserved word.
+ * @param p The parser.
+ * @param word The reserved word.
+ * @return 1 if the next token is that word, unquoted, otherwise 0.
+*/
+int parseReserved(Parser* p, const char* word) {
+    if (p->pos >= p->ntokens) {
+        return 0;
+    }
+    Token* t = &p->tokens[p->pos];
+    size_t len = strlen(word);
+    return t->type == TOKEN_WORD && t->flags == 0 && t->length == len && memcmp(p->text + t->offset, word, len) == 0;
+}
+
+/**
+ * @brief Checks whether the parser is at a word that is a valid variable or function name.
+*/
+int parseName(Parser* p) {
+    if (p->pos >= p->ntokens || p->tokens[p->pos].type != TOKEN_WORD || p->tokens[p->pos].flags != 0) {
+        return 0;
+    }
+    const char* word = p->text + p->tokens[p->pos].offset;
+    size_t len = p->tokens[p->pos].length;
+    if (!isalpha((unsigned char)word[0]) && word[0] != '_') {
+        return 0;
+    }
+    for (size_t i = 1; i < len; i++) {
+        if (!isalnum((unsigned char)word[i]) && word[i] != '_') {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/**
+ * @brief Steps over the reserved word, or the ), that must come next.
+ * @param p The parser.
+ * @param word The word.
+ * @return 1, or 0 after reporting what came instead.
+*/
+int parseExpect(Parser* p, const char* word) {
+    if (word[0] == ')' ? p->pos < p->ntokens && p->tokens[p->pos].type == TOKEN_RPAREN : parseReserved(p, word)) {
+        p->pos++;
+        return 1;
+    }
+    parseError(p);
+    return 0;
+}
+
+/**
+ * @brief Checks whether the parser is at the end of a list: the end of the tokens, a ), a ;;, or
+ * a reserved word that closes a compound command.
+*/
+int parseListEnd(Parser* p) {
+    static const char* const closers[] = { "}", "then", "elif", "else", "fi", "do", "done", "esac" };
+    if (p->pos >= p->ntokens || p->tokens[p->pos].type == TOKEN_RPAREN || p->tokens[p->pos].type == TOKEN_DSEMI) {
+        return 1;
+    }
+    for (size_t i = 0; i < sizeof(closers) / sizeof(closers[0]); i++) {
+        if (parseReserved(p, closers[i])) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Skips newline tokens.
+*/
+void parseNewlines(Parser* p) {
+    while (p->pos < p->ntokens && p->tokens[p->pos].type == TOKEN_NEWLINE) {
+        p->pos++;
+    }
+}
+
+/**
+ * @brief Reports the token the parser stopped at, or marks the input incomplete at its end.
+ * @param p The parser.
+*/
+void parseError(Parser* p) {
+    if (p->status != PARSE_OK) {
+        return;
+    }
+    if (p->pos >= p->ntokens) {
+        p->status = PARSE_INCOMPLETE;
+        return;
+    }
+    Token* t = &p->tokens[p->pos];
+    if (t->type == TOKEN_WORD || t->type == TOKEN_IO_NUMBER) {
+        fprintf(stderr, "Error: syntax error near unexpected token '%.*s'\n", (int)t->length, p->text + t->offset);
+    }
+    else {
+        fprintf(stderr, "Error: syntax error near unexpected token '%s'\n", token_spellings[t->type]);
+    }
+    p->status = PARSE_ERROR;
+}
+
+/**
+ * @brief Allocates a node from the parser's arena.
+ * @param p The parser.
+ * @param type The node type.
+ * @param left The first operand or body.
+ * @param right The second operand.
+ * @return The node, with its other fields cleared.
+*/
+Node* parseNode(Parser* p, int type, Node* left, Node* right) {
+    Node* node = arenaAlloc(p->arena, sizeof(Node));
+    memset(node, 0, sizeof(Node));
+    node->type = type;
+    node->text = p->text;
+    node->left = left;
+    node->right = right;
+    return node;
+}
+
+/**
+ * @brief Compiles a syntax tree to bytecode and runs it.
+ * @param text The text the tree's tokens were cut from.
+ * @param tree The tree.
+ * @details The program lives in line_arena with the tree. Loop bodies are compiled once, however
+ * many times they run.
+*/
+void runTree(char* text, Node* tree) {
+    Program* prog = compileProgram(&line_arena, text, tree);
+    runProgram(prog, 0, prog->ncode);
+}
+
+/**
+ * @brief Compiles a syntax tree to bytecode.
+ * @param arena The arena the program is allocated from.
+ * @param text The text the tree's tokens were cut from.
+ * @param tree The tree.
+ * @return The program.
+*/
+Program* compileProgram(Arena* arena, char* text, Node* tree) {
+    Program* prog = arenaAlloc(arena, sizeof(Program));
+    prog->text = text;
+    prog->cap = 16;
+    prog->code = arenaAlloc(arena, sizeof(Instr) * prog->cap);
+    prog->ncode = 0;
+    prog->max_loops = 0;
+    prog->max_redirs = 0;
+    prog->arena = arena;
+
+    Compiler c = { prog, 0, 0 };
+    compileNode(&c, tree, tree->flags, 0);
+    return prog;
+}
+
+/**
+ * @brief Appends an instruction to the program being compiled.
+ * @param c The compiler.
+ * @param op The opcode.
+ * @param flags INSTR_BACKGROUND and INSTR_EXEMPT.
+ * @param tokens The instruction's tokens, or NULL.
+ * @param ntokens The number of tokens.
+ * @param data Anything else the instruction needs, or NULL.
+ * @return The index of the instruction, so its arg can be filled in once a jump target is known.
+*/
+int compileEmit(Compiler* c, int op, int flags, Token* tokens, size_t ntokens, const void* data) {
+    Program* prog = c->prog;
+    if (prog->ncode == prog->cap) {
+        Instr* grown = arenaAlloc(prog->arena, sizeof(Instr) * prog->cap * 2);
+        memcpy(grown, prog->code, sizeof(Instr) * prog->cap);
+        prog->code = grown;
+        prog->cap *= 2;
+    }
+    Instr* in = &prog->code[prog->ncode];
+    in->op = op;
+    in->flags = flags;
+    in->arg = 0;
+    in->tokens = tokens;
+    in->ntokens = ntokens;
+    in->data = data;
+    return prog->ncode++;
+}
+
+/**
+ * @brief Compiles a node, and the rest of the list it heads.
+ * @param c The compiler.
+ * @param node The node.
+ * @param flags The node's flags; a block run in a forked shell passes them without the ones the
+ * fork took care of.
+ * @param exempt Whether -e must ignore the status of the node's commands, as inside the
+ * condition of an if or the left side of &&.
+ * @details A simple command becomes one instruction, and a lone builtin one that calls it
+ * directly. Anything that needs a forked shell becomes an OP_SPAWN, with the code the child
+ * runs compiled in front of it and jumped over.
+*/
+void compileNode(Compiler* c, Node* node, int flags, int exempt) {
+    while (node->type == NODE_LIST) {
+        compileNode(c, node->left, node->left->flags, exempt);
+        node = node->right;
+        flags = node->flags;
+    }
+
+    int negate = (flags & NODE_NEGATE) && !(flags & NODE_BACKGROUND);
+    int instr_flags = exempt || negate ? INSTR_EXEMPT : 0;
+    if (node->type == NODE_COMMAND) {
+        compileCommand(c, node, flags, instr_flags);
+    }
+    else if (node->type == NODE_FUNCTION) {
+        //The body is copied while the text is still untouched; running commands NUL-terminates words
+        Node* body = node->left;
+        size_t start = body->tokens[0].offset;
+        size_t end = start;
+        for (size_t i = 0; i < body->ntokens; i++) {
+            Token* t = &body->tokens[i];
+            size_t t_end = t->offset + t->length;
+            if (t->type == TOKEN_HEREDOC) {
+                //Keep the delimiter line, so the body still ends its here-document
+                const char* line_end = strchrnul(c->prog->text + t_end, '\n');
+                t_end = line_end - c->prog->text + (*line_end == '\n');
+            }
+            end = t_end > end ? t_end : end;
+        }
+        int define = compileEmit(c, OP_DEFINE, instr_flags, node->name, 1, arenaCopy(c->prog->arena, c->prog->text + start, end - start));
+        c->prog->code[define].arg = end - start;
+    }
+    else if (node->type == NODE_SUBSHELL || node->type == NODE_PIPELINE || (flags & (NODE_BACKGROUND | NODE_TIMED))) {
+        compileSpawn(c, node, instr_flags);
+    }
+    else if (node->type == NODE_AND || node->type == NODE_OR) {
+        compileNode(c, node->left, node->left->flags, 1);
+        int skip = compileEmit(c, node->type == NODE_AND ? OP_JUMP_FALSE : OP_JUMP_TRUE, 0, NULL, 0, NULL);
+        compileNode(c, node->right, node->right->flags, negate || exempt);
+        c->prog->code[skip].arg = c->prog->ncode;
+    }
+    else if (node->nredirs > 0) {
+        //The compound command's redirections stay applied to the shell while its body runs
+        int redirect = compileEmit(c, OP_REDIRECT, instr_flags, node->redirs, node->nredirs, NULL);
+        c->redirs++;
+        c->prog->max_redirs = c->redirs > c->prog->max_redirs ? c->redirs : c->prog->max_redirs;
+        compileCompound(c, node, negate || exempt);
+        c->redirs--;
+        compileEmit(c, OP_RESTORE, 0, NULL, 0, NULL);
+        c->prog->code[redirect].arg = c->prog->ncode;
+    }
+    else {
+        compileCompound(c, node, negate || exempt);
+    }
+
+    if (negate) {
+        compileEmit(c, OP_NOT, 0, NULL, 0, NULL);
+    }
+}
+
+/**
+ * @brief Compiles a simple command or pipeline of them.
+ * @param c The compiler.
+ * @param node The NODE_COMMAND.
+ * @param flags The node's flags.
+ * @param instr_flags INSTR_EXEMPT, if the status is exempt from -e.
+ * @details A foreground command whose first word is the plain name of a builtin, with no pipe,
+ * is an OP_BUILTIN, which skips execCmd() when the builtin needs nothing else done for it.
+*/
+void compileCommand(Compiler* c, Node* node, int flags, int instr_flags) {
+    Token* first = &node->tokens[0];
+    const void* builtin = NULL;
+
+    if (!(flags & NODE_BACKGROUND) && first->type == TOKEN_WORD && first->flags == 0 && first->length <= BUILTIN_NAME_MAX) {
+        char name[BUILTIN_NAME_MAX + 1];
+        memcpy(name, node->text + first->offset, first->length);
+        name[first->length] = '\0';
+        builtin = findBuiltin(name);
+        for (size_t i = 1; builtin != NULL && i < node->ntokens; i++) {
+            builtin = node->tokens[i].type == TOKEN_PIPE ? NULL : builtin;
+        }
+    }
+    if (flags & NODE_BACKGROUND) {
+        instr_flags |= INSTR_BACKGROUND;
+    }
+    compileEmit(c, builtin != NULL ? OP_BUILTIN : OP_COMMAND, instr_flags, node->tokens, node->ntokens, builtin);
+}
+
+/**
+ * @brief Compiles a node that runs in forked copies of the shell.
+ * @param c The compiler.
+ * @param node A subshell, a pipeline with compound stages, or a node put in the background or timed.
+ * @param instr_flags INSTR_EXEMPT, if the status is exempt from -e.
+*/
+void compileSpawn(Compiler* c, Node* node, int instr_flags) {
+    int skip = compileEmit(c, OP_JUMP, 0, NULL, 0, NULL);
+    if (node->type == NODE_PIPELINE) {
+        for (int i = 0; i < node->nstages; i++) {
+            if (node->stages[i]->type != NODE_COMMAND) {
+                compileBlock(c, node->stages[i]);
+            }
+        }
+    }
+    else {
+        compileBlock(c, node);
+    }
+    c->prog->code[skip].arg = c->prog->ncode;
+    compileEmit(c, OP_SPAWN, instr_flags, NULL, 0, node);
+}
+
+/**
+ * @brief Compiles the code a forked shell runs for a node, and records its range in the node.
+ * @param c The compiler.
+ * @param node The node; for a subshell its body is compiled, and a compound command's
+ * redirections are left to the plan the child applies before it starts.
+*/
+void compileBlock(Compiler* c, Node* node) {
+    int loops = c->loops;
+    int redirs = c->redirs;
+
+    //The child starts a frame of its own
+    c->loops = 0;
+    c->redirs = 0;
+    node->prog = c->prog;
+    node->code_start = c->prog->ncode;
+    if (node->type == NODE_SUBSHELL) {
+        compileNode(c, node->left, node->left->flags, 0);
+    }
+    else if (node->type == NODE_GROUP || (node->type >= NODE_IF && node->type <= NODE_CASE)) {
+        compileCompound(c, node, 0);
+    }
+    else {
+        compileNode(c, node, node->flags & ~(NODE_BACKGROUND | NODE_TIMED), 0);
+    }
+    node->code_end = c->prog->ncode;
+    c->loops = loops;
+    c->redirs = redirs;
+}
+
+/**
+ * @brief Compiles the body of a group, if, loop or case, leaving out its redirections.
+ * @param c The compiler.
+ * @param node The compound command.
+ * @param exempt Whether -e must ignore the status of its commands.
+*/
+void compileCompound(Compiler* c, Node* node, int exempt) {
+    Program* prog = c->prog;
+
+    if (node->type == NODE_GROUP) {
+        compileNode(c, node->left, node->left->flags, exempt);
+    }
+    else if (node->type == NODE_IF) {
+        compileNode(c, node->left, node->left->flags, 1);
+        int test = compileEmit(c, OP_JUMP_FALSE, 0, NULL, 0, NULL);
+        compileNode(c, node->right, node->right->flags, exempt);
+        int skip = compileEmit(c, OP_JUMP, 0, NULL, 0, NULL);
+        prog->code[test].arg = prog->ncode;
+        if (node->alt != NULL) {
+            compileNode(c, node->alt, node->alt->flags, exempt);
+        }
+        else {
+            compileEmit(c, OP_STATUS, 0, NULL, 0, NULL);
+        }
+        prog->code[skip].arg = prog->ncode;
+    }
+    else if (node->type == NODE_WHILE || node->type == NODE_UNTIL || node->type == NODE_FOR) {
+        int loop;
+        int test = 0;
+        if (node->type == NODE_FOR) {
+            loop = compileEmit(c, OP_FOR, 0, node->words, node->nwords, NULL);
+            test = compileEmit(c, OP_NEXT, 0, node->name, 1, NULL);
+        }
+        else {
+            loop = compileEmit(c, OP_LOOP, 0, NULL, 0, NULL);
+        }
+        c->loops++;
+        prog->max_loops = c->loops > prog->max_loops ? c->loops : prog->max_loops;
+        if (node->type != NODE_FOR) {
+            compileNode(c, node->left, node->left->flags, 1);
+            test = compileEmit(c, node->type == NODE_WHILE ? OP_JUMP_FALSE : OP_JUMP_TRUE, 0, NULL, 0, NULL);
+        }
+        Node* body = node->type == NODE_FOR ? node->left : node->right;
+        compileNode(c, body, body->flags, exempt);
+        compileEmit(c, OP_REPEAT, 0, NULL, 0, NULL);
+        int done = compileEmit(c, OP_DONE, 0, NULL, 0, NULL);
+        c->loops--;
+        prog->code[loop].arg = done;
+        prog->code[test].arg = done;
+    }
+    else if (node->type == NODE_CASE) {
+        compileEmit(c, OP_CASE, 0, node->words, 1, NULL);
+        //One OP_MATCH per pattern, in order, holding its item's index until the bodies are placed
+        int first = prog->ncode;
+        for (int item = 0; item < node->nstages; item++) {
+            Node* pattern = node->stages[item];
+            for (size_t w = 0; w < pattern->nwords; w++) {
+                if (pattern->words[w].type == TOKEN_WORD) {
+                    int match = compileEmit(c, OP_MATCH, 0, &pattern->words[w], 1, NULL);
+                    prog->code[match].arg = item;
+                }
+            }
+        }
+        int last = prog->ncode;
+        int* bodies = arenaAlloc(prog->arena, sizeof(int) * (node->nstages + 1));
+        int* ends = arenaAlloc(prog->arena, sizeof(int) * (node->nstages + 1));
+        compileEmit(c, OP_STATUS, 0, NULL, 0, NULL);
+        ends[node->nstages] = compileEmit(c, OP_JUMP, 0, NULL, 0, NULL);
+        for (int item = 0; item < node->nstages; item++) {
+            Node* body = node->stages[item]->left;
+            bodies[item] = prog->ncode;
+            if (body != NULL) {
+                compileNode(c, body, body->flags, exempt);
+            }
+            else {
+                compileEmit(c, OP_STATUS, 0, NULL, 0, NULL);
+            }
+            ends[item] = compileEmit(c, OP_JUMP, 0, NULL, 0, NULL);
+        }
+        for (int i = first; i < last; i++) {
+            prog->code[i].arg = bodies[prog->code[i].arg];
+        }
+        for (int item = 0; item <= node->nstages; item++) {
+            prog->code[ends[item]].arg = prog->ncode;
+        }
+    }
+}
+
+/**
+ * @brief Runs a range of bytecode.
+ * @param prog The program.
+ * @param start The first instruction.
+ * @param end Where to stop: the end of the program, or of the block a forked shell runs.
+ * @details Each run is a frame with its own loop and redirection stacks, sized by the compiler.
+ * Every iteration of a loop gives back what it allocated from line_arena, so a long loop runs
+ * in constant memory. Commands leave last_status behind; break, continue and return leave
+ * unwind, which is acted on after the command that set it. With -e the frame stops at the
+ * first command that fails outside a condition.
+*/
+void runProgram(Program* prog, int start, int end) {
+    LoopFrame loops[prog->max_loops + 1];
+    SavedFds redirs[prog->max_redirs + 1];
+    int depth = 0;
+    int nredirs = 0;
+    int frame_mark = nprocsubs;
+    const char* case_word = "";
+    int pc = start;
+
+    while (pc < end) {
+        Instr* in = &prog->code[pc++];
+        int mark = nprocsubs;
+
+        switch (in->op) {
+        case OP_COMMAND:
+            execCmd(prog->text, in->tokens, in->ntokens, in->flags & INSTR_BACKGROUND);
+            break;
+
+        case OP_BUILTIN: {
+            const Builtin* builtin = in->data;
+            if (capture != NULL || (functions != NULL && findFunction(builtin->name) != NULL)) {
+                execCmd(prog->text, in->tokens, in->ntokens, 0);
+                break;
+            }
+            //A pure builtin without redirections has nothing to set up or undo; its output is
+            //flushed by the next command that starts a process, or at the end of the input unit
+            PipelineStage stage;
+            if (buildStage(&stage, prog->text, in->tokens, in->ntokens) != 0) {
+                last_status = 2;
+            }
+            else if (stage.plan.nactions == 0 && builtin->pure) {
+                last_status = builtin->fn(stage.argv);
+            }
+            else {
+                last_status = runBuiltin((Builtin*)builtin, stage.argv, &stage.plan);
+            }
+            releaseRedirPlan(&stage.plan);
+            break;
+        }
+
+        case OP_SPAWN:
+            runCompound((Node*)in->data);
+            break;
+
+        case OP_JUMP:
+            pc = in->arg;
+            continue;
+
+        case OP_JUMP_FALSE:
+        case OP_JUMP_TRUE:
+            if ((last_status == 0) == (in->op == OP_JUMP_TRUE)) {
+                pc = in->arg;
+                errexit_exempt = 1;
+            }
+            continue;
+
+        case OP_NOT:
+            last_status = !last_status;
+            errexit_exempt = 1;
+            continue;
+
+        case OP_STATUS:
+            last_status = in->arg;
+            continue;
+
+        case OP_REDIRECT: {
+            PipelineStage stage;
+            int failed = buildStage(&stage, prog->text, in->tokens, in->ntokens) != 0;
+            if (!failed && redirectShell(&stage.plan, &redirs[nredirs]) != 0) {
+                restoreShell(&redirs[nredirs]);
+                failed = 1;
+            }
+            releaseRedirPlan(&stage.plan);
+            if (!failed) {
+                nredirs++;
+                continue;
+            }
+            //The body is skipped, as in sh
+            last_status = 1;
+            pc = in->arg;
+            break;
+        }
+
+        case OP_RESTORE:
+            if (restoreShell(&redirs[--nredirs]) != 0 && last_status == 0) {
+                last_status = 1;
+            }
+            continue;
+
+        case OP_LOOP:
+        case OP_FOR: {
+            LoopFrame* loop = &loops[depth];
+            loop->items = NULL;
+            loop->nitems = 0;
+            loop->item = 0;
+            if (in->op == OP_FOR && in->tokens == NULL) {
+                loop->items = script_args;
+                loop->nitems = script_argc;
+            }
+            else if (in->op == OP_FOR) {
+                size_t cap = 8;
+                loop->items = arenaAlloc(&line_arena, sizeof(char*) * cap);
+                for (size_t i = 0; i < in->ntokens; i++) {
+                    loop->items = expandToken(loop->items, &loop->nitems, &cap, prog->text, &in->tokens[i]);
+                }
+            }
+            loop->done = in->arg;
+            loop->next = pc;
+            loop->status = 0;
+            loop->redirs = nredirs;
+            loop->mark = arenaMark(&line_arena);
+            depth++;
+            loop_depth++;
+            continue;
+        }
+
+        case OP_NEXT: {
+            LoopFrame* loop = &loops[depth - 1];
+            if (loop->item == loop->nitems) {
+                pc = in->arg;
+                continue;
+            }
+            setVar(prog->text + in->tokens->offset, in->tokens->length, loop->items[loop->item++], 0);
+            continue;
+        }
+
+        case OP_REPEAT: {
+            LoopFrame* loop = &loops[depth - 1];
+            loop->status = last_status;
+            arenaRelease(&line_arena, loop->mark);
+            pc = loop->next;
+            continue;
+        }
+
+        case OP_DONE: {
+            LoopFrame* loop = &loops[--depth];
+            loop_depth--;
+            last_status = loop->status;
+            arenaRelease(&line_arena, loop->mark);
+            continue;
+        }
+
+        case OP_CASE:
+        case OP_MATCH: {
+            char* word = prog->text + in->tokens->offset;
+            word[in->tokens->length] = '\0';
+            if (in->op == OP_CASE) {
+                case_word = in->tokens->flags == 0 ? word : expandString(word, EXPAND_STRING);
+                continue;
+            }
+            const char* pattern = in->tokens->flags == 0 ? word : expandString(word, EXPAND_PATTERN);
+            if (globMatch(pattern, strlen(pattern), case_word)) {
+                pc = in->arg;
+            }
+            continue;
+        }
+
+        case OP_DEFINE:
+            last_status = defineFunction(prog->text + in->tokens->offset, in->tokens->length, in->data, in->arg);
+            break;
+        }
+        closeProcSubs(mark);
+
+        if (unwind == UNWIND_RETURN) {
+            break;
+        }
+        if (unwind != 0 && depth == 0) {
+            //break or continue in a forked shell, with the loop in the parent
+            unwind = 0;
+        }
+        else if (unwind != 0) {
+            int levels = unwind_count < depth ? unwind_count : depth;
+            LoopFrame* loop = &loops[depth - levels];
+            while (nredirs > loop->redirs) {
+                restoreShell(&redirs[--nredirs]);
+            }
+            depth -= levels - 1;
+            loop_depth -= levels - 1;
+            if (unwind == UNWIND_BREAK) {
+                loop->status = 0;
+                pc = loop->done;
+            }
+            else {
+                arenaRelease(&line_arena, loop->mark);
+                pc = loop->next;
+            }
+            unwind = 0;
+            continue;
+        }
+
+        errexit_exempt = (in->flags & INSTR_EXEMPT) != 0;
+        if (errexit && last_status != 0 && !errexit_exempt) {
+            break;
+        }
+    }
+
+    while (nredirs > 0) {
+        restoreShell(&redirs[--nredirs]);
+    }
+    loop_depth -= depth;
+    closeProcSubs(frame_mark);
+}
+
+/**
+ * @brief Defines a function, replacing any function of the same name.
+ * @param name The name; it does not need to be NUL-terminated.
+ * @param name_len The length of the name.
+ * @param body The text of the body, a compound command with its redirections.
+ * @param body_len The length of the body.
+ * @return 0, or 2 if the body does not parse again, which has been reported.
+ * @details The body is copied, parsed and compiled into an arena of the function's own, so a
+ * call runs bytecode straight away. A function redefined while it runs is freed once its last
+ * call returns.
+*/
+int defineFunction(const char* name, size_t name_len, const char* body, size_t body_len) {
+    Function* fn = calloc(1, sizeof(Function));
+    if (fn == NULL) {
+        perror("Error: Out of memory");
+        exit(1);
+    }
+    fn->name = strndup(name, name_len);
+
+    char* text = arenaCopy(&fn->arena, body, body_len);
+    Token* tokens;
+    size_t ntokens = tokenizeLine(&fn->arena, text, body_len, &tokens);
+    int status = PARSE_ERROR;
+    Node* tree = ntokens != TOKENS_INCOMPLETE && ntokens != TOKENS_ERROR ? parseTokens(&fn->arena, text, tokens, ntokens, &status) : NULL;
+    if (tree == NULL) {
+        fprintf(stderr, "Error: %s: function body does not parse\n", fn->name);
+        freeFunction(fn);
+        return 2;
+    }
+    fn->prog = compileProgram(&fn->arena, text, tree);
+
+    Function** link = &functions;
+    while (*link != NULL && strcmp((*link)->name, fn->name) != 0) {
+        link = &(*link)->next;
+    }
+    if (*link != NULL) {
+        Function* old = *link;
+        fn->next = old->next;
+        old->retired = 1;
+        if (old->calls == 0) {
+            freeFunction(old);
+        }
+    }
+    *link = fn;
+    return 0;
+}
+
+/**
+ * @brief Finds the function with the given name.
+ * @param name The name.
+ * @return The function, or NULL if there is none.
+*/
+Function* findFunction(const char* name) {
+    for (Function* fn = functions; fn != NULL; fn = fn->next) {
+        if (fn->name[0] == name[0] && strcmp(fn->name, name) == 0) {
+            return fn;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Frees a function that is no longer defined or running.
+ * @param fn The function.
+*/
+void freeFunction(Function* fn) {
+    ArenaMark all = { NULL, 0 };
+    arenaRelease(&fn->arena, all);
+    free(fn->name);
+    free(fn);
+}
+
+/**
+ * @brief Calls a function in the shell.
+ * @param fn The function.
+ * @param argv The command's words; argv[1] onwards become $1, $2 and so on for the call.
+ * @return The function's status: that of its last command, or the one given to return.
+ * @details Loops outside the function cannot be left with break or continue from inside it.
+*/
+int callFunction(Function* fn, char** argv) {
+    char** outer_args = script_args;
+    int outer_argc = script_argc;
+    int outer_loops = loop_depth;
+
+    script_args = argv + 1;
+    script_argc = 0;
+    while (script_args[script_argc] != NULL) {
+        script_argc++;
+    }
+    loop_depth = 0;
+    function_depth++;
+    fn->calls++;
+
+    runProgram(fn->prog, 0, fn->prog->ncode);
+    if (unwind == UNWIND_RETURN) {
+        unwind = 0;
+    }
+
+    fn->calls--;
+    function_depth--;
+    loop_depth = outer_loops;
+    script_args = outer_args;
+    script_argc = outer_argc;
+    if (fn->retired && fn->calls == 0) {
+        freeFunction(fn);
+    }
+    return last_status;
+}
+
+/**
+ * @brief Calls a function in the shell with its redirections applied.
+ * @param fn The function.
+ * @param argv The command's words.
+ * @param plan The redirections, saved and restored as for runBuiltin().
+ * @return The function's status, or 1 if a redirection could not be applied.
+*/
+int runFunction(Function* fn, char** argv, RedirPlan* plan) {
+    SavedFds saved;
+    int status = 1;
+
+    if (redirectShell(plan, &saved) == 0) {
+        status = callFunction(fn, argv);
+    }
+    if (restoreShell(&saved) != 0) {
+        status = status ? status : 1;
+    }
+    return status;
+}
+
+/**
+ * @brief Runs a node in forked copies of the shell, as a job.
+ * @param node A subshell, a pipeline with compound stages, or any node put in the background.
+ * @details Simple stages of a pipeline are expanded and spawned as usual; every other stage gets
+ * a forked shell that runs it and exits with its status.
+*/
+void runCompound(Node* node) {
+    Node* single = node;
+    Node** nodes = node->type == NODE_PIPELINE ? node->stages : &single;
+    int nstages = node->type == NODE_PIPELINE ? node->nstages : 1;
+    PipelineStage* stages = arenaAlloc(&line_arena, sizeof(PipelineStage) * nstages);
+    int background = (node->flags & NODE_BACKGROUND) != 0;
+
+    for (int i = 0; i < nstages; i++) {
+        Node* stage = nodes[i];
+        int failed;
+        if (stage->type == NODE_COMMAND && stage != node) {
+            failed = buildStage(&stages[i], node->text, stage->tokens, stage->ntokens);
+            failed = failed || (stages[i].argv[0] == NULL && !(fprintf(stderr, "Error: Empty command in pipeline\n") < 0));
+        }
+        else {
+            //The stage's own redirections are made by the forked shell before it runs the body
+            failed = buildStage(&stages[i], node->text, stage->redirs, stage->nredirs);
+            stages[i].body = stage;
+            stages[i].argv = arenaAlloc(&line_arena, sizeof(char*) * 2);
+            stages[i].argv[0] = tokensText(node->text, stage->tokens, stage->ntokens, 0);
+            stages[i].argv[1] = NULL;
+        }
+        if (failed) {
+            last_status = 2;
+            for (int j = 0; j <= i; j++) {
+                releaseRedirPlan(&stages[j].plan);
+            }
+            return;
+        }
+    }
+
+    if (nprocsubs > 0) {
+        for (int i = 0; i < nstages; i++) {
+            keepProcSubFds(&stages[i].plan, stages[i].argv);
+        }
+    }
+    runPipeline(stages, nstages, background, (node->flags & NODE_TIMED) != 0, tokensText(node->text, node->tokens, node->ntokens, background));
+    for (int i = 0; i < nstages; i++) {
+        releaseRedirPlan(&stages[i].plan);
+    }
+}
+
+/**
+ * @brief Starts a forked copy of the shell that runs a node and exits with its status.
+ * @param node The node; the child runs the block of bytecode compileBlock() made for it.
+ * @param plan The redirections to apply first.
+ * @param pgid The process group to join; 0 starts a new group and -1 keeps the shell's.
+ * @return The pid of the new process, or -1 on failure.
+ * @details The copy is not interactive: its own pipelines stay in its process group, and it
+ * does not report or wait for the jobs of the shell it was forked from.
+*/
+pid_t forkNode(Node* node, RedirPlan* plan, pid_t pgid) {
+    pid_t pid = fork();
+
+    if (pid == -1) {
+        perror("Error: fork");
+        return -1;
+    }
+    else if (pid == 0) {
+        if (pgid >= 0) {
+            setpgid(0, pgid);
+        }
+        signal(SIGTTOU, SIG_DFL);
+        job_control = 0;
+        job_list = NULL;
+        capture = NULL;
+
+        if (applyRedirPlan(plan) != 0) {
+            fflush(stdout);
+            _exit(1);
+        }
+        runProgram(node->prog, node->code_start, node->code_end);
+        fflush(stdout);
+        _exit(last_status);
+    }
+    if (pgid >= 0) {
+        setpgid(pid, pgid);
+    }
+    return pid;
+}
+
+/**
+     * @brief Executes a command with the given arguments.
+     * @details This function handles the execution of a simple command or a pipeline of them, including background processes, input and output redirection, and piping. It splits the tokens into pipeline stages at every "|", builds each stage with buildStage(), and hands the stages to runPipeline(). A single foreground builtin or function is run in the shell itself instead; a function takes precedence over a builtin of the same name. A leading "time" keyword reports what the whole command cost on stderr once it finishes.
+     * @param text The line the tokens were cut from. Words are NUL-terminated in place, so words with no quotes or expansions are passed on without being copied.
+     * @param tokens The tokens, as parsed into a NODE_COMMAND.
+     * @param ntokens The number of tokens; at least one.
+     * @param background Whether the command was followed by "&".
+*/
+void execCmd(char* text, Token* tokens, size_t ntokens, int background) {
+    int nstages = 1;
+    int timed = 0;
+
+    if (tokens[0].type == TOKEN_WORD && tokens[0].flags == 0 && tokens[0].length == 4 && memcmp(text + tokens[0].offset, "time", 4) == 0) {
+        timed = 1;
+        tokens++;
+        ntokens--;
+        if (ntokens == 0) {
+            //Nothing to time, as in sh
+            ResourceUsage none = { 0 };
+            printUsage(stderr, &none, "", 1);
+            last_status = 0;
+            return;
+        }
+    }
+
+    for (size_t i = 0; i < ntokens; i++) {
+        nstages += tokens[i].type == TOKEN_PIPE;
+    }
+    //Keep the command line for the job table
+    char* cmdline = tokensText(text, tokens, ntokens, background);
+
+    PipelineStage* stages = arenaAlloc(&line_arena, sizeof(PipelineStage) * nstages);
+    unsigned long captures_before = captures_run;
+    size_t start = 0;
+    for (int stage = 0; stage < nstages; stage++) {
+        size_t end = start;
+        while (end < ntokens && tokens[end].type != TOKEN_PIPE) {
+            end++;
+        }
+        if (buildStage(&stages[stage], text, tokens + start, end - start) != 0) {
+            last_status = 2;
+            for (int j = 0; j <= stage; j++) {
+                releaseRedirPlan(&stages[j].plan);
+            }
+            return;
+        }
+        start = end + 1;
+    }
+
+    if (nstages == 1 && stages[0].argv[0] == NULL) {
+        //Without a command name the status is that of the last $(...) in the words, or 0 if there was none
+        if (captures_run == captures_before) {
+            last_status = 0;
+        }
+        //Only assignments: they set shell variables, which stay exported if they were
+        for (char** a = stages[0].assigns; *a != NULL; a++) {
+            assignVariable(*a, 0);
+        }
+        //Redirections on their own are made and undone, as for ":", and only a failure among them changes the status
+        if (stages[0].plan.nactions > 0 && runBuiltin(findBuiltin(":"), stages[0].argv, &stages[0].plan) != 0) {
+            last_status = 1;
+        }
+        releaseRedirPlan(&stages[0].plan);
+        return;
+    }
+
+    Builtin* builtin = nstages == 1 && !background && stages[0].argv[0] != NULL ? findBuiltin(stages[0].argv[0]) : NULL;
+    Function* fn = nstages == 1 && !background && capture == NULL && functions != NULL && stages[0].argv[0] != NULL ? findFunction(stages[0].argv[0]) : NULL;
+    int empty = 0;
+
+    if (nprocsubs > 0) {
+        for (int i = 0; i < nstages; i++) {
+            keepProcSubFds(&stages[i].plan, stages[i].argv);
+        }
+    }
+
+    //Inside $(...) only pure builtins stay in the shell; the last stage writes to the capture
+    if (capture != NULL) {
+        if (builtin != NULL && (!builtin->pure || (functions != NULL && findFunction(builtin->name) != NULL))) {
+            builtin = NULL;
+        }
+        if (builtin != NULL) {
+            //Output the pipelines before it left in the buffer goes first
+            if (spillCapture(capture) < 0) {
+                perror("Error: command substitution");
+            }
+            stages[0].plan.stdout_fd = capture->spill_fd;
+        }
+    }
+
+    for (int i = 0; i < nstages; i++) {
+        empty |= stages[i].argv[0] == NULL;
+    }
+
+    if (empty) {
+        fprintf(stderr, "Error: Empty command in pipeline\n");
+        last_status = 2;
+    }
+    else if (builtin != NULL || fn != NULL) {
+        //A lone foreground builtin or function runs in the shell; in a pipeline or the background it gets a child
+        struct rusage before;
+        struct timespec started;
+        if (timed) {
+            getrusage(RUSAGE_SELF, &before);
+            clock_gettime(CLOCK_MONOTONIC, &started);
+        }
+        //Its VAR=value prefixes are set for as long as it runs
+        char** saved = saveVariables(stages[0].assigns);
+        last_status = fn != NULL ? runFunction(fn, stages[0].argv, &stages[0].plan) : runBuiltin(builtin, stages[0].argv, &stages[0].plan);
+        restoreVariables(stages[0].assigns, saved);
+        if (timed) {
+            reportBuiltinTime(stages[0].argv[0], &before, &started);
+        }
+    }
+    else {
+        runPipeline(stages, nstages, background, timed, cmdline);
+    }
+
+    //The children have their own copies of any here-documents by now
+    for (int i = 0; i < nstages; i++) {
+        releaseRedirPlan(&stages[i].plan);
+    }
+}
+
+/**
+ * @brief Expands the tokens of one simple command into a pipeline stage.
+ * @param stage The stage to fill in: its argv, its VAR=value prefixes and its redirection plan.
+ * @param text The line the tokens were cut from; words are NUL-terminated in place.
+ * @param tokens The command's words and redirections.
+ * @param ntokens The number of tokens; may be 0, for a subshell or group without redirections.
+ * @return 0, or -1 if a redirection failed, which has been reported and leaves the plan to release.
+*/
+int buildStage(PipelineStage* stage, char* text, Token* tokens, size_t ntokens) {
+    size_t nargs = 0;
+    size_t args_cap = 8;
+    size_t nassigns = 0;
+    size_t assigns_cap = 4;
+    char** args = arenaAlloc(&line_arena, sizeof(char*) * args_cap);
+    char** assigns = arenaAlloc(&line_arena, sizeof(char*) * assigns_cap);
+
+    initRedirPlan(&stage->plan);
+    stage->body = NULL;
+    stage->argv = args;
+    stage->assigns = assigns;
+    args[0] = NULL;
+    assigns[0] = NULL;
+    for (size_t i = 0; i < ntokens; i++) {
+        if (tokens[i].type == TOKEN_WORD || tokens[i].type == TOKEN_IO_NUMBER) {
+            text[tokens[i].offset + tokens[i].length] = '\0';
+        }
+    }
+
+    //Expand the words into the argv, taking out redirections
+    for (size_t i = 0; i < ntokens; i++) {
+        Token* t = &tokens[i];
+        char* word = text + t->offset;
+
+        if (t->type == TOKEN_IO_NUMBER || TOKEN_IS_REDIR(t->type)) {
+            int fd = -1;
+            if (t->type == TOKEN_IO_NUMBER) {
+                fd = t->length <= 7 ? atoi(word) : INT_MAX;
+                t = &tokens[++i];
+            }
+            if (i + 1 >= ntokens || tokens[i + 1].type != TOKEN_WORD) {
+                fprintf(stderr, "Error: Missing file name after %s\n", token_spellings[t->type]);
+                return -1;
+            }
+            const char* target = text + tokens[++i].offset;
+            if ((t->type == TOKEN_DLESS || t->type == TOKEN_DLESSDASH) && i + 2 < ntokens && tokens[i + 1].type == TOKEN_HEREDOC) {
+                //A here-document's body is written out from between the two tokens after the delimiter
+                int body = hereDocFd(text, &tokens[i + 1], t->type == TOKEN_DLESSDASH);
+                if (body < 0) {
+                    return -1;
+                }
+                addRedirAction(&stage->plan, REDIR_FD, fd < 0 ? STDIN_FILENO : fd, body, 0, NULL);
+                i += 2;
+                continue;
+            }
+            if (tokens[i].flags != 0) {
+                target = expandString(target, EXPAND_STRING);
+            }
+            if (parseRedirection(&stage->plan, fd, t->type, target) < 0) {
+                return -1;
+            }
+        }
+        else if (t->type != TOKEN_WORD) {
+            continue;
+        }
+        else if (nargs == 0 && isAssignment(word) > 0) {
+            //NAME=value before the command name applies to that command only
+            assigns = appendWord(assigns, &nassigns, &assigns_cap, t->flags == 0 ? word : expandString(word, EXPAND_STRING));
+        }
+        else {
+            args = expandToken(args, &nargs, &args_cap, text, t);
+        }
+    }
+
+    args[nargs] = NULL;
+    assigns[nassigns] = NULL;
+    stage->argv = args;
+    stage->assigns = assigns;
+    return 0;
+}
+
+/**
+ * @brief Expands one word token into fields and appends them to an argv.
+ * @param words The argv, in line_arena.
+ * @param count The number of words so far; updated.
+ * @param cap The capacity of words; updated when it grows.
+ * @param text The text the token was cut from; the word is NUL-terminated in place.
+ * @param t The token.
+ * @return The argv, which moves when it grows.
+ * @details A word with no quotes or expansions is passed on without being copied, and one that
+ * is only a pattern goes straight to glob expansion.
+*/
+char** expandToken(char** words, size_t* count, size_t* cap, char* text, Token* t) {
+    char* word = text + t->offset;
+    word[t->length] = '\0';
+    if (t->flags == 0) {
+        return appendWord(words, count, cap, word);
+    }
+    if (t->flags == WORD_GLOB) {
+        char** matches;
+        size_t nmatches = expandGlob(word, &matches);
+        for (size_t m = 0; m < nmatches; m++) {
+            words = appendWord(words, count, cap, matches[m]);
+        }
+        return nmatches > 0 ? words : appendWord(words, count, cap, word);
+    }
+    return expandWord(words, count, cap, word, EXPAND_FIELDS);
+}
+
+/**
+ * @brief Rebuilds the text of a command from its tokens, for the job table.
+ * @param text The line the tokens were cut from.
+ * @param tokens The tokens.
+ * @param ntokens The number of tokens.
+ * @param background Whether to append " &".
+ * @return The tokens joined by single spaces, in line_arena; a newline becomes "; " where it
+ * ends a command.
+ * @details Operators are written from their spellings, since the byte after a word may already
+ * have been overwritten by its terminating NUL. Here-document bodies are left out.
+*/
+char* tokensText(char* text, Token* tokens, size_t ntokens, int background) {
+    size_t len = 3;
+    for (size_t i = 0; i < ntokens; i++) {
+        len += tokens[i].length + 2;
+    }
+    char* out = arenaAlloc(&line_arena, len);
+    size_t used = 0;
+    int ends_command = 0;
+
+    for (size_t i = 0; i < ntokens; i++) {
+        Token* t = &tokens[i];
+        const char* spelling = token_spellings[t->type];
+        size_t spelling_len = t->length;
+        if (t->type == TOKEN_WORD || t->type == TOKEN_IO_NUMBER) {
+            spelling = text + t->offset;
+        }
+        else if (t->type == TOKEN_HEREDOC) {
+            continue;
+        }
+        else if (t->type == TOKEN_NEWLINE) {
+            if (!ends_command) {
+                continue;
+            }
+            spelling = ";";
+            spelling_len = 1;
+        }
+        if (used > 0 && t->type != TOKEN_SEMI && t->type != TOKEN_NEWLINE && tokens[i - 1].type != TOKEN_IO_NUMBER) {
+            out[used++] = ' ';
+        }
+        memcpy(out + used, spelling, spelling_len);
+        used += spelling_len;
+        ends_command = (t->type == TOKEN_WORD && !(t->flags == 0 && tokensOpen(spelling, t->length))) || t->type == TOKEN_RPAREN;
+    }
+    if (background) {
+        memcpy(out + used, " &", 2);
+        used += 2;
+    }
+    out[used] = '\0';
+    return out;
+}
+
+/**
+ * @brief Checks whether a word opens a body, so a newline after it does not end a command.
+ * @param word The word.
+ * @param len Its length.
+ * @return 1 for {, then, else, do and in, otherwise 0.
+*/
+int tokensOpen(const char* word, size_t len) {
+    static const char* openers[] = { "{", "in", "do", "then", "else" };
+    for (size_t k = 0; k < sizeof(openers) / sizeof(openers[0]); k++) {
+        if (strlen(openers[k]) == len && memcmp(openers[k], word, len) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Runs a pipeline of any length and, unless it is in the background, reaps every stage.
+ * @param stages The stages in order; their pids and statuses are filled in.
+ * @param nstages The number of stages.
+ * @param background A flag indicating whether the pipeline should run in the background.
+ * @param timed Whether to report the pipeline's resource usage once it finishes, for "time".
+ * @param cmdline The command line as typed, recorded in the job table.
+ * @details All pipes are created up front with O_CLOEXEC and sized by pipeCapacityFor(), so each child keeps only the two ends
+ * its file actions dup onto stdin and stdout and every other end is closed at exec, which lets
+ * EOF arrive as soon as a writer exits. The shell drops its copies as soon as the stages using
+ * them are spawned. With job control, all stages join the process group of the first one, which
+ * is given the terminal while it runs in the foreground. The pipeline becomes a job; once a foreground job
+ * finishes, its per-stage exit statuses are kept in pipe_status and the last stage's status in
+ * last_status.
+*/
+void runPipeline(PipelineStage* stages, int nstages, int background, int timed, const char* cmdline) {
+    int (*pipes)[2] = malloc(sizeof(int[2]) * (nstages > 1 ? nstages - 1 : 1));
+
+    //Inside $(...) the last stage writes to a pipe of this pipeline's own, drained below
+    int captured[2] = { -1, -1 };
+    if (capture != NULL) {
+        if (pipe2(captured, O_CLOEXEC) < 0) {
+            perror("Pipe creation failed");
+            free(pipes);
+            last_status = 1;
+            return;
+        }
+        stages[nstages - 1].plan.stdout_fd = captured[1];
+    }
+
+    for (int i = 0; i < nstages - 1; i++) {
+        if (pipe2(pipes[i], O_CLOEXEC) < 0) {
+            perror("Pipe creation failed");
+            for (int j = 0; j < i; j++) {
+                close(pipes[j][0]);
+                close(pipes[j][1]);
+            }
+            if (captured[0] >= 0) {
+                close(captured[0]);
+                close(captured[1]);
+            }
+            free(pipes);
+            return;
+        }
+        tunePipe(pipes[i][1], pipeCapacityFor(stages[i].argv[0]));
+    }
+
+    struct timespec started;
+    clock_gettime(CLOCK_MONOTONIC, &started);
+
+    //Anything the shell printed must come out before the children's output, and only once
+    fflush(stdout);
+
+    pid_t pgid = 0;
+    for (int i = 0; i < nstages; i++) {
+        RedirPlan* plan = &stages[i].plan;
+        if (i > 0) {
+            plan->stdin_fd = pipes[i - 1][0];
+        }
+        if (i < nstages - 1) {
+            plan->stdout_fd = pipes[i][1];
+        }
+
+        if (stages[i].body != NULL) {
+            stages[i].pid = forkNode(stages[i].body, plan, job_control ? pgid : -1);
+        }
+        else {
+            stages[i].pid = spawnCmd(stages[i].argv, stages[i].assigns, plan, job_control ? pgid : -1);
+        }
+        stages[i].status = 127 << 8;
+        if (stages[i].pid != -1 && pgid == 0) {
+            pgid = stages[i].pid;
+            if (job_control && !background) {
+                tcsetpgrp(STDIN_FILENO, pgid);
+            }
+        }
+
+        if (i > 0) {
+            close(pipes[i - 1][0]);
+        }
+        if (i < nstages - 1) {
+            close(pipes[i][1]);
+        }
+    }
+    free(pipes);
+
+    //A $(...) reads the last stage's output while the pipeline runs, then waits for it as usual
+    if (captured[0] >= 0) {
+        close(captured[1]);
+        drainCapture(capture, captured[0]);
+        close(captured[0]);
+    }
+
+    free(pipe_status);
+    pipe_status = malloc(sizeof(int) * nstages);
+    pipe_status_len = nstages;
+
+    if (pgid == 0) {
+        //Nothing could be started
+        for (int i = 0; i < nstages; i++) {
+            pipe_status[i] = 127;
+        }
+        last_status = 127;
+        return;
+    }
+
+    Job* job = addJob(stages, nstages, pgid, cmdline);
+    job->timed = timed;
+
+    if (background == 1) {
+        //Reaped later by reapChildren() once SIGCHLD reports it
+        last_background_pid = stages[nstages - 1].pid;
+        //Only an interactive shell announces the job; a script's output is not the place for it
+        if (job_control) {
+            printf("[%d] %d\n", job->id, pgid);
+        }
+        return;
+    }
+
+    foregroundJob(job, 0);
+    if (job->state != JOB_DONE) {
+        return;
+    }
+
+    for (int i = 0, p = 0; i < nstages; i++) {
+        if (stages[i].pid != -1) {
+            stages[i].status = job->procs[p].status;
+            stages[i].usage = job->procs[p].usage;
+            p++;
+        }
+        pipe_status[i] = waitStatusToCode(stages[i].status);
+    }
+    last_status = pipe_status[nstages - 1];
+    removeJob(job);
+
+    if (pipe_capacity_auto && nstages > 1) {
+        struct timespec finished;
+        clock_gettime(CLOCK_MONOTONIC, &finished);
+        adaptPipeCapacity(stages, nstages, (finished.tv_sec - started.tv_sec) + (finished.tv_nsec - started.tv_nsec) / 1e9);
+    }
+}
+
+/**
+ * @brief Adds a freshly spawned pipeline to the job table.
+ * @param stages The spawned stages; those that failed to start are left out.
+ * @param nstages The number of stages.
+ * @param pgid The pipeline's process group, or its first pid without job control.
+ * @param cmdline The command line as typed.
+ * @return The new job, numbered one past the highest job number in use.
+*/
+Job* addJob(PipelineStage* stages, int nstages, pid_t pgid, const char* cmdline) {
+    Job* job = malloc(sizeof(Job));
+    Job** tail = &job_list;
+    int id = 1;
+
+    while (*tail != NULL) {
+        id = (*tail)->id + 1;
+        tail = &(*tail)->next;
+    }
+
+    job->id = id;
+    job->pgid = pgid;
+    job->procs = malloc(sizeof(JobProc) * nstages);
+    job->nprocs = 0;
+    job->state = JOB_RUNNING;
+    job->notified = 0;
+    job->timed = 0;
+    job->has_tmodes = 0;
+    job->cmdline = strdup(cmdline);
+    job->next = NULL;
+    clock_gettime(CLOCK_MONOTONIC, &job->started);
+
+    for (int i = 0; i < nstages; i++) {
+        if (stages[i].pid != -1) {
+            JobProc* proc = &job->procs[job->nprocs++];
+            proc->pid = stages[i].pid;
+            proc->state = JOB_RUNNING;
+            proc->status = 0;
+            memset(&proc->usage, 0, sizeof(struct rusage));
+            proc->name = strdup(stages[i].argv[0]);
+        }
+    }
+
+    *tail = job;
+    return job;
+}
+
+/**
+ * @brief Unlinks a job from the job table and frees it.
+ * @param job The job to remove.
+ * @details A finished job started with "time" has its usage reported here, since every way of
+ * collecting a job ends with this call. The last job collected is kept for the metrics builtin
+ * in place of the one before it.
+*/
+void removeJob(Job* job) {
+    for (Job** link = &job_list; *link != NULL; link = &(*link)->next) {
+        if (*link == job) {
+            *link = job->next;
+            break;
+        }
+    }
+    if (job->state != JOB_DONE) {
+        freeJob(job);
+        return;
+    }
+    if (job->timed) {
+        fflush(stdout);
+        printJobUsage(stderr, job);
+    }
+    job->next = NULL;
+    freeJob(last_job);
+    last_job = job;
+}
+
+/**
+ * @brief Frees a job that is no longer in the job table.
+ * @param job The job, or NULL.
+*/
+void freeJob(Job* job) {
+    if (job == NULL) {
+        return;
+    }
+    for (int i = 0; i < job->nprocs; i++) {
+        free(job->procs[i].name);
+    }
+    free(job->procs);
+    free(job->cmdline);
+    free(job);
+}
+
+/**
+ * @brief Returns the current ("+") or previous ("-") job.
+ * @param which 0 for the current job, 1 for the previous one.
+ * @return The job, or NULL if there is none.
+ * @details Like other shells, the most recent stopped job is preferred over running ones.
+*/
+Job* currentJob(int which) {
+    Job* best[2] = { NULL, NULL };
+    for (int stopped = 1; stopped >= 0; stopped--) {
+        for (Job* job = job_list; job != NULL; job = job->next) {
+            if ((job->state == JOB_STOPPED) != stopped || job->state == JOB_DONE) {
+                continue;
+            }
+            if (best[0] == NULL || (best[0]->state == JOB_STOPPED) == stopped) {
+                best[1] = best[0];
+                best[0] = job;
+            }
+            else if (best[1] == NULL || (best[1]->state == JOB_STOPPED) == stopped) {
+                best[1] = job;
+            }
+        }
+    }
+    return best[which];
+}
+
+/**
+ * @brief Resolves a job specification.
+ * @param spec "%n", "%%", "%+", "%-", "%prefix", or NULL for the current job.
+ * @param builtin The name of the calling builtin, used in error messages.
+ * @return The job, or NULL after printing an error.
+*/
+Job* findJob(const char* spec, const char* builtin) {
+    Job* found = NULL;
+
+    if (spec == NULL || strcmp(spec, "%%") == 0 || strcmp(spec, "%+") == 0 || strcmp(spec, "%") == 0) {
+        found = currentJob(0);
+    }
+    else if (strcmp(spec, "%-") == 0) {
+        found = currentJob(1);
+    }
+    else if (spec[0] == '%' && spec[1] >= '0' && spec[1] <= '9') {
+        int id = atoi(spec + 1);
+        for (Job* job = job_list; job != NULL; job = job->next) {
+            if (job->id == id) {
+                found = job;
+            }
+        }
+    }
+    else if (spec[0] == '%') {
+        for (Job* job = job_list; job != NULL; job = job->next) {
+            if (strncmp(job->cmdline, spec + 1, strlen(spec + 1)) == 0) {
+                found = job;
+            }
+        }
+    }
+    else {
+        pid_t pid = atoi(spec);
+        for (Job* job = job_list; job != NULL; job = job->next) {
+            if (job->pgid == pid) {
+                found = job;
+            }
+        }
+    }
+
+    if (found == NULL) {
+        fprintf(stderr, "%s: %s: no such job\n", builtin, spec != NULL ? spec : "current");
+    }
+    return found;
+}
+
+/**
+ * @brief Records a state change reported by wait4() against the job that owns the pid.
+ * @param pid The child whose state changed.
+ * @param status The wait status.
+ * @param usage The child's resource usage, meaningful once it has terminated.
+*/
+void updateJob(pid_t pid, int status, struct rusage* usage) {
+    for (Job* job = job_list; job != NULL; job = job->next) {
+        int running = 0;
+        int stopped = 0;
+        int matched = 0;
+
+        for (int i = 0; i < job->nprocs; i++) {
+            JobProc* proc = &job->procs[i];
+            if (proc->pid == pid) {
+                matched = 1;
+                if (WIFSTOPPED(status)) {
+                    proc->state = JOB_STOPPED;
+                }
+                else if (WIFCONTINUED(status)) {
+                    proc->state = JOB_RUNNING;
+                }
+                else {
+                    proc->state = JOB_DONE;
+                    proc->status = status;
+                    proc->usage = *usage;
+                }
+            }
+            running += proc->state == JOB_RUNNING;
+            stopped += proc->state == JOB_STOPPED;
+        }
+
+        if (matched) {
+            int state = running ? JOB_RUNNING : (stopped ? JOB_STOPPED : JOB_DONE);
+            if (state != job->state) {
+                job->state = state;
+                job->notified = 0;
+                if (state == JOB_DONE) {
+                    recordJobUsage(job);
+                }
+            }
+            return;
+        }
+    }
+}
+
+/**
+ * @brief Blocks until every process of a job has finished or the job has stopped.
+ * @param job The job to wait for.
+ * @details Waits on the job's own pids only, so other children keep their statuses.
+*/
+void waitForJob(Job* job) {
+    int status;
+    struct rusage usage;
+
+    while (job->state == JOB_RUNNING) {
+        JobProc* proc = NULL;
+        for (int i = 0; i < job->nprocs && proc == NULL; i++) {
+            if (job->procs[i].state == JOB_RUNNING) {
+                proc = &job->procs[i];
+            }
+        }
+        if (proc == NULL) {
+            break;
+        }
+
+        pid_t pid = wait4(proc->pid, &status, WUNTRACED, &usage);
+        if (pid < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            //Already reaped elsewhere; there is no status left to collect
+            status = 0;
+            memset(&usage, 0, sizeof(usage));
+            pid = proc->pid;
+        }
+        updateJob(pid, status, &usage);
+    }
+}
+
+/**
+ * @brief Sends a signal to every process of a job.
+ * @param job The job.
+ * @param sig The signal.
+ * @details With job control the whole process group is signalled at once; otherwise the job's
+ * processes share the shell's group and are signalled one by one.
+*/
+void signalJob(Job* job, int sig) {
+    if (job_control) {
+        kill(-job->pgid, sig);
+        return;
+    }
+    for (int i = 0; i < job->nprocs; i++) {
+        if (job->procs[i].state != JOB_DONE) {
+            kill(job->procs[i].pid, sig);
+        }
+    }
+}
+
+/**
+ * @brief Runs a job in the foreground until it finishes or stops.
+ * @param job The job.
+ * @param resume Whether to send SIGCONT first, as fg does.
+ * @details The job gets the terminal (and its saved terminal modes) while it runs; afterwards
+ * the shell takes the terminal back and restores its own modes. A job that stops is reported.
+*/
+void foregroundJob(Job* job, int resume) {
+    if (job_control) {
+        tcsetpgrp(STDIN_FILENO, job->pgid);
+        if (resume && job->has_tmodes) {
+            tcsetattr(STDIN_FILENO, TCSADRAIN, &job->tmodes);
+        }
+    }
+    if (resume) {
+        for (int i = 0; i < job->nprocs; i++) {
+            if (job->procs[i].state == JOB_STOPPED) {
+                job->procs[i].state = JOB_RUNNING;
+            }
+        }
+        job->state = JOB_RUNNING;
+        signalJob(job, SIGCONT);
+    }
+
+    waitForJob(job);
+
+    if (job_control) {
+        tcsetpgrp(STDIN_FILENO, shell_pgid);
+        if (job->state == JOB_STOPPED) {
+            job->has_tmodes = tcgetattr(STDIN_FILENO, &job->tmodes) == 0;
+        }
+        tcsetattr(STDIN_FILENO, TCSADRAIN, &shell_tmodes);
+    }
+
+    if (job->state == JOB_STOPPED) {
+        printf("\n");
+        printJob(job, 0);
+        job->notified = 1;
+        last_status = 128 + SIGTSTP;
+    }
+}
+
+/**
+ * @brief Returns a finished job's exit code, which is that of its last process.
+ * @param job The job.
+*/
+int jobExitCode(Job* job) {
+    if (job->nprocs == 0) {
+        return 127;
+    }
+    return waitStatusToCode(job->procs[job->nprocs - 1].status);
+}
+
+/**
+ * @brief Prints one line describing a job in the format used by jobs.
+ * @param job The job.
+ * @param show_pids Whether to add every pid and the job's age, as "jobs -l" does.
+*/
+void printJob(Job* job, int show_pids) {
+    char mark = ' ';
+    const char* state = "Running";
+    char done[32];
+
+    if (job == currentJob(0)) {
+        mark = '+';
+    }
+    else if (job == currentJob(1)) {
+        mark = '-';
+    }
+
+    if (job->state == JOB_STOPPED) {
+        state = "Stopped";
+    }
+    else if (job->state == JOB_DONE) {
+        int code = jobExitCode(job);
+        int status = job->procs[job->nprocs - 1].status;
+        if (WIFSIGNALED(status)) {
+            snprintf(done, sizeof(done), "%s", strsignal(WTERMSIG(status)));
+        }
+        else if (code != 0) {
+            snprintf(done, sizeof(done), "Exit %d", code);
+        }
+        else {
+            snprintf(done, sizeof(done), "Done");
+        }
+        state = done;
+    }
+
+    printf("[%d]%c  %-22s %s\n", job->id, mark, state, job->cmdline);
+
+    if (show_pids) {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        printf("      pgid %d, started %lds ago, pids", job->pgid, (long)(now.tv_sec - job->started.tv_sec));
+        for (int i = 0; i < job->nprocs; i++) {
+            printf(" %d", job->procs[i].pid);
+        }
+        printf("\n");
+    }
+}
+
+/**
+ * @brief Reports background jobs that finished or stopped since the last prompt.
+ * @details Finished jobs are removed from the table once reported.
+*/
+void notifyJobs() {
+    Job* job = job_list;
+    while (job != NULL) {
+        Job* next = job->next;
+        if (!job->notified && job->state != JOB_RUNNING) {
+            printJob(job, 0);
+            job->notified = 1;
+        }
+        if (job->state == JOB_DONE && job->notified) {
+            removeJob(job);
+        }
+        job = next;
+    }
+}
+
+/**
+ * @brief Works out what a job cost once its last process has finished, and adds it to the
+ * session totals.
+ * @param job The finished job.
+ * @details Real time runs from the spawn of the first stage until the shell noticed the last
+ * one exit; user and sys time and context switches are summed over the stages.
+*/
+void recordJobUsage(Job* job) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    memset(&job->usage, 0, sizeof(ResourceUsage));
+    for (int i = 0; i < job->nprocs; i++) {
+        ResourceUsage stage;
+        usageFromRusage(&stage, &job->procs[i].usage);
+        addUsage(&job->usage, &stage);
+    }
+    job->usage.real = (now.tv_sec - job->started.tv_sec) + (now.tv_nsec - job->started.tv_nsec) / 1e9;
+
+    addUsage(&session_usage, &job->usage);
+    session_pipelines++;
+    session_processes += job->nprocs;
+}
+
+/**
+ * @brief Converts a struct rusage from wait4() or getrusage().
+ * @param out Set to the usage, with its real time marked as not measured.
+ * @param usage The kernel's figures.
+*/
+void usageFromRusage(ResourceUsage* out, const struct rusage* usage) {
+    out->real = -1;
+    out->user = usage->ru_utime.tv_sec + usage->ru_utime.tv_usec / 1e6;
+    out->sys = usage->ru_stime.tv_sec + usage->ru_stime.tv_usec / 1e6;
+    out->maxrss = usage->ru_maxrss;
+    out->nvcsw = usage->ru_nvcsw;
+    out->nivcsw = usage->ru_nivcsw;
+}
+
+/**
+ * @brief Adds one usage to a total.
+ * @param total The total; its maxrss becomes the larger of the two.
+ * @param usage The usage to add; a real time that was not measured adds nothing.
+*/
+void addUsage(ResourceUsage* total, const ResourceUsage* usage) {
+    if (usage->real > 0) {
+        total->real += usage->real;
+    }
+    total->user += usage->user;
+    total->sys += usage->sys;
+    total->maxrss = usage->maxrss > total->maxrss ? usage->maxrss : total->maxrss;
+    total->nvcsw += usage->nvcsw;
+    total->nivcsw += usage->nivcsw;
+}
+
+/**
+ * @brief Prints one row of a resource usage table.
+ * @param out Where to print.
+ * @param usage The usage.
+ * @param label What the row describes.
+ * @param header Whether to print the column headings first.
+*/
+void printUsage(FILE* out, const ResourceUsage* usage, const char* label, int header) {
+    if (header) {
+        fprintf(out, "      real      user       sys     maxrss     vcsw    ivcsw\n");
+    }
+    if (usage->real < 0) {
+        fprintf(out, "%10s", "-");
+    }
+    else {
+        fprintf(out, "%10.3f", usage->real);
+    }
+    fprintf(out, "%10.3f%10.3f%10ldK%9ld%9ld  %s\n", usage->user, usage->sys, usage->maxrss, usage->nvcsw, usage->nivcsw, label);
+}
+
+/**
+ * @brief Prints what a finished job cost, with a row per stage when it is a pipeline.
+ * @param out Where to print.
+ * @param job The job.
+*/
+void printJobUsage(FILE* out, Job* job) {
+    printUsage(out, &job->usage, job->cmdline, 1);
+    if (job->nprocs < 2) {
+        return;
+    }
+    for (int i = 0; i < job->nprocs; i++) {
+        ResourceUsage stage;
+        char label[64];
+        usageFromRusage(&stage, &job->procs[i].usage);
+        snprintf(label, sizeof(label), "  %s (exit %d)", job->procs[i].name, waitStatusToCode(job->procs[i].status));
+        printUsage(out, &stage, label, 0);
+    }
+}
+
+/**
+ * @brief Reports on stderr what a builtin run by "time" inside the shell cost.
+ * @param name The builtin's name.
+ * @param before The shell's usage from just before it ran.
+ * @param started When it started.
+ * @details maxrss is the shell's own peak, since a builtin has no process of its own.
+*/
+void reportBuiltinTime(const char* name, const struct rusage* before, const struct timespec* started) {
+    struct rusage after;
+    struct timespec now;
+    getrusage(RUSAGE_SELF, &after);
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    ResourceUsage usage;
+    ResourceUsage base;
+    usageFromRusage(&usage, &after);
+    usageFromRusage(&base, before);
+    usage.real = (now.tv_sec - started->tv_sec) + (now.tv_nsec - started->tv_nsec) / 1e9;
+    usage.user -= base.user;
+    usage.sys -= base.sys;
+    usage.nvcsw -= base.nvcsw;
+    usage.nivcsw -= base.nivcsw;
+    fflush(stdout);
+    printUsage(stderr, &usage, name, 1);
+}
+
+/**
+ * @brief Implements the metrics builtin: what the session's commands have cost so far.
+ * @param args The command-line arguments; "-r" resets the totals.
+ * @return The exit status of the builtin.
+ * @details Prints the totals over every finished pipeline, the shell's own usage (which
+ * includes every builtin it ran itself), and the last pipeline collected, stage by stage.
+*/
+int metricsBuiltin(char** args) {
+    if (args[1] != NULL && strcmp(args[1], "-r") == 0) {
+        memset(&session_usage, 0, sizeof(ResourceUsage));
+        session_pipelines = 0;
+        session_processes = 0;
+        freeJob(last_job);
+        last_job = NULL;
+        return 0;
+    }
+    if (args[1] != NULL) {
+        fprintf(stderr, "metrics: usage: metrics [-r]\n");
+        return 2;
+    }
+
+    struct rusage self;
+    ResourceUsage shell;
+    char label[64];
+    getrusage(RUSAGE_SELF, &self);
+    usageFromRusage(&shell, &self);
+
+    snprintf(label, sizeof(label), "%lu pipelines, %lu processes", session_pipelines, session_processes);
+    printUsage(stdout, &session_usage, label, 1);
+    printUsage(stdout, &shell, "shell", 0);
+    if (last_job != NULL) {
+        printf("\n");
+        printJobUsage(stdout, last_job);
+    }
+    return 0;
+}
+
+/**
+ * @brief Implements the jobs builtin.
+ * @param args The command-line arguments; "-l" adds pids, process group and age.
+ * @return The exit status of the builtin.
+*/
+int jobsBuiltin(char** args) {
+    int show_pids = args[1] != NULL && strcmp(args[1], "-l") == 0;
+
+    reapChildren();
+    for (Job* job = job_list; job != NULL; job = job->next) {
+        printJob(job, show_pids);
+        job->notified = 1;
+    }
+    notifyJobs();
+    return 0;
+}
+
+/**
+ * @brief Implements the fg builtin: resumes a job in the foreground and waits for it.
+ * @param args The command-line arguments; args[1] is an optional job specification.
+ * @return The exit status of the builtin.
+*/
+int fgBuiltin(char** args) {
+    reapChildren();
+    Job* job = findJob(args[1], "fg");
+    if (job == NULL) {
+        return 1;
+    }
+
+    printf("%s\n", job->cmdline);
+    foregroundJob(job, 1);
+    if (job->state != JOB_DONE) {
+        return 128 + SIGTSTP;
+    }
+    int code = jobExitCode(job);
+    removeJob(job);
+    return code;
+}
+
+/**
+ * @brief Implements the bg builtin: resumes a stopped job in the background.
+ * @param args The command-line arguments; args[1] is an optional job specification.
+ * @return The exit status of the builtin.
+*/
+int bgBuiltin(char** args) {
+    reapChildren();
+    Job* job = findJob(args[1], "bg");
+    if (job == NULL) {
+        return 1;
+    }
+
+    for (int i = 0; i < job->nprocs; i++) {
+        if (job->procs[i].state == JOB_STOPPED) {
+            job->procs[i].state = JOB_RUNNING;
+        }
+    }
+    job->state = JOB_RUNNING;
+    signalJob(job, SIGCONT);
+    printf("[%d] %s &\n", job->id, job->cmdline);
+    return 0;
+}
+
+/**
+ * @brief Implements the wait builtin.
+ * @param args The command-line arguments.
+ * @return The exit status of the builtin.
+ * @details "wait" waits for every background job, "wait %n" or "wait pid" for one job or
+ * process, and "wait -n" for whichever job finishes next. The exit status is that of the last
+ * job or process waited for, or 127 if there was nothing to wait for.
+*/
+int waitBuiltin(char** args) {
+    int status;
+    struct rusage usage;
+    pid_t pid;
+    int result = 0;
+
+    reapChildren();
+
+    if (args[1] != NULL && strcmp(args[1], "-n") == 0) {
+        while (1) {
+            Job* running = NULL;
+            for (Job* job = job_list; job != NULL; job = job->next) {
+                if (job->state == JOB_DONE && !job->notified) {
+                    result = jobExitCode(job);
+                    removeJob(job);
+                    return result;
+                }
+                if (job->state == JOB_RUNNING) {
+                    running = job;
+                }
+            }
+            if (running == NULL) {
+                return 127;
+            }
+            pid = wait4(-1, &status, WUNTRACED, &usage);
+            if (pid > 0) {
+                updateJob(pid, status, &usage);
+            }
+            else if (errno != EINTR) {
+                return 127;
+            }
+        }
+    }
+
+    if (args[1] == NULL) {
+        while ((pid = wait4(-1, &status, 0, &usage)) > 0 || errno == EINTR) {
+            if (pid > 0) {
+                updateJob(pid, status, &usage);
+            }
+        }
+        Job* job = job_list;
+        while (job != NULL) {
+            Job* next = job->next;
+            if (job->state == JOB_DONE) {
+                removeJob(job);
+            }
+            job = next;
+        }
+        return 0;
+    }
+
+    for (int i = 1; args[i] != NULL; i++) {
+        if (args[i][0] == '%') {
+            Job* job = findJob(args[i], "wait");
+            if (job == NULL) {
+                result = 127;
+                continue;
+            }
+            waitForJob(job);
+            result = job->state == JOB_DONE ? jobExitCode(job) : 128 + SIGTSTP;
+            if (job->state == JOB_DONE) {
+                removeJob(job);
+            }
+            continue;
+        }
+
+        pid_t target = atoi(args[i]);
+        Job* owner = NULL;
+        JobProc* proc = NULL;
+        for (Job* job = job_list; job != NULL && proc == NULL; job = job->next) {
+            for (int p = 0; p < job->nprocs; p++) {
+                if (job->procs[p].pid == target) {
+                    owner = job;
+                    proc = &job->procs[p];
+                }
+            }
+        }
+        if (proc == NULL) {
+            fprintf(stderr, "wait: pid %s is not a child of this shell\n", args[i]);
+            result = 127;
+            continue;
+        }
+        while (proc->state == JOB_RUNNING) {
+            pid = wait4(target, &status, WUNTRACED, &usage);
+            if (pid > 0) {
+                updateJob(pid, status, &usage);
+            }
+            else if (errno != EINTR) {
+                proc->state = JOB_DONE;
+            }
+        }
+        result = waitStatusToCode(proc->status);
+        if (owner->state == JOB_DONE) {
+            removeJob(owner);
+        }
+    }
+    return result;
+}
+
+/**
+ * @brief Implements the kill builtin, which accepts job specifications as well as pids.
+ * @param args The command-line arguments: [-SIGNAL | -s SIGNAL] (%job | pid)...
+ * @return The exit status of the builtin.
+ * @details Signalling a job targets its whole process group; a stopped job is also continued
+ * so that it can act on the signal.
+*/
+int killBuiltin(char** args) {
+    int sig = SIGTERM;
+    int i = 1;
+
+    if (args[i] != NULL && args[i][0] == '-') {
+        const char* name = args[i] + 1;
+        if (strcmp(args[i], "-s") == 0 && args[i + 1] != NULL) {
+            name = args[++i];
+        }
+        i++;
+        if (strncmp(name, "SIG", 3) == 0) {
+            name += 3;
+        }
+        if (name[0] >= '0' && name[0] <= '9') {
+            sig = atoi(name);
+        }
+        else {
+            sig = -1;
+            for (int n = 1; n < NSIG; n++) {
+                const char* abbrev = sigabbrev_np(n);
+                if (abbrev != NULL && strcmp(abbrev, name) == 0) {
+                    sig = n;
+                }
+            }
+            if (sig == -1) {
+                fprintf(stderr, "kill: %s: invalid signal specification\n", name);
+                return 1;
+            }
+        }
+    }
+
+    if (args[i] == NULL) {
+        fprintf(stderr, "kill: usage: kill [-s sigspec | -signum] pid | %%job ...\n");
+        return 1;
+    }
+
+    int result = 0;
+    for (; args[i] != NULL; i++) {
+        if (args[i][0] == '%') {
+            Job* job = findJob(args[i], "kill");
+            if (job == NULL) {
+                result = 1;
+                continue;
+            }
+            signalJob(job, sig);
+            if (job->state == JOB_STOPPED && sig != SIGCONT && sig != 0) {
+                signalJob(job, SIGCONT);
+            }
+        }
+        else if (kill(atoi(args[i]), sig) < 0) {
+            perror("kill");
+            result = 1;
+        }
+    }
+    return result;
+}
+
+/**
+ * @brief Chooses the capacity for a pipe fed by the given command.
+ * @param producer The argv[0] of the stage writing into the pipe.
+ * @return The capacity in bytes, or 0 to keep the kernel default.
+*/
+long pipeCapacityFor(const char* producer) {
+    if (!pipe_capacity_auto) {
+        return pipe_capacity;
+    }
+    PipeHint* hint = findPipeHint(producer, 0);
+    return hint != NULL ? hint->capacity : pipe_capacity;
+}
+
+/**
+ * @brief Resizes a pipe with F_SETPIPE_SZ, backing off if the request exceeds the user's limit.
+ * @param fd Either end of the pipe.
+ * @param capacity The requested capacity in bytes; 0 leaves the pipe alone.
+*/
+void tunePipe(int fd, long capacity) {
+    if (capacity <= 0) {
+        return;
+    }
+    long max = readPipeMax();
+    if (capacity > max) {
+        capacity = max;
+    }
+    while (capacity > PIPE_SIZE_DEFAULT && fcntl(fd, F_SETPIPE_SZ, (int)capacity) < 0 && errno == EPERM) {
+        capacity /= 2;
+    }
+}
+
+/**
+ * @brief Adjusts the learned pipe capacity of each producer after a pipeline finishes.
+ * @param stages The reaped stages with their resource usage.
+ * @param nstages The number of stages.
+ * @param seconds The wall time the pipeline took.
+ * @details A producer that blocks on a full pipe shows up as a high rate of voluntary context
+ * switches. Producers switching more than 1000 times a second get their capacity doubled, up
+ * to /proc/sys/fs/pipe-max-size; those that barely block decay back towards the default.
+*/
+void adaptPipeCapacity(PipelineStage* stages, int nstages, double seconds) {
+    if (seconds < 0.05) {
+        return;
+    }
+    for (int i = 0; i < nstages - 1; i++) {
+        if (stages[i].pid == -1) {
+            continue;
+        }
+        double rate = stages[i].usage.ru_nvcsw / seconds;
+        PipeHint* hint = findPipeHint(stages[i].argv[0], 1);
+        long capacity = hint->capacity;
+
+        if (rate > 1000) {
+            capacity *= 2;
+            if (capacity > readPipeMax()) {
+                capacity = readPipeMax();
+            }
+        }
+        else if (rate < 100 && capacity > PIPE_SIZE_DEFAULT) {
+            capacity /= 2;
+        }
+        hint->capacity = capacity;
+    }
+}
+
+/**
+ * @brief Looks up the pipe hint slot for a producer command.
+ * @param producer The command name; only its last path component is used.
+ * @param create Whether to claim a slot (evicting whatever hashed there) if none matches.
+ * @return The hint, or NULL if none exists and create is 0.
+*/
+PipeHint* findPipeHint(const char* producer, int create) {
+    const char* base = strrchr(producer, '/');
+    base = base != NULL ? base + 1 : producer;
+
+    PipeHint* hint = &pipe_hints[hashName(base, strlen(base)) % PIPE_HINT_SLOTS];
+
+    if (strncmp(hint->name, base, sizeof(hint->name) - 1) == 0 && hint->capacity > 0) {
+        return hint;
+    }
+    if (!create) {
+        return NULL;
+    }
+    snprintf(hint->name, sizeof(hint->name), "%s", base);
+    hint->capacity = pipe_capacity > 0 ? pipe_capacity : PIPE_SIZE_DEFAULT;
+    return hint;
+}
+
+/**
+ * @brief Returns the largest pipe capacity an unprivileged process may request.
+*/
+long readPipeMax() {
+    if (pipe_capacity_max == 0) {
+        FILE* f = fopen("/proc/sys/fs/pipe-max-size", "re");
+        pipe_capacity_max = 1048576;
+        if (f != NULL) {
+            if (fscanf(f, "%ld", &pipe_capacity_max) != 1) {
+                pipe_capacity_max = 1048576;
+            }
+            fclose(f);
+        }
+    }
+    return pipe_capacity_max;
+}
+
+/**
+ * @brief Moves everything readable from one fd to another without copying through userspace.
+ * @param in_fd The source, read until EOF.
+ * @param out_fd The destination.
+ * @return The number of bytes moved, or -1 on error.
+ * @details Uses splice() when either side is a pipe and sendfile() from regular files. Any other
+ * pairing is routed through a scratch pipe with two splices, and read()/write() is only the
+ * last resort for fds that support none of these.
+*/
+ssize_t relayFd(int in_fd, int out_fd) {
+    struct stat in_st;
+    struct stat out_st;
+    ssize_t total = 0;
+    ssize_t n;
+
+    if (fstat(in_fd, &in_st) < 0 || fstat(out_fd, &out_st) < 0) {
+        return -1;
+    }
+
+    if (S_ISFIFO(in_st.st_mode) || S_ISFIFO(out_st.st_mode)) {
+        while ((n = splice(in_fd, NULL, out_fd, NULL, 1 << 20, SPLICE_F_MOVE | SPLICE_F_MORE)) > 0) {
+            total += n;
+        }
+        if (n == 0) {
+            return total;
+        }
+        if (errno != EINVAL) {
+            return -1;
+        }
+    }
+    else if (S_ISREG(in_st.st_mode)) {
+        while ((n = sendfile(out_fd, in_fd, NULL, 1 << 20)) > 0) {
+            total += n;
+        }
+        if (n == 0) {
+            return total;
+        }
+        if (errno != EINVAL) {
+            return -1;
+        }
+    }
+    else {
+        int scratch[2];
+        if (pipe2(scratch, O_CLOEXEC) == 0) {
+            while ((n = splice(in_fd, NULL, scratch[1], NULL, 1 << 16, SPLICE_F_MOVE)) > 0) {
+                ssize_t left = n;
+                while (left > 0) {
+                    ssize_t moved = splice(scratch[0], NULL, out_fd, NULL, left, SPLICE_F_MOVE | SPLICE_F_MORE);
+                    if (moved <= 0) {
+                        break;
+                    }
+                    left -= moved;
+                }
+                total += n - left;
+                if (left > 0) {
+                    n = -1;
+                    break;
+                }
+            }
+            close(scratch[0]);
+            close(scratch[1]);
+            if (n == 0) {
+                return total;
+            }
+            if (total > 0) {
+                return -1;
+            }
+        }
+    }
+
+    char buffer[65536];
+    while ((n = read(in_fd, buffer, sizeof(buffer))) > 0) {
+        for (ssize_t off = 0; off < n;) {
+            ssize_t written = write(out_fd, buffer + off, n - off);
+            if (written < 0) {
+                return -1;
+            }
+            off += written;
+        }
+        total += n;
+    }
+    return n < 0 ? -1 : total;
+}
+
+/**
+ * @brief Implements the pipesize builtin.
+ * @param args The command-line arguments.
+ * @return The exit status of the builtin.
+ * @details "pipesize" prints the current policy, "pipesize N[K|M]" fixes the capacity of every
+ * pipeline pipe, "pipesize auto" learns a capacity per producer from how often it blocks, and
+ * "pipesize default" returns to the kernel's 64 KiB.
+*/
+int pipesizeBuiltin(char** args) {
+    if (args[1] == NULL) {
+        if (pipe_capacity_auto) {
+            printf("auto (start %ld, max %ld)\n", pipe_capacity > 0 ? pipe_capacity : PIPE_SIZE_DEFAULT, readPipeMax());
+            for (int i = 0; i < PIPE_HINT_SLOTS; i++) {
+                if (pipe_hints[i].capacity > 0) {
+                    printf("%8ld\t%s\n", pipe_hints[i].capacity, pipe_hints[i].name);
+                }
+            }
+        }
+        else if (pipe_capacity > 0) {
+            printf("%ld\n", pipe_capacity);
+        }
+        else {
+            printf("default\n");
+        }
+        return 0;
+    }
+
+    if (strcmp(args[1], "auto") == 0) {
+        pipe_capacity_auto = 1;
+        return 0;
+    }
+    if (strcmp(args[1], "default") == 0) {
+        pipe_capacity = 0;
+        pipe_capacity_auto = 0;
+        memset(pipe_hints, 0, sizeof(pipe_hints));
+        return 0;
+    }
+
+    char* end;
+    long capacity = strtol(args[1], &end, 10);
+    if (*end == 'K' || *end == 'k') {
+        capacity <<= 10;
+        end++;
+    }
+    else if (*end == 'M' || *end == 'm') {
+        capacity <<= 20;
+        end++;
+    }
+    if (*end != '\0' || capacity <= 0) {
+        fprintf(stderr, "pipesize: invalid size: %s\n", args[1]);
+        return 1;
+    }
+    pipe_capacity = capacity;
+    pipe_capacity_auto = 0;
+    return 0;
+}
+
+/**
+ * @brief Converts a raw wait status into a shell exit code.
+ * @param status The status reported by waitpid().
+ * @return The exit code, or 128 plus the signal number for a signaled or stopped process.
+*/
+int waitStatusToCode(int status) {
+    if (WIFEXITED(status)) {
+        return WEXITSTATUS(status);
+    }
+    if (WIFSIGNALED(status)) {
+        return 128 + WTERMSIG(status);
+    }
+    if (WIFSTOPPED(status)) {
+        return 128 + WSTOPSIG(status);
+    }
+    return 1;
+}
+
+/**
+ * @brief Resets a redirection plan so every stream is inherited from the shell.
+ * @param plan The plan to initialize.
+*/
+void initRedirPlan(RedirPlan* plan) {
+    plan->actions = NULL;
+    plan->nactions = 0;
+    plan->cap = 0;
+    plan->stdin_fd = -1;
+    plan->stdout_fd = -1;
+}
+
+/**
+ * @brief Appends an action to a redirection plan.
+ * @param plan The plan; its action list grows in line_arena.
+ * @param type REDIR_OPEN, REDIR_DUP or REDIR_CLOSE.
+ * @param fd The fd being redirected.
+ * @param src_fd The fd to copy, for REDIR_DUP.
+ * @param flags The open() flags, for REDIR_OPEN.
+ * @param path The file to open, for REDIR_OPEN.
+*/
+void addRedirAction(RedirPlan* plan, int type, int fd, int src_fd, int flags, const char* path) {
+    if (plan->nactions == plan->cap) {
+        int cap = plan->cap ? plan->cap * 2 : 4;
+        RedirAction* grown = arenaAlloc(&line_arena, sizeof(RedirAction) * cap);
+        if (plan->nactions > 0) {
+            memcpy(grown, plan->actions, sizeof(RedirAction) * plan->nactions);
+        }
+        plan->actions = grown;
+        plan->cap = cap;
+    }
+
+    RedirAction* action = &plan->actions[plan->nactions++];
+    action->type = type;
+    action->fd = fd;
+    action->src_fd = src_fd;
+    action->flags = flags;
+    action->path = path;
+}
+
+/**
+ * @brief Adds a redirection to a plan.
+ * @param plan The plan of the command the redirection belongs to.
+ * @param fd The IO_NUMBER before the operator, or -1 if there was none.
+ * @param type The operator's token type.
+ * @param target The word after the operator, already expanded.
+ * @return 0, or -1 on an error, which has been reported.
+ * @details Understands [n]<, [n]>, [n]>|, [n]>>, [n]<>, [n]>&m, [n]<&m, [n]>&-, [n]<&-, &> and
+ * &>>, and here-strings ([n]<<<word), which take their text from the word. Here-documents
+ * ([n]<<word, [n]<<-word) are made by buildStage() with hereDocFd(), from the body the lexer
+ * found after the command.
+*/
+int parseRedirection(RedirPlan* plan, int fd, int type, const char* target) {
+    int input = type == TOKEN_LESS || type == TOKEN_LESSGREAT || type == TOKEN_DLESS || type == TOKEN_DLESSDASH || type == TOKEN_TLESS || type == TOKEN_LESSAND;
+    int both = type == TOKEN_ANDGREAT || type == TOKEN_ANDDGREAT;
+    int default_fd = fd < 0;
+    if (default_fd) {
+        fd = input ? STDIN_FILENO : STDOUT_FILENO;
+    }
+
+    if (type == TOKEN_TLESS) {
+        int body = hereStringFd(target);
+        if (body < 0) {
+            return -1;
+        }
+        addRedirAction(plan, REDIR_FD, fd, body, 0, NULL);
+        return 0;
+    }
+    if (type == TOKEN_GREATAND || type == TOKEN_LESSAND) {
+        if (strcmp(target, "-") == 0) {
+            addRedirAction(plan, REDIR_CLOSE, fd, -1, 0, NULL);
+            return 0;
+        }
+        char* end;
+        long src = strtol(target, &end, 10);
+        if (*target != '\0' && *end == '\0' && src >= 0 && src < 1 << 20) {
+            addRedirAction(plan, REDIR_DUP, fd, (int)src, 0, NULL);
+            return 0;
+        }
+        if (type == TOKEN_GREATAND && default_fd) {
+            //">&file" is the csh spelling of "&>file"
+            both = 1;
+            type = TOKEN_GREAT;
+        }
+        else {
+            fprintf(stderr, "Error: %s: ambiguous redirect\n", target);
+            return -1;
+        }
+    }
+
+    int flags;
+    if (type == TOKEN_LESSGREAT) {
+        flags = O_RDWR | O_CREAT;
+    }
+    else if (input) {
+        flags = O_RDONLY;
+    }
+    else if (type == TOKEN_DGREAT || type == TOKEN_ANDDGREAT) {
+        flags = O_WRONLY | O_CREAT | O_APPEND;
+    }
+    else {
+        flags = O_WRONLY | O_CREAT | O_TRUNC;
+    }
+
+    addRedirAction(plan, REDIR_OPEN, fd, -1, flags, target);
+    if (both) {
+        addRedirAction(plan, REDIR_DUP, STDERR_FILENO, STDOUT_FILENO, 0, NULL);
+    }
+    return 0;
+}
+
+/**
+ * @brief Puts a here-document body into a sealed memfd.
+ * @param text The text the command was cut from.
+ * @param body The first of the two TOKEN_HEREDOC tokens around the body, as scanHereDoc() left
+ * them; the body includes its trailing newline.
+ * @param strip_tabs Whether leading tabs are removed from each line, as <<- does.
+ * @return A read-only fd positioned at the start of the body, or -1 on error.
+ * @details The body was read with the rest of its command, so a here-document in a loop or a
+ * function is read from the input once and written out again each time the command runs. A body
+ * with nothing to expand is written straight from the text, a buffer at a time if tabs are
+ * stripped. One whose delimiter was unquoted is copied once, less its tabs, to be expanded as if
+ * in double quotes, and the result is written instead.
+*/
+int hereDocFd(const char* text, const Token* body, int strip_tabs) {
+    int fd = memfd_create("heredoc", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (fd < 0) {
+        perror("Error: memfd_create");
+        return -1;
+    }
+
+    const char* in = text + body[0].offset;
+    size_t len = body[1].offset - body[0].offset;
+    int line_start = 1;
+    int failed = 0;
+    if (body[0].flags & WORD_EXPAND) {
+        //The expander takes a NUL-terminated string, which the text around the body is not
+        char* copy = arenaAlloc(&line_arena, len + 1);
+        size_t used = len;
+        if (strip_tabs) {
+            used = stripTabs(copy, in, len, &line_start);
+        }
+        else {
+            memcpy(copy, in, len);
+        }
+        copy[used] = '\0';
+        char* expanded = expandString(copy, EXPAND_HEREDOC);
+        size_t expanded_len = strlen(expanded);
+        failed = expanded_len > 0 && write(fd, expanded, expanded_len) != (ssize_t)expanded_len;
+    }
+    else if (!strip_tabs) {
+        failed = len > 0 && write(fd, in, len) != (ssize_t)len;
+    }
+    else {
+        //Without its tabs each piece only gets shorter, so a fixed buffer is enough
+        char chunk[65536];
+        for (size_t k = 0; k < len && !failed; k += sizeof(chunk)) {
+            size_t n = len - k < sizeof(chunk) ? len - k : sizeof(chunk);
+            size_t used = stripTabs(chunk, in + k, n, &line_start);
+            failed = used > 0 && write(fd, chunk, used) != (ssize_t)used;
+        }
+    }
+
+    if (failed) {
+        perror("Error: here-document");
+        close(fd);
+        return -1;
+    }
+    return sealedMemfd("heredoc", fd);
+}
+
+/**
+ * @brief Copies part of a here-document body without the tabs at the start of its lines.
+ * @param out Where the copy goes; it needs room for len bytes.
+ * @param in The part of the body.
+ * @param len Its length.
+ * @param line_start Whether in starts a line; updated, so the next part carries on from this one.
+ * @return The length of the copy.
+*/
+size_t stripTabs(char* out, const char* in, size_t len, int* line_start) {
+    size_t used = 0;
+    for (size_t i = 0; i < len; i++) {
+        if (*line_start && in[i] == '\t') {
+            continue;
+        }
+        out[used++] = in[i];
+        *line_start = in[i] == '\n';
+    }
+    return used;
+}
+
+/**
+ * @brief Puts a here-string into a sealed memfd.
+ * @param word The string; a newline is added after it.
+ * @return A read-only fd positioned at the start of the string, or -1 on error.
+*/
+int hereStringFd(const char* word) {
+    int fd = memfd_create("herestring", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (fd < 0) {
+        perror("Error: memfd_create");
+        return -1;
+    }
+
+    size_t len = strlen(word);
+    struct iovec parts[2] = { { (void*)word, len }, { "\n", 1 } };
+    if (writev(fd, parts, 2) != (ssize_t)len + 1) {
+        perror("Error: here-string");
+        close(fd);
+        return -1;
+    }
+    return sealedMemfd("herestring", fd);
+}
+
+/**
+ * @brief Seals a fully written memfd and hands back a read-only descriptor for it.
+ * @param name The name used in error messages.
+ * @param fd The memfd; it is consumed.
+ * @return A close-on-exec read-only fd at offset 0, or -1 on error.
+ * @details The seals make the contents immutable, and reopening through /proc gives the
+ * reader its own offset and no write access.
+*/
+int sealedMemfd(const char* name, int fd) {
+    char path[32];
+
+    fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL);
+    snprintf(path, sizeof(path), "/proc/self/fd/%d", fd);
+    int reader = open(path, O_RDONLY | O_CLOEXEC);
+    if (reader < 0) {
+        //Without /proc, rewind and pass the writable fd; the seals still keep it unchanged
+        if (lseek(fd, 0, SEEK_SET) < 0) {
+            perror(name);
+            close(fd);
+            return -1;
+        }
+        return fd;
+    }
+    close(fd);
+    return reader;
+}
+
+/**
+ * @brief Closes the descriptors the shell opened on a plan's behalf.
+ * @param plan The plan; its REDIR_FD steps are turned into no-ops.
+*/
+void releaseRedirPlan(RedirPlan* plan) {
+    for (int i = 0; i < plan->nactions; i++) {
+        if (plan->actions[i].type == REDIR_FD && plan->actions[i].src_fd >= 0) {
+            close(plan->actions[i].src_fd);
+            plan->actions[i].src_fd = -1;
+        }
+    }
+}
 
-        command[strcspn(command, "\n")] = 0;
-
-        //Tokenize the input
-        char* token = strtok(command, " ");
-        int i = 0;
-        while (token != NULL && i < 10) {
-            args[i++] = token;
-            token = strtok(NULL, " ");
+/**
+ * @brief Checks that every fd a plan copies from belongs to the command and not to the shell.
+ * @param plan The plan.
+ * @return 1 if every source is visible, otherwise 0 after reporting the first that is not.
+ * @details The fds the shell opens for itself are close-on-exec, but posix_spawn applies its
+ * file actions before the exec, so "> &3" could otherwise reach a script file or a pipe the
+ * shell is holding. A source counts as the command's if it is inherited without FD_CLOEXEC or
+ * an earlier step of the plan put it there.
+*/
+int redirSourcesVisible(RedirPlan* plan) {
+    for (int i = 0; i < plan->nactions; i++) {
+        RedirAction* action = &plan->actions[i];
+        if (action->type != REDIR_DUP) {
+            continue;
         }
-        args[i] = NULL;
 
-        //Handle built-in commands
-        if (args[0] != NULL && strcmp(args[0], "exit") == 0) {
-            exit(1);
+        int src = action->src_fd;
+        int visible = (src == STDIN_FILENO && plan->stdin_fd >= 0) || (src == STDOUT_FILENO && plan->stdout_fd >= 0);
+        for (int j = 0; j < i && !visible; j++) {
+            visible = plan->actions[j].fd == src && plan->actions[j].type != REDIR_CLOSE;
         }
-        else if (args[0] != NULL && strcmp(args[0], "cd") == 0) {
-            if (args[1] != NULL) {
-                if (strcmp(args[1], "~") == 0) {
-                    char* home = getenv("HOME");
-                    if (chdir(home) == 0) {
-                        printf("Changed directory to home.\n", home);
-                    }
-                    else {
-                        perror("Error: Failed to change directory to home.\n");
-                        exit(1);
-                    }
-                }
-                else {
-                    if (chdir(args[1]) != 0) {
-                        perror("Error: Failed to change directory.\n");
-                    }
-                }
-            }
+        if (!visible) {
+            int flags = fcntl(src, F_GETFD);
+            visible = flags >= 0 && !(flags & FD_CLOEXEC);
         }
-        else if (args[0] != NULL) {
-            execCmd(args);
+        if (!visible) {
+            fprintf(stderr, "Error: %d: Bad file descriptor\n", src);
+            return 0;
         }
     }
-    return 0;
+    return 1;
 }
 
+/**
+ * @brief Explains why posix_spawn failed when the failure may have come from a redirection.
+ * @param plan The plan that was given to posix_spawn.
+ * @details The open actions and the exec share one error code, so the opens are retried in the
+ * shell, without truncating, until one fails. If they all succeed the exec was at fault.
+*/
+void reportRedirError(RedirPlan* plan) {
+    for (int i = 0; i < plan->nactions; i++) {
+        RedirAction* action = &plan->actions[i];
+        if (action->type != REDIR_OPEN) {
+            continue;
+        }
 
+        int fd = open(action->path, (action->flags & ~O_TRUNC) | O_CLOEXEC, 0666);
+        if (fd < 0) {
+            perror(action->path);
+            return;
+        }
+        close(fd);
+    }
+    printf("\nCould not execute command..\n");
+}
 
 /**
- * @brief Prints a welcome message with the current date and time.
- */
-void welcomeMessage() {
-    time_t t;
-    struct tm* tm_info;
-    char dateBuffer[20];
-    char timeBuffer[20];
-    time(&t);
-    tm_info = localtime(&t);
-    strftime(dateBuffer, sizeof(dateBuffer), "%m/%d/%Y", tm_info);
-    strftime(timeBuffer, sizeof(timeBuffer), "%H:%M:%S", tm_info);
-    printf("**************************************************\n");
-    printf("*             Welcome to SeaShell                *\n");
-    printf("*                  Created by                    *\n");
-    printf("*                Jacob Leonardo                  *\n");
-    printf("*                                                *\n");
-    printf("*                 Date: %s               *\n", dateBuffer);
-    printf("*                 Time: %s                 *\n", timeBuffer);
-    printf("**************************************************\n\n");
+ * @brief Launches an external command with the given redirection plan.
+ * @param argv The NULL-terminated argument vector; argv[0] is resolved through the PATH cache.
+ * @param assigns NAME=value words to add to the command's environment, or NULL.
+ * @param plan The redirections to apply in the new process.
+ * @param pgid The process group to join; 0 starts a new group led by the new process and -1
+ * stays in the shell's group.
+ * @return The pid of the new process, or -1 if it could not be started.
+ * @details Uses posix_spawn, which glibc implements with clone(CLONE_VM|CLONE_VFORK), so the
+ * shell's page tables are never copied. The plain fork() path is kept as a fallback and can be
+ * forced by setting SEASHELL_SPAWN=fork. Builtins and functions in a pipeline or the background
+ * always take it, since they need a copy of the shell to run in.
+*/
+pid_t spawnCmd(char** argv, char** assigns, RedirPlan* plan, pid_t pgid) {
+    if (spawn_mode == SPAWN_FORK || findBuiltin(argv[0]) != NULL || (functions != NULL && findFunction(argv[0]) != NULL)) {
+        return forkCmd(argv, assigns, plan, pgid);
+    }
+    return posixSpawnCmd(argv, assigns, plan, pgid);
 }
 
 /**
-     * @brief Executes a command with the given arguments.
-     * @details This function handles the execution of a command, including background processes, input and output redirection, and piping. It forks a new process to execute the command and waits for it to complete unless it is a background process.
-     * @param parsed The array of command-line arguments.
+ * @brief Launches a command through posix_spawn, expressing the plan as file actions.
+ * @param argv The NULL-terminated argument vector.
+ * @param assigns NAME=value words to add to the command's environment, or NULL.
+ * @param plan The redirections to apply in the new process.
+ * @param pgid The process group to join; 0 starts a new group and -1 keeps the shell's.
+ * @return The pid of the new process, or -1 on failure.
+ * @details The environment is the cached envp with the assignments laid over it, which
+ * posix_spawn has finished with by the time it returns. Falls back to forkCmd() if the spawn
+ * machinery itself is unavailable.
 */
-void execCmd(char** parsed) {
-    int background = 0;
-    int append = 0;
-    int output_redirection = 0;
-    int input_redirection = 0;
-    int input_file_pos = 0;
-    int output_file_pos = 0;
-    int pipe_fd[2];
-    int is_pipe = 0;
-    int piped_cmd_pos = 0;
+pid_t posixSpawnCmd(char** argv, char** assigns, RedirPlan* plan, pid_t pgid) {
+    posix_spawn_file_actions_t actions;
+    posix_spawnattr_t attr;
+    sigset_t defaults;
+    pid_t pid;
+    int err;
 
-    //Check for special characters
-    for (int i = 0; i < 10; i++) {
-        if (parsed[i] == NULL)
-            break;
-        if (strcmp(parsed[i], "&") == 0) {
-            parsed[i] = NULL;
-            background = 1;
-            continue;
+    if (posix_spawn_file_actions_init(&actions) != 0) {
+        return forkCmd(argv, assigns, plan, pgid);
+    }
+    if (posix_spawnattr_init(&attr) != 0) {
+        posix_spawn_file_actions_destroy(&actions);
+        return forkCmd(argv, assigns, plan, pgid);
+    }
+
+    //Join the pipeline's process group and undo the signals the shell ignores
+    sigemptyset(&defaults);
+    sigaddset(&defaults, SIGTTOU);
+    posix_spawnattr_setsigdefault(&attr, &defaults);
+    if (pgid >= 0) {
+        posix_spawnattr_setpgroup(&attr, pgid);
+    }
+    posix_spawnattr_setflags(&attr, (pgid >= 0 ? POSIX_SPAWN_SETPGROUP : 0) | POSIX_SPAWN_SETSIGDEF);
+
+    //Pipe ends first so that file redirections on the same stream take precedence
+    if (plan->stdout_fd >= 0) {
+        posix_spawn_file_actions_adddup2(&actions, plan->stdout_fd, STDOUT_FILENO);
+        posix_spawn_file_actions_addclose(&actions, plan->stdout_fd);
+    }
+    if (plan->stdin_fd >= 0) {
+        posix_spawn_file_actions_adddup2(&actions, plan->stdin_fd, STDIN_FILENO);
+        posix_spawn_file_actions_addclose(&actions, plan->stdin_fd);
+    }
+    for (int i = 0; i < plan->nactions; i++) {
+        RedirAction* action = &plan->actions[i];
+        if (action->type == REDIR_OPEN) {
+            posix_spawn_file_actions_addopen(&actions, action->fd, action->path, action->flags, 0666);
         }
-        else if (strcmp(parsed[i], ">") == 0) {
-            parsed[i] = NULL;
-            output_redirection = 1;
-            output_file_pos = i;
-            continue;
+        else if (action->type == REDIR_DUP || action->type == REDIR_FD) {
+            posix_spawn_file_actions_adddup2(&actions, action->src_fd, action->fd);
         }
-        else if (strcmp(parsed[i], ">>") == 0) {
-            parsed[i] = NULL;
-            append = 1;
-            output_file_pos = i;
-            continue;
+        else if (action->type == REDIR_KEEP) {
+            //Since glibc 2.29 a dup2 of an fd onto itself clears its FD_CLOEXEC
+            posix_spawn_file_actions_adddup2(&actions, action->fd, action->fd);
         }
-        else if (strcmp(parsed[i], "<") == 0) {
-            parsed[i] = NULL;
-            input_redirection = 1;
-            input_file_pos = i;
-            continue;
+        else {
+            posix_spawn_file_actions_addclose(&actions, action->fd);
         }
-        else if (strcmp(parsed[i], "|") == 0) {
-            parsed[i] = NULL;
-            is_pipe = 1;
-            piped_cmd_pos = i + 1;
-            pipe(pipe_fd);
-            continue;
+    }
+
+    const char* path = lookupCommand(argv[0]);
+    if (path == NULL || !redirSourcesVisible(plan)) {
+        posix_spawn_file_actions_destroy(&actions);
+        posix_spawnattr_destroy(&attr);
+        if (path == NULL) {
+            printf("\nCould not execute command..\n");
         }
+        return -1;
     }
 
-    //Handle piping
-    if (is_pipe == 1) {
-        pipeCommands(parsed, background, output_redirection, append, input_redirection, output_file_pos, input_file_pos, piped_cmd_pos);
+    EnvOverlay overlay;
+    char** envp = overlayEnv(assigns, &overlay);
+    err = posix_spawn(&pid, path, &actions, &attr, argv, envp);
+    if (err == ENOENT && strchr(argv[0], '/') == NULL) {
+        //The cached location may have gone away before the directory mtime check noticed
+        forgetCommand(argv[0]);
+        path = lookupCommand(argv[0]);
+        if (path != NULL) {
+            err = posix_spawn(&pid, path, &actions, &attr, argv, envp);
+        }
+    }
+    if (err == ENOEXEC) {
+        //An executable file without a #! line is a shell script, as execvp() has it
+        err = posix_spawn(&pid, "/bin/sh", &actions, &attr, scriptArgv(path, argv), envp);
+    }
+    restoreEnv(&overlay);
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&attr);
 
+    if (err == ENOSYS) {
+        return forkCmd(argv, assigns, plan, pgid);
     }
-    else {
+    if (err != 0) {
+        reportRedirError(plan);
+        return -1;
+    }
+    return pid;
+}
 
-        //Fork and execute the command
-        pid_t pid = fork();
+/**
+ * @brief Launches a command with fork() and execve(), applying the plan in the child.
+ * @param argv The NULL-terminated argument vector.
+ * @param assigns NAME=value words to export in the child, or NULL.
+ * @param plan The redirections to apply in the new process.
+ * @param pgid The process group to join; 0 starts a new group and -1 keeps the shell's.
+ * @return The pid of the new process, or -1 on failure.
+ * @details The group is set in both parent and child so it is in place whichever runs first.
+ * A function or builtin runs in the child instead of being executed.
+*/
+pid_t forkCmd(char** argv, char** assigns, RedirPlan* plan, pid_t pgid) {
+    Function* fn = functions != NULL ? findFunction(argv[0]) : NULL;
+    Builtin* builtin = fn == NULL ? findBuiltin(argv[0]) : NULL;
+    const char* path = fn != NULL || builtin != NULL ? argv[0] : lookupCommand(argv[0]);
+    if (path == NULL) {
+        printf("\nCould not execute command..\n");
+        return -1;
+    }
 
-        if (pid == -1) {
-            printf("\nFailed forking child..");
-            return;
+    pid_t pid = fork();
+
+    if (pid == -1) {
+        perror("Error: fork");
+        return -1;
+    }
+    else if (pid == 0) {
+        if (pgid >= 0) {
+            setpgid(0, pgid);
         }
-        else if (pid == 0) {
-            if (output_redirection == 1 || append == 1) {
-                outputRedirection(parsed, output_file_pos, append);
-            }
-            if (input_redirection == 1) {
-                inputRedirection(parsed, input_file_pos);
-            }
+        signal(SIGTTOU, SIG_DFL);
 
-            if (execvp(parsed[0], parsed) < 0) {
-                printf("\nCould not execute command..\n");
-            }
-            exit(0);
+        if (applyRedirPlan(plan) != 0) {
+            fflush(stdout);
+            _exit(1);
         }
-        else {
-            if (background == 1) {
-                waitpid(pid, NULL, WNOHANG);
-                return;
-            }
-            wait(NULL);
+        for (int i = 0; assigns != NULL && assigns[i] != NULL; i++) {
+            assignVariable(assigns[i], VAR_EXPORT);
         }
+
+        if (fn != NULL) {
+            job_control = 0;
+            job_list = NULL;
+            capture = NULL;
+            int status = callFunction(fn, argv);
+            fflush(stdout);
+            _exit(status);
+        }
+        if (builtin != NULL) {
+            int status = builtin->fn(argv);
+            fflush(stdout);
+            _exit(status);
+        }
+        char** envp = currentEnv();
+        execve(path, argv, envp);
+        if (errno == ENOEXEC) {
+            execve("/bin/sh", scriptArgv(path, argv), envp);
+        }
+        printf("\nCould not execute command..\n");
+        exit(127);
     }
+    if (pgid >= 0) {
+        setpgid(pid, pgid);
+    }
+    return pid;
 }
 
 
 /**
- * @brief Handles input redirection for a command.
- * @param cmd The array of command-line arguments.
- * @param input_file_pos The position of the input file in the command array.
- * @details This function opens the input file and redirects standard input to it.
+ * @brief Builds the argv that runs an executable file without a #! line through /bin/sh.
+ * @param path The file's resolved path.
+ * @param argv The command's argv.
+ * @return "/bin/sh path argv[1]...", in line_arena.
 */
-void inputRedirection(char** cmd, int input_file_pos) {
-    int fd = open(cmd[input_file_pos + 1], O_RDONLY);
-    if (fd < 0) {
-        perror("Error opening file");
-        exit(1);
+char** scriptArgv(const char* path, char** argv) {
+    size_t argc = 0;
+    while (argv[argc] != NULL) {
+        argc++;
     }
-    dup2(fd, STDIN_FILENO);
-    close(fd);
+    char** script = arenaAlloc(&line_arena, sizeof(char*) * (argc + 2));
+    script[0] = "/bin/sh";
+    script[1] = (char*)path;
+    memcpy(script + 2, argv + 1, sizeof(char*) * argc);
+    return script;
 }
 
 /**
- * @brief Handles output redirection for a command.
- * @param cmd The array of command-line arguments.
- * @param output_file_pos The position of the output file in the command array.
- * @param append A flag indicating whether to append to the output file or overwrite it.
- * @details This function opens the output file and redirects standard output to it. If the append flag is set, it appends to the file; otherwise, it overwrites the file.
+ * @brief Hashes a name with 32-bit FNV-1a, for the shell's hash tables.
+ * @param name The name; it does not need to be NUL-terminated.
+ * @param len Its length.
+ * @return The hash.
 */
-void outputRedirection(char** cmd, int output_file_pos, int append) {
-    int fd;
-    if (append) {
-        fd = open(cmd[output_file_pos + 1], O_WRONLY | O_CREAT | O_APPEND, 0777);
+unsigned int hashName(const char* name, size_t len) {
+    unsigned int hash = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        hash = (hash ^ (unsigned char)name[i]) * 16777619u;
     }
-    else {
-        fd = open(cmd[output_file_pos + 1], O_WRONLY | O_CREAT | O_TRUNC, 0777);
+    return hash;
+}
+
+/**
+ * @brief Resolves a command name to an executable path using the PATH cache.
+ * @param name The command name as typed.
+ * @return The path to execute, or NULL if the command is not found. Names containing a slash
+ * are returned unchanged. The returned string is owned by the cache.
+ * @details A miss is answered from the command index when an interactive shell has one, and
+ * otherwise walks PATH with one stat() per directory. The result is remembered, including a
+ * negative entry when nothing is found, so repeated lookups cost no syscalls at all.
+*/
+const char* lookupCommand(const char* name) {
+    if (strchr(name, '/') != NULL) {
+        return name;
     }
-    if (fd < 0) {
-        perror("Error opening file");
-        exit(1);
+
+    revalidatePathCache();
+
+    unsigned int bucket = hashName(name, strlen(name)) % PATH_CACHE_BUCKETS;
+
+    for (PathEntry* entry = path_cache.buckets[bucket]; entry != NULL; entry = entry->next) {
+        if (strcmp(entry->name, name) == 0) {
+            path_cache.hits++;
+            entry->hits++;
+            return entry->path;
+        }
     }
-    dup2(fd, STDOUT_FILENO);
-    close(fd);
+
+    path_cache.misses++;
+
+    PathEntry* entry = malloc(sizeof(PathEntry));
+    entry->name = strdup(name);
+    entry->path = NULL;
+    entry->hits = 1;
+    size_t name_len = strlen(name);
+
+    //Once the command index is up, a miss is a binary search instead of a stat() per directory
+    CommandIndex* index = command_index != NULL || index_building ? commandIndex(0) : NULL;
+    int indexed = index != NULL && !index->partial;
+    if (indexed) {
+        size_t at = findIndexEntry(index, name);
+        if (at < index->count && strcmp(index->strings + index->entries[at].offset, name) == 0) {
+            const char* dir = index->dirs[index->entries[at].dir];
+            size_t dir_len = strlen(dir);
+            entry->path = malloc(dir_len + name_len + 2);
+            memcpy(entry->path, dir, dir_len);
+            entry->path[dir_len] = '/';
+            memcpy(entry->path + dir_len + 1, name, name_len + 1);
+        }
+    }
+
+    for (int i = 0; i < path_cache.ndirs && !indexed; i++) {
+        size_t dir_len = strlen(path_cache.dirs[i]);
+        char* candidate = malloc(dir_len + name_len + 2);
+        struct stat st;
+
+        memcpy(candidate, path_cache.dirs[i], dir_len);
+        candidate[dir_len] = '/';
+        memcpy(candidate + dir_len + 1, name, name_len + 1);
+
+        if (stat(candidate, &st) == 0 && S_ISREG(st.st_mode) && (st.st_mode & 0111)) {
+            entry->path = candidate;
+            break;
+        }
+        free(candidate);
+    }
+
+    entry->next = path_cache.buckets[bucket];
+    path_cache.buckets[bucket] = entry;
+    return entry->path;
 }
 
 /**
- * @brief Handles piping between two commands.
- * @param parsed The array of command-line arguments.
- * @param background A flag indicating whether the command should run in the background.
- * @param output_redirection A flag indicating whether output redirection is enabled.
- * @param append A flag indicating whether to append to the output file.
- * @param input_redirection A flag indicating whether input redirection is enabled.
- * @param output_file_pos The position of the output file in the command array.
- * @param input_file_pos The position of the input file in the command array.
- * @param piped_cmd_pos The position of the piped command in the command array.
- * @details This function creates a pipe and forks two child processes to execute the two commands. The first child process writes to the pipe, and the second child process reads from the pipe.
- * @note This function assumes that the command array contains two commands separated by a pipe character.
- * @note This function does not handle errors that occur during pipe creation or process creation.
+ * @brief Drops stale cache entries when PATH or one of its directories has changed.
+ * @details A changed PATH value flushes everything. Directory mtimes are re-checked at most
+ * once per second so that a busy script does not pay a stat() per PATH entry per command.
 */
-void pipeCommands(char** parsed, int background, int output_redirection, int append, int input_redirection, int output_file_pos, int input_file_pos, int piped_cmd_pos) {
+void revalidatePathCache() {
+    const char* path_value = getVar("PATH");
+    if (path_value == NULL) {
+        path_value = "/usr/local/bin:/usr/bin:/bin";
+    }
 
-    int pipe_fd[2];
+    if (path_cache.path_value == NULL || strcmp(path_cache.path_value, path_value) != 0) {
+        clearPathCache();
+        loadPathDirs(path_value);
+        return;
+    }
 
-    if (pipe(pipe_fd) < 0) {
-        perror("Pipe creation failed");
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+    if (now.tv_sec == path_cache.last_check) {
         return;
     }
+    path_cache.last_check = now.tv_sec;
+
+    for (int i = 0; i < path_cache.ndirs; i++) {
+        struct stat st;
+        if (stat(path_cache.dirs[i], &st) != 0) {
+            st.st_mtim.tv_sec = 0;
+            st.st_mtim.tv_nsec = 0;
+        }
+        if (st.st_mtim.tv_sec != path_cache.mtimes[i].tv_sec || st.st_mtim.tv_nsec != path_cache.mtimes[i].tv_nsec) {
+            clearPathCache();
+            loadPathDirs(path_value);
+            return;
+        }
+    }
+}
 
-    pid_t pid1 = fork();
+/**
+ * @brief Splits a PATH value into directories and records their current mtimes.
+ * @param path_value The PATH string; empty components mean the current directory.
+*/
+void loadPathDirs(const char* path_value) {
+    free(path_cache.path_value);
+    path_cache.path_value = strdup(path_value);
 
-    if (pid1 < 0) {
-        perror("Fork failed");
-        return;
+    int count = 1;
+    for (const char* c = path_value; *c; c++) {
+        if (*c == ':') {
+            count++;
+        }
     }
 
-    if (pid1 == 0) {
-        //First child process
-        close(pipe_fd[0]);
-        dup2(pipe_fd[1], STDOUT_FILENO);
-        close(pipe_fd[1]);
+    path_cache.dirs = malloc(sizeof(char*) * count);
+    path_cache.mtimes = malloc(sizeof(struct timespec) * count);
+    path_cache.ndirs = 0;
+
+    const char* start = path_value;
+    while (1) {
+        const char* end = strchrnul(start, ':');
+        char* dir = (end == start) ? strdup(".") : strndup(start, end - start);
+        struct stat st;
 
-        if (input_redirection == 1) {
-            inputRedirection(parsed, input_file_pos);
+        path_cache.mtimes[path_cache.ndirs].tv_sec = 0;
+        path_cache.mtimes[path_cache.ndirs].tv_nsec = 0;
+        if (stat(dir, &st) == 0) {
+            path_cache.mtimes[path_cache.ndirs] = st.st_mtim;
         }
+        path_cache.dirs[path_cache.ndirs++] = dir;
 
-        if (execvp(parsed[0], parsed) < 0) {
-            perror("First command execution failed");
-            exit(1);
+        if (*end == '\0') {
+            break;
         }
-        exit(0);
+        start = end + 1;
     }
-    else {
 
-        pid_t pid2 = fork();
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+    path_cache.last_check = now.tv_sec;
+}
+
+/**
+ * @brief Removes every remembered command location and the PATH directory list.
+*/
+void clearPathCache() {
+    for (int i = 0; i < PATH_CACHE_BUCKETS; i++) {
+        PathEntry* entry = path_cache.buckets[i];
+        while (entry != NULL) {
+            PathEntry* next = entry->next;
+            free(entry->name);
+            free(entry->path);
+            free(entry);
+            entry = next;
+        }
+        path_cache.buckets[i] = NULL;
+    }
+    for (int i = 0; i < path_cache.ndirs; i++) {
+        free(path_cache.dirs[i]);
+    }
+    free(path_cache.dirs);
+    free(path_cache.mtimes);
+    free(path_cache.path_value);
+    path_cache.dirs = NULL;
+    path_cache.mtimes = NULL;
+    path_cache.path_value = NULL;
+    path_cache.ndirs = 0;
+}
 
-        if (pid2 < 0) {
-            perror("Second fork failed");
+/**
+ * @brief Removes a single command from the PATH cache.
+ * @param name The command name to forget.
+*/
+void forgetCommand(const char* name) {
+    PathEntry** link = &path_cache.buckets[hashName(name, strlen(name)) % PATH_CACHE_BUCKETS];
+    while (*link != NULL) {
+        PathEntry* entry = *link;
+        if (strcmp(entry->name, name) == 0) {
+            *link = entry->next;
+            free(entry->name);
+            free(entry->path);
+            free(entry);
             return;
         }
+        link = &entry->next;
+    }
+}
+
+/**
+ * @brief Implements the hash builtin.
+ * @param args The command-line arguments.
+ * @return The exit status of the builtin.
+ * @details With no arguments, lists remembered commands with their hit counts followed by the
+ * cache hit/miss counters. "hash -r" empties the cache, "hash -d name" forgets one entry, and
+ * "hash name..." looks the names up and remembers them.
+*/
+int hashBuiltin(char** args) {
+    int result = 0;
+
+    if (args[1] == NULL) {
+        printf("hits\tcommand\n");
+        for (int i = 0; i < PATH_CACHE_BUCKETS; i++) {
+            for (PathEntry* entry = path_cache.buckets[i]; entry != NULL; entry = entry->next) {
+                if (entry->path != NULL) {
+                    printf("%4lu\t%s\n", entry->hits, entry->path);
+                }
+                else {
+                    printf("%4lu\t%s (not found)\n", entry->hits, entry->name);
+                }
+            }
+        }
+        printf("cache hits: %lu, misses: %lu\n", path_cache.hits, path_cache.misses);
+    }
+    else if (strcmp(args[1], "-r") == 0) {
+        clearPathCache();
+        path_cache.hits = 0;
+        path_cache.misses = 0;
+    }
+    else if (strcmp(args[1], "-d") == 0) {
+        for (int i = 2; args[i] != NULL; i++) {
+            forgetCommand(args[i]);
+        }
+    }
+    else {
+        for (int i = 1; args[i] != NULL; i++) {
+            forgetCommand(args[i]);
+            if (lookupCommand(args[i]) == NULL) {
+                fprintf(stderr, "hash: %s: not found\n", args[i]);
+                result = 1;
+            }
+        }
+    }
+    return result;
+}
+
+/**
+ * @brief Starts building the command index for a PATH value on a background thread.
+ * @param path_value The PATH string.
+ * @details The PATH directories are watched with inotify before they are read, so nothing that
+ * changes during the scan is missed; the queued events are applied once the index is ready.
+ * Relative directories are left out, since their contents depend on the working directory, and
+ * mark the index as partial.
+*/
+void startCommandIndex(const char* path_value) {
+    CommandIndex* index = calloc(1, sizeof(CommandIndex));
+    index->path_value = strdup(path_value);
 
-        if (pid2 == 0) {
-            //Second child process
-            close(pipe_fd[1]);
-            dup2(pipe_fd[0], STDIN_FILENO);
-            close(pipe_fd[0]);
+    int count = 1;
+    for (const char* c = path_value; *c; c++) {
+        count += *c == ':';
+    }
+    index->dirs = malloc(sizeof(char*) * count);
+    index->watches = malloc(sizeof(int) * count);
 
-            if (output_redirection == 1 || append == 1) {
-                outputRedirection(parsed, output_file_pos, append);
+    if (index_inotify < 0) {
+        index_inotify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    }
+    const char* start = path_value;
+    while (1) {
+        const char* end = strchrnul(start, ':');
+        index->watches[index->ndirs] = -1;
+        if (end == start || *start != '/') {
+            index->partial = 1;
+            index->dirs[index->ndirs++] = NULL;
+        }
+        else {
+            index->dirs[index->ndirs] = strndup(start, end - start);
+            if (index_inotify >= 0) {
+                index->watches[index->ndirs] = inotify_add_watch(index_inotify, index->dirs[index->ndirs], IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ATTRIB | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR);
             }
+            index->ndirs++;
+        }
+        if (*end == '\0') {
+            break;
+        }
+        start = end + 1;
+    }
+
+    //Signals are left to the main thread, so SIGWINCH still interrupts the line editor
+    sigset_t all;
+    sigset_t old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    if (pthread_create(&index_thread, NULL, buildCommandIndex, index) == 0) {
+        index_building = 1;
+    }
+    else {
+        buildCommandIndex(index);
+        command_index = index;
+        __atomic_store_n(&index_built, NULL, __ATOMIC_RELAXED);
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+/**
+ * @brief Fills a command index with every executable in its directories.
+ * @param arg The CommandIndex, with its directories set.
+ * @return NULL; the index is handed to the main thread through index_built.
+ * @details Entries are sorted by name and, for names found in several directories, only the
+ * first directory in PATH order is kept, which is the one execvp() would run. The thread runs
+ * under SCHED_IDLE, so on a busy or single-CPU machine it waits for the shell to go idle at
+ * the prompt.
+*/
+void* buildCommandIndex(void* arg) {
+    CommandIndex* index = arg;
 
-            if (execvp(parsed[piped_cmd_pos], &parsed[piped_cmd_pos]) < 0) {
-                perror("Second command execution failed");
-                exit(1);
+    //Only use CPU time the shell leaves idle, so the scan never delays the first prompt
+    struct sched_param param = { 0 };
+    sched_setscheduler(0, SCHED_IDLE, &param);
+    sched_yield();
+
+    for (int d = 0; d < index->ndirs; d++) {
+        DIR* dir = index->dirs[d] != NULL ? opendir(index->dirs[d]) : NULL;
+        if (dir == NULL) {
+            //A directory that exists but cannot be listed may still hold commands
+            index->partial |= index->dirs[d] != NULL && errno != ENOENT && errno != ENOTDIR;
+            continue;
+        }
+        struct dirent* ent;
+        while ((ent = readdir(dir)) != NULL) {
+            struct stat st;
+            if (ent->d_name[0] == '.' || ent->d_type == DT_DIR) {
+                continue;
+            }
+            if (fstatat(dirfd(dir), ent->d_name, &st, 0) != 0 || !S_ISREG(st.st_mode) || !(st.st_mode & 0111)) {
+                continue;
             }
-            exit(0);
+            addIndexEntry(index, index->count, ent->d_name, d);
+        }
+        closedir(dir);
+    }
+
+    qsort_r(index->entries, index->count, sizeof(IndexEntry), compareIndexEntries, index->strings);
+    size_t kept = 0;
+    for (size_t i = 0; i < index->count; i++) {
+        if (kept > 0 && strcmp(index->strings + index->entries[kept - 1].offset, index->strings + index->entries[i].offset) == 0) {
+            continue;
+        }
+        index->entries[kept++] = index->entries[i];
+    }
+    index->count = kept;
+
+    __atomic_store_n(&index_built, index, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+/**
+ * @brief qsort_r comparator ordering index entries by name, then by PATH position.
+*/
+int compareIndexEntries(const void* a, const void* b, void* strings) {
+    const IndexEntry* x = a;
+    const IndexEntry* y = b;
+    int order = strcmp((char*)strings + x->offset, (char*)strings + y->offset);
+    return order != 0 ? order : x->dir - y->dir;
+}
+
+/**
+ * @brief Inserts a name into a command index at a given position.
+ * @param index The index.
+ * @param at The position; the caller keeps the entries sorted.
+ * @param name The command name.
+ * @param dir The PATH directory it was found in.
+*/
+void addIndexEntry(CommandIndex* index, size_t at, const char* name, int dir) {
+    size_t name_len = strlen(name) + 1;
+    if (index->strings_len + name_len > index->strings_cap) {
+        index->strings_cap = (index->strings_len + name_len) * 2;
+        index->strings = realloc(index->strings, index->strings_cap);
+    }
+    if (index->count == index->cap) {
+        index->cap = index->cap ? index->cap * 2 : 1024;
+        index->entries = realloc(index->entries, sizeof(IndexEntry) * index->cap);
+    }
+
+    memmove(index->entries + at + 1, index->entries + at, sizeof(IndexEntry) * (index->count - at));
+    index->entries[at].offset = index->strings_len;
+    index->entries[at].dir = dir;
+    index->count++;
+    memcpy(index->strings + index->strings_len, name, name_len);
+    index->strings_len += name_len;
+}
+
+/**
+ * @brief Finds where a name is, or would be, in a command index.
+ * @param index The index.
+ * @param name The name, or a prefix of the names wanted.
+ * @return The position of the first entry not less than name.
+*/
+size_t findIndexEntry(CommandIndex* index, const char* name) {
+    size_t low = 0;
+    size_t high = index->count;
+    while (low < high) {
+        size_t mid = (low + high) / 2;
+        if (strcmp(index->strings + index->entries[mid].offset, name) < 0) {
+            low = mid + 1;
         }
         else {
-            //Parent process: wait for both child processes to complete
-            close(pipe_fd[0]);
-            close(pipe_fd[1]);
+            high = mid;
+        }
+    }
+    return low;
+}
 
-            if (background == 1) {
-                return;
+/**
+ * @brief Returns the command index, once it is ready and up to date.
+ * @param wait Whether to wait for a build that is still running.
+ * @return The index for the current PATH, or NULL if it is not available yet.
+ * @details Takes over a finished build from its thread, starts a new build when PATH has
+ * changed, and applies the inotify events queued since the last call.
+*/
+CommandIndex* commandIndex(int wait) {
+    const char* path_value = getVar("PATH");
+    if (path_value == NULL) {
+        path_value = "/usr/local/bin:/usr/bin:/bin";
+    }
+
+    if (index_building) {
+        if (!wait && __atomic_load_n(&index_built, __ATOMIC_ACQUIRE) == NULL) {
+            return NULL;
+        }
+        pthread_join(index_thread, NULL);
+        index_building = 0;
+        command_index = index_built;
+        index_built = NULL;
+    }
+    if (command_index == NULL || strcmp(command_index->path_value, path_value) != 0) {
+        freeCommandIndex(command_index);
+        command_index = NULL;
+        startCommandIndex(path_value);
+        return wait ? commandIndex(1) : NULL;
+    }
+
+    char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t n;
+    while (index_inotify >= 0 && (n = read(index_inotify, events, sizeof(events))) > 0) {
+        for (char* p = events; p < events + n; p += sizeof(struct inotify_event) + ((struct inotify_event*)p)->len) {
+            struct inotify_event* event = (struct inotify_event*)p;
+            if (event->mask & (IN_Q_OVERFLOW | IN_DELETE_SELF | IN_MOVE_SELF)) {
+                //Too much changed to follow, so scan everything again
+                freeCommandIndex(command_index);
+                command_index = NULL;
+                startCommandIndex(path_value);
+                return wait ? commandIndex(1) : NULL;
             }
+            if (event->len > 0) {
+                refreshIndexEntry(command_index, event->name);
+            }
+        }
+    }
+    return command_index;
+}
+
+/**
+ * @brief Re-checks one name in every PATH directory after inotify reported a change to it.
+ * @param index The index.
+ * @param name The name that was created, deleted, renamed or had its mode changed.
+*/
+void refreshIndexEntry(CommandIndex* index, const char* name) {
+    int found = -1;
+    size_t name_len = strlen(name);
+    for (int d = 0; d < index->ndirs && found < 0; d++) {
+        if (index->dirs[d] == NULL) {
+            continue;
+        }
+        size_t dir_len = strlen(index->dirs[d]);
+        char* candidate = malloc(dir_len + name_len + 2);
+        struct stat st;
+        memcpy(candidate, index->dirs[d], dir_len);
+        candidate[dir_len] = '/';
+        memcpy(candidate + dir_len + 1, name, name_len + 1);
+        if (stat(candidate, &st) == 0 && S_ISREG(st.st_mode) && (st.st_mode & 0111)) {
+            found = d;
+        }
+        free(candidate);
+    }
+
+    size_t at = findIndexEntry(index, name);
+    int present = at < index->count && strcmp(index->strings + index->entries[at].offset, name) == 0;
+    if (present && found < 0) {
+        memmove(index->entries + at, index->entries + at + 1, sizeof(IndexEntry) * (index->count - at - 1));
+        index->count--;
+    }
+    else if (present) {
+        index->entries[at].dir = found;
+    }
+    else if (found >= 0) {
+        addIndexEntry(index, at, name, found);
+    }
+}
 
-            waitpid(pid1, NULL, 0);
-            waitpid(pid2, NULL, 0);
+/**
+ * @brief Frees a command index and drops its inotify watches.
+ * @param index The index, or NULL.
+*/
+void freeCommandIndex(CommandIndex* index) {
+    if (index == NULL) {
+        return;
+    }
+    for (int d = 0; d < index->ndirs; d++) {
+        if (index->watches[d] >= 0) {
+            inotify_rm_watch(index_inotify, index->watches[d]);
         }
+        free(index->dirs[d]);
     }
+    free(index->dirs);
+    free(index->watches);
+    free(index->entries);
+    free(index->strings);
+    free(index->path_value);
+    free(index);
 }
 
+/**
+ * @brief Applies one redirection step to the current process.
+ * @param action The step.
+ * @return 0 on success, or -1 after reporting the error.
+ * @details Files are opened close-on-exec and then moved onto their fd, which clears the flag
+ * on the copy the command will use, so no stray descriptor survives into the exec.
+*/
+int applyRedirAction(const RedirAction* action) {
+    if (action->type == REDIR_CLOSE) {
+        close(action->fd);
+        return 0;
+    }
+    if (action->type == REDIR_KEEP) {
+        return fcntl(action->fd, F_SETFD, 0) < 0 ? -1 : 0;
+    }
+
+    if (action->type == REDIR_DUP || action->type == REDIR_FD) {
+        int flags = fcntl(action->src_fd, F_GETFD);
+        if (flags < 0 || (action->type == REDIR_DUP && (flags & FD_CLOEXEC))) {
+            fprintf(stderr, "Error: %d: Bad file descriptor\n", action->src_fd);
+            return -1;
+        }
+        if (dup2(action->src_fd, action->fd) < 0) {
+            perror("Error: dup2");
+            return -1;
+        }
+        return 0;
+    }
+
+    int fd = open(action->path, action->flags | O_CLOEXEC, 0666);
+    if (fd < 0) {
+        perror(action->path);
+        return -1;
+    }
+    if (fd == action->fd) {
+        fcntl(fd, F_SETFD, 0);
+        return 0;
+    }
+    int result = dup2(fd, action->fd);
+    close(fd);
+    if (result < 0) {
+        perror("Error: dup2");
+        return -1;
+    }
+    return 0;
+}
 
+/**
+ * @brief Wires up the current process according to a plan, pipe ends first.
+ * @param plan The plan.
+ * @return 0 on success, or -1 if a step failed.
+*/
+int applyRedirPlan(RedirPlan* plan) {
+    if (plan->stdout_fd >= 0) {
+        dup2(plan->stdout_fd, STDOUT_FILENO);
+        close(plan->stdout_fd);
+    }
+    if (plan->stdin_fd >= 0) {
+        dup2(plan->stdin_fd, STDIN_FILENO);
+        close(plan->stdin_fd);
+    }
+    for (int i = 0; i < plan->nactions; i++) {
+        if (applyRedirAction(&plan->actions[i]) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
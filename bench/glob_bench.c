@@ -0,0 +1,95 @@
+/**
+ * @file glob_bench.c
+ * @brief Benchmark for glob expansion on a large generated directory.
+ * @details Builds against the shell source directly. Creates a directory with the given number
+ * of empty files, then times expandGlob() for a pattern matching every entry, one matching a
+ * tenth of them, the same pattern again on the same line (answered from the directory cache),
+ * and a ** pattern over a small tree below it. The directory is removed afterwards.
+ *
+ * Build: gcc -O2 bench/glob_bench.c -o glob_bench
+ * Run:   ./glob_bench [entries]
+*/
+
+#define main seashell_main
+#include "../Seashell.c"
+#undef main
+
+/**
+ * @brief Returns a monotonic timestamp in seconds.
+*/
+static double nowSeconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * @brief Times one expansion.
+ * @return Milliseconds.
+*/
+static double timeGlob(const char* pattern, size_t* count) {
+    char** matches;
+    double start = nowSeconds();
+    *count = expandGlob(pattern, &matches);
+    return (nowSeconds() - start) * 1000;
+}
+
+int main(int argc, char* argv[]) {
+    long entries = argc > 1 ? atol(argv[1]) : 1000000;
+    char dir[] = "/tmp/seashell_glob_bench_XXXXXX";
+    if (mkdtemp(dir) == NULL) {
+        perror("mkdtemp");
+        return 1;
+    }
+
+    double start = nowSeconds();
+    char path[PATH_MAX];
+    for (long i = 0; i < entries; i++) {
+        snprintf(path, sizeof(path), "%s/file%07ld.log", dir, i);
+        close(open(path, O_WRONLY | O_CREAT | O_CLOEXEC, 0644));
+    }
+    for (int i = 0; i < 100; i++) {
+        snprintf(path, sizeof(path), "%s/tree/d%d/e%d", dir, i / 10, i % 10);
+        char* slash = path;
+        while ((slash = strchr(slash + 1, '/')) != NULL) {
+            *slash = '\0';
+            mkdir(path, 0755);
+            *slash = '/';
+        }
+        mkdir(path, 0755);
+        strcat(path, "/leaf.c");
+        close(open(path, O_WRONLY | O_CREAT | O_CLOEXEC, 0644));
+    }
+    printf("%ld entries created in %.2f s\n", entries, nowSeconds() - start);
+
+    size_t count;
+    double ms;
+    char pattern[PATH_MAX];
+    snprintf(pattern, sizeof(pattern), "%s/*", dir);
+    double all = timeGlob(pattern, &count);
+    printf("%-22s %9.1f ms  %8zu matches (first read)\n", "*", all, count);
+    snprintf(pattern, sizeof(pattern), "%s/file*3.log", dir);
+    ms = timeGlob(pattern, &count);
+    printf("%-22s %9.1f ms  %8zu matches (cached)\n", "file*3.log", ms, count);
+    snprintf(pattern, sizeof(pattern), "%s/file00[0-4]?[13579]*", dir);
+    ms = timeGlob(pattern, &count);
+    printf("%-22s %9.1f ms  %8zu matches (cached)\n", "file00[0-4]?[13579]*", ms, count);
+    clearGlobCache();
+    snprintf(pattern, sizeof(pattern), "%s/file*3.log", dir);
+    ms = timeGlob(pattern, &count);
+    printf("%-22s %9.1f ms  %8zu matches (new line, read again)\n", "file*3.log", ms, count);
+    snprintf(pattern, sizeof(pattern), "%s/tree/**/*.c", dir);
+    ms = timeGlob(pattern, &count);
+    printf("%-22s %9.1f ms  %8zu matches\n", "tree/**/*.c", ms, count);
+    clearGlobCache();
+    arenaReset(&line_arena);
+
+    //Leave nothing behind
+    start = nowSeconds();
+    snprintf(path, sizeof(path), "rm -rf %s", dir);
+    if (system(path) != 0) {
+        fprintf(stderr, "could not remove %s\n", dir);
+    }
+    printf("removed in %.2f s\n", nowSeconds() - start);
+    return all < 1000 ? 0 : 1;
+}
@@ -0,0 +1,78 @@
+/**
+ * @file history_bench.c
+ * @brief Benchmark for history search and compaction on a large generated history file.
+ * @details Builds against the shell source directly. Writes a history of the given number of
+ * entries through historyAdd(), then times Ctrl-R style searches through historySearch(): a
+ * match among the newest entries, one near the oldest, and a miss that scans the whole file.
+ * Finally times a compaction that removes the duplicates.
+ *
+ * Build: gcc -O2 bench/history_bench.c -o history_bench
+ * Run:   ./history_bench [entries] [searches]
+*/
+
+#define main seashell_main
+#include "../Seashell.c"
+#undef main
+
+/**
+ * @brief Returns a monotonic timestamp in seconds.
+*/
+static double nowSeconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * @brief Times repeated searches for one query from the end of the history.
+ * @return Milliseconds per search.
+*/
+static double timeSearch(const char* query, int searches, long* found) {
+    double start = nowSeconds();
+    for (int i = 0; i < searches; i++) {
+        *found = historySearch(query, history_size);
+    }
+    return (nowSeconds() - start) * 1000 / searches;
+}
+
+int main(int argc, char* argv[]) {
+    long entries = argc > 1 ? atol(argv[1]) : 1000000;
+    int searches = argc > 2 ? atoi(argv[2]) : 20;
+    char path[] = "/tmp/seashell_history_bench_XXXXXX";
+    int fd = mkstemp(path);
+    close(fd);
+    setenv("HISTFILE", path, 1);
+
+    //The second half of the entries repeats the first
+    double start = nowSeconds();
+    static const char* words[] = { "git status", "make -j8", "ls -la", "cd src", "grep -rn", "vim", "ssh build" };
+    char line[128];
+    for (long i = 0; i < entries; i++) {
+        long command = i % (entries / 2 + 1);
+        int n = snprintf(line, sizeof(line), "%s %ld", words[command % 7], command);
+        historyAdd(line, n);
+    }
+    double write_time = nowSeconds() - start;
+    mapHistory();
+    printf("%ld entries (%.1f MiB) appended in %.2f s (%.2f us/entry)\n",
+        entries, history_size / 1048576.0, write_time, write_time * 1e6 / entries);
+
+    long found;
+    snprintf(line, sizeof(line), "%ld", entries / 2 - 10);
+    printf("recent match  %8.3f ms/search\n", timeSearch(line, searches, &found));
+    printf("oldest match  %8.3f ms/search\n", timeSearch("git status 0", searches, &found));
+    double miss = timeSearch("no such command", searches, &found);
+    printf("miss          %8.3f ms/search  %8.1f MB/s\n", miss, history_size / miss / 1e3);
+
+    size_t before = history_size;
+    start = nowSeconds();
+    if (compactHistory(HISTORY_FILE_MAX, 1) != 0) {
+        perror("compact");
+    }
+    double compact_time = nowSeconds() - start;
+    mapHistory();
+    printf("compaction    %8.1f ms  %.1f MiB -> %.1f MiB\n", compact_time * 1000, before / 1048576.0, history_size / 1048576.0);
+
+    unlink(path);
+    return 0;
+}
@@ -0,0 +1,137 @@
+/**
+ * @file lex_bench.c
+ * @brief Benchmark for the arena tokenizer on very long generated command lines.
+ * @details Builds against the shell source directly and times tokenizeLine() plus building
+ * the argv on lines with a configurable number of tokens, resetting the arena after every line
+ * exactly as the prompt loop does. Plain words go into the argv in place, as in execCmd(); a
+ * second line with every fourth word quoted also times the unquoting done by expandWord().
+ *
+ * Build: gcc -O2 bench/lex_bench.c -o lex_bench
+ * Run:   ./lex_bench [tokens per line] [lines]
+*/
+
+#define main seashell_main
+#include "../Seashell.c"
+#undef main
+
+/**
+ * @brief Returns a monotonic timestamp in seconds.
+*/
+static double nowSeconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char* argv[]) {
+    size_t ntokens = argc > 1 ? strtoul(argv[1], NULL, 10) : 1000000;
+    int lines = argc > 2 ? atoi(argv[2]) : 20;
+
+    //Words of varying length separated by runs of spaces and tabs
+    size_t cap = ntokens * 16 + 1;
+    char* line = malloc(cap);
+    size_t len = 0;
+    unsigned int seed = 1;
+    for (size_t i = 0; i < ntokens; i++) {
+        seed = seed * 1103515245u + 12345u;
+        int word = 1 + (seed >> 16) % 12;
+        for (int c = 0; c < word; c++) {
+            line[len++] = 'a' + (c + i) % 26;
+        }
+        line[len++] = (seed & 1) ? ' ' : '\t';
+        if (seed & 2) {
+            line[len++] = ' ';
+        }
+    }
+    line[len] = '\0';
+
+    Arena arena = { NULL };
+    size_t seen = 0;
+    double start = nowSeconds();
+    for (int i = 0; i < lines; i++) {
+        char* text = arenaAlloc(&arena, len + 1);
+        memcpy(text, line, len + 1);
+        Token* tokens;
+        size_t count = tokenizeLine(&arena, text, len, &tokens);
+        char** args = arenaAlloc(&arena, sizeof(char*) * (count + 1));
+        for (size_t t = 0; t < count; t++) {
+            args[t] = text + tokens[t].offset;
+            args[t][tokens[t].length] = '\0';
+        }
+        args[count] = NULL;
+        seen += count + (args[0] != NULL);
+        arenaReset(&arena);
+    }
+    double elapsed = nowSeconds() - start;
+
+    printf("%d lines of %zu tokens (%.1f MiB each)\n", lines, ntokens, len / 1048576.0);
+    printf("arena   %8.1f ms/line  %8.1f Mtokens/s  %8.1f MB/s\n",
+        elapsed * 1000 / lines, seen / elapsed / 1e6, (double)len * lines / elapsed / 1e6);
+
+    //The same words with every fourth one in quotes, which are taken off through line_arena
+    char* quoted = malloc(cap + ntokens);
+    size_t quoted_len = 0;
+    size_t word = 0;
+    for (size_t i = 0; i < len; word++) {
+        size_t run = strcspn(line + i, " \t");
+        if (word % 4 == 0) {
+            quoted[quoted_len++] = '\'';
+        }
+        memcpy(quoted + quoted_len, line + i, run);
+        quoted_len += run;
+        if (word % 4 == 0) {
+            quoted[quoted_len++] = '\'';
+        }
+        i += run;
+        size_t blanks = strspn(line + i, " \t");
+        memcpy(quoted + quoted_len, line + i, blanks);
+        quoted_len += blanks;
+        i += blanks;
+    }
+    quoted[quoted_len] = '\0';
+    seen = 0;
+    start = nowSeconds();
+    for (int i = 0; i < lines; i++) {
+        char* text = arenaAlloc(&line_arena, quoted_len + 1);
+        memcpy(text, quoted, quoted_len + 1);
+        Token* tokens;
+        size_t count = tokenizeLine(&line_arena, text, quoted_len, &tokens);
+        size_t nargs = 0;
+        size_t args_cap = count + 1;
+        char** args = arenaAlloc(&line_arena, sizeof(char*) * args_cap);
+        for (size_t t = 0; t < count; t++) {
+            char* w = text + tokens[t].offset;
+            w[tokens[t].length] = '\0';
+            args = tokens[t].flags == 0 ? appendWord(args, &nargs, &args_cap, w) : expandWord(args, &nargs, &args_cap, w, EXPAND_FIELDS);
+        }
+        seen += nargs;
+        arenaReset(&line_arena);
+    }
+    elapsed = nowSeconds() - start;
+    printf("quoted  %8.1f ms/line  %8.1f Mtokens/s  %8.1f MB/s\n",
+        elapsed * 1000 / lines, seen / elapsed / 1e6, (double)quoted_len * lines / elapsed / 1e6);
+    free(quoted);
+
+    //The old strtok loop on the same input, for reference, with an argv big enough to hold it all
+    char* copy = malloc(len + 1);
+    char** old_args = malloc(sizeof(char*) * (ntokens + 1));
+    seen = 0;
+    start = nowSeconds();
+    for (int i = 0; i < lines; i++) {
+        size_t count = 0;
+        memcpy(copy, line, len + 1);
+        for (char* token = strtok(copy, " \t"); token != NULL; token = strtok(NULL, " \t")) {
+            old_args[count++] = token;
+        }
+        old_args[count] = NULL;
+        seen += count + (old_args[0] != NULL);
+    }
+    elapsed = nowSeconds() - start;
+    printf("strtok  %8.1f ms/line  %8.1f Mtokens/s  %8.1f MB/s\n",
+        elapsed * 1000 / lines, seen / elapsed / 1e6, (double)len * lines / elapsed / 1e6);
+
+    free(old_args);
+    free(copy);
+    free(line);
+    return 0;
+}
@@ -0,0 +1,143 @@
+/**
+ * @file loop_bench.c
+ * @brief Interpreter-loop benchmark: a million iterations of a builtin, against dash.
+ * @details Runs "shell -c" on six nested for loops of ten words each around ":", so the body
+ * runs 1,000,000 times with nothing but the loop machinery and a builtin call to pay for; the
+ * shell has no arithmetic expansion for a counting while loop. The median over the runs is
+ * printed in milliseconds and nanoseconds per iteration, for seashell and, when it is
+ * installed, dash.
+ *
+ * Build: gcc -O2 bench/loop_bench.c -o loop_bench
+ * Run:   ./loop_bench [path to seashell] [runs]
+*/
+
+#define _GNU_SOURCE
+#include <spawn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define ITERATIONS 1000000
+
+extern char** environ;
+
+static const char loop_script[] =
+    "for a in 0 1 2 3 4 5 6 7 8 9; do "
+    "for b in 0 1 2 3 4 5 6 7 8 9; do "
+    "for c in 0 1 2 3 4 5 6 7 8 9; do "
+    "for d in 0 1 2 3 4 5 6 7 8 9; do "
+    "for e in 0 1 2 3 4 5 6 7 8 9; do "
+    "for f in 0 1 2 3 4 5 6 7 8 9; do :; "
+    "done; done; done; done; done; done";
+
+/**
+ * @brief Returns a monotonic timestamp in nanoseconds.
+*/
+static long long nowNs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/**
+ * @brief qsort comparator for timings.
+*/
+static int compareTimes(const void* a, const void* b) {
+    long long x = *(const long long*)a;
+    long long y = *(const long long*)b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * @brief Finds an executable in PATH.
+ * @param name The command name.
+ * @return A malloc'd path, or NULL if it is not installed.
+*/
+static char* findInPath(const char* name) {
+    const char* path = getenv("PATH");
+    if (path == NULL) {
+        return NULL;
+    }
+    while (*path) {
+        size_t dir_len = strcspn(path, ":");
+        char* candidate = malloc(dir_len + strlen(name) + 2);
+        sprintf(candidate, "%.*s/%s", (int)dir_len, path, name);
+        if (access(candidate, X_OK) == 0) {
+            return candidate;
+        }
+        free(candidate);
+        path += dir_len + (path[dir_len] == ':');
+    }
+    return NULL;
+}
+
+/**
+ * @brief Times one run of the loop.
+ * @param shell The shell's path.
+ * @return Nanoseconds from spawn to exit, or -1 if it failed.
+*/
+static long long timeLoop(const char* shell) {
+    char* argv[] = { (char*)shell, "-c", (char*)loop_script, NULL };
+    pid_t pid;
+    int status;
+
+    long long start = nowNs();
+    if (posix_spawn(&pid, shell, NULL, NULL, argv, environ) != 0) {
+        return -1;
+    }
+    waitpid(pid, &status, 0);
+    long long elapsed = nowNs() - start;
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0 ? elapsed : -1;
+}
+
+/**
+ * @brief Runs the loop repeatedly and returns the median in milliseconds.
+ * @return The median, or -1 if any run failed.
+*/
+static double median(const char* shell, int runs) {
+    long long* times = malloc(sizeof(long long) * runs);
+    for (int i = 0; i < runs; i++) {
+        times[i] = timeLoop(shell);
+        if (times[i] < 0) {
+            free(times);
+            return -1;
+        }
+    }
+    qsort(times, runs, sizeof(long long), compareTimes);
+    double result = times[runs / 2] / 1e6;
+    free(times);
+    return result;
+}
+
+int main(int argc, char* argv[]) {
+    const char* seashell = argc > 1 ? argv[1] : "./a.out";
+    int runs = argc > 2 ? atoi(argv[2]) : 5;
+
+    if (access(seashell, X_OK) != 0) {
+        fprintf(stderr, "%s: not executable\n", seashell);
+        return 1;
+    }
+    if (runs < 1) {
+        runs = 1;
+    }
+
+    double seashell_ms = median(seashell, runs);
+    if (seashell_ms < 0) {
+        fprintf(stderr, "%s: the loop failed\n", seashell);
+        return 1;
+    }
+    printf("seashell  %9.1f ms  %6.1f ns/iteration\n", seashell_ms, seashell_ms * 1e6 / ITERATIONS);
+
+    char* dash = findInPath("dash");
+    if (dash != NULL) {
+        double dash_ms = median(dash, runs);
+        if (dash_ms > 0) {
+            printf("dash      %9.1f ms  %6.1f ns/iteration  (seashell takes %.2fx)\n", dash_ms, dash_ms * 1e6 / ITERATIONS, seashell_ms / dash_ms);
+        }
+        free(dash);
+    }
+    return 0;
+}
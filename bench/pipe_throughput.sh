@@ -0,0 +1,41 @@
+#!/bin/sh
+# Pushes several GiB through a SeaShell pipeline under each pipe capacity policy
+# and reports the throughput.
+#
+# Usage: bench/pipe_throughput.sh [path to seashell] [GiB] [stages]
+
+SEASHELL=${1:-./a.out}
+GIB=${2:-4}
+STAGES=${3:-3}
+BYTES=$((GIB * 1024 * 1024 * 1024))
+
+PIPELINE="head -c $BYTES /dev/zero"
+i=1
+while [ "$i" -lt "$STAGES" ]; do
+    PIPELINE="$PIPELINE | cat"
+    i=$((i + 1))
+done
+PIPELINE="$PIPELINE > /dev/null"
+
+# run <setup line> <label> [number of pipeline runs]
+run() {
+    runs=${3:-1}
+    input=$1
+    i=0
+    while [ "$i" -lt "$runs" ]; do
+        input="$input
+$PIPELINE"
+        i=$((i + 1))
+    done
+    start=$(date +%s.%N)
+    printf '%s\n' "$input" | "$SEASHELL" > /dev/null
+    end=$(date +%s.%N)
+    echo "$start $end" | awk -v label="$2" -v bytes="$((BYTES * runs))" \
+        '{ secs = $2 - $1; printf "%-10s %8.2f s  %9.1f MB/s\n", label, secs, bytes / secs / 1e6 }'
+}
+
+echo "$GIB GiB through $STAGES stages"
+run "pipesize default" "default"
+run "pipesize 1M" "1M"
+# The adaptive policy learns across runs, so average it over several
+run "pipesize auto" "auto" 4
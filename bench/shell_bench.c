@@ -0,0 +1,335 @@
+/**
+ * @file shell_bench.c
+ * @brief End-to-end throughput and latency benchmark that drives a shell binary non-interactively.
+ * @details Generates scripts, runs them under SeaShell and, when installed, dash and bash, and
+ * prints one JSON document so runs can be diffed or checked for regressions by a script:
+ *   - startup_ms: running an empty script, which is subtracted from the per-command rates
+ *   - external_cmds_per_sec: lines of /bin/true run from a script file
+ *   - builtin_cmds_per_sec: lines of ":" run from a script file
+ *   - pipeline_2_mb_per_sec / pipeline_n_mb_per_sec: head -c N /dev/zero piped through cat
+ *   - redirect_overhead_us: extra cost per command of "> /dev/null" on /bin/true
+ *   - spawn_p50_us / spawn_p99_us: round trip of one "/bin/true" line written to the shell's
+ *     stdin, measured until an "echo" on the following line answers on its stdout
+ * Every script is run a few times and the fastest run is kept, which filters out scheduler noise.
+ *
+ * Build: gcc -O2 bench/shell_bench.c -o shell_bench
+ * Run:   ./shell_bench [path to seashell] [commands] [pipeline MiB] [stages]
+*/
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <float.h>
+#include <fcntl.h>
+#include <spawn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+extern char** environ;
+
+typedef struct {
+    const char* name;
+    const char* path;
+} Shell;
+
+static int commands;
+static long long pipeline_bytes;
+static int stages;
+
+//Runs of each script; the fastest is reported
+#define BENCH_RUNS 3
+
+/**
+ * @brief Returns a monotonic timestamp in nanoseconds.
+*/
+static long long nowNs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/**
+ * @brief qsort comparator for latencies.
+*/
+static int compareLatency(const void* a, const void* b) {
+    long long x = *(const long long*)a;
+    long long y = *(const long long*)b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * @brief Finds an executable in PATH.
+ * @param name The command name.
+ * @return A malloc'd path, or NULL if it is not installed.
+*/
+static char* findInPath(const char* name) {
+    const char* path = getenv("PATH");
+    if (path == NULL) {
+        return NULL;
+    }
+    while (*path) {
+        size_t dir_len = strcspn(path, ":");
+        char* candidate = malloc(dir_len + strlen(name) + 2);
+        sprintf(candidate, "%.*s/%s", (int)dir_len, path, name);
+        if (access(candidate, X_OK) == 0) {
+            return candidate;
+        }
+        free(candidate);
+        path += dir_len + (path[dir_len] == ':');
+    }
+    return NULL;
+}
+
+/**
+ * @brief Writes a script made of one line repeated.
+ * @param line The line, without its newline.
+ * @param count How many times to repeat it.
+ * @return The path of the script, owned by the caller.
+*/
+static char* writeScript(const char* line, int count) {
+    char* path = strdup("/tmp/seashell_bench_XXXXXX");
+    int fd = mkstemp(path);
+    FILE* out = fdopen(fd, "w");
+    for (int i = 0; i < count; i++) {
+        fprintf(out, "%s\n", line);
+    }
+    fclose(out);
+    return path;
+}
+
+/**
+ * @brief Runs a script under a shell with its output discarded.
+ * @param shell The shell.
+ * @param script The script's path.
+ * @return Wall time in seconds, or -1 if the shell could not be run or failed.
+*/
+static double timeScript(const Shell* shell, const char* script) {
+    posix_spawn_file_actions_t actions;
+    char* argv[] = { (char*)shell->path, (char*)script, NULL };
+    pid_t pid;
+    int status;
+
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_addopen(&actions, STDIN_FILENO, "/dev/null", O_RDONLY, 0);
+    posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, "/dev/null", O_WRONLY, 0);
+
+    long long start = nowNs();
+    int err = posix_spawn(&pid, shell->path, &actions, NULL, argv, environ);
+    posix_spawn_file_actions_destroy(&actions);
+    if (err != 0) {
+        return -1;
+    }
+    waitpid(pid, &status, 0);
+    double elapsed = (nowNs() - start) / 1e9;
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0 ? elapsed : -1;
+}
+
+/**
+ * @brief Times a script of one repeated line, keeping the fastest of BENCH_RUNS runs.
+ * @param shell The shell.
+ * @param line The line.
+ * @param count How many times to repeat it.
+ * @return Wall time in seconds, or -1 on failure.
+*/
+static double timeLines(const Shell* shell, const char* line, int count) {
+    char* script = writeScript(line, count);
+    double elapsed = DBL_MAX;
+    for (int i = 0; i < BENCH_RUNS && elapsed > 0; i++) {
+        double run = timeScript(shell, script);
+        elapsed = run < elapsed ? run : elapsed;
+    }
+    unlink(script);
+    free(script);
+    return elapsed;
+}
+
+/**
+ * @brief Measures the round trip of single external commands fed to the shell over a pipe.
+ * @param shell The shell.
+ * @param samples How many commands to time.
+ * @param p50 Set to the median latency in microseconds.
+ * @param p99 Set to the 99th percentile latency in microseconds.
+ * @return 0 on success, -1 if the shell stopped answering.
+*/
+static int spawnLatency(const Shell* shell, int samples, double* p50, double* p99) {
+    posix_spawn_file_actions_t actions;
+    char* argv[] = { (char*)shell->path, NULL };
+    int to_shell[2];
+    int from_shell[2];
+    pid_t pid;
+
+    if (pipe2(to_shell, O_CLOEXEC) != 0 || pipe2(from_shell, O_CLOEXEC) != 0) {
+        return -1;
+    }
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_adddup2(&actions, to_shell[0], STDIN_FILENO);
+    posix_spawn_file_actions_adddup2(&actions, from_shell[1], STDOUT_FILENO);
+    int err = posix_spawn(&pid, shell->path, &actions, NULL, argv, environ);
+    posix_spawn_file_actions_destroy(&actions);
+    close(to_shell[0]);
+    close(from_shell[1]);
+    if (err != 0) {
+        close(to_shell[1]);
+        close(from_shell[0]);
+        return -1;
+    }
+
+    static const char request[] = "/bin/true\necho .\n";
+    long long* latency = malloc(sizeof(long long) * samples);
+    int ok = 0;
+    int warmup = samples / 10;
+
+    for (int i = -warmup; i < samples; i++) {
+        char reply[2];
+        long long start = nowNs();
+        if (write(to_shell[1], request, sizeof(request) - 1) != sizeof(request) - 1) {
+            break;
+        }
+        size_t got = 0;
+        while (got < sizeof(reply)) {
+            ssize_t n = read(from_shell[0], reply + got, sizeof(reply) - got);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n <= 0) {
+                break;
+            }
+            got += n;
+        }
+        if (got < sizeof(reply)) {
+            break;
+        }
+        if (i >= 0) {
+            latency[i] = nowNs() - start;
+            ok = i + 1;
+        }
+    }
+
+    close(to_shell[1]);
+    close(from_shell[0]);
+    waitpid(pid, NULL, 0);
+
+    if (ok < samples) {
+        free(latency);
+        return -1;
+    }
+    qsort(latency, samples, sizeof(long long), compareLatency);
+    *p50 = latency[samples / 2] / 1000.0;
+    *p99 = latency[(samples * 99) / 100] / 1000.0;
+    free(latency);
+    return 0;
+}
+
+/**
+ * @brief Times a pipeline of head -c through cat stages.
+ * @param shell The shell.
+ * @param nstages Number of stages, including head.
+ * @return Throughput in MB/s, or -1 on failure.
+*/
+static double pipelineThroughput(const Shell* shell, int nstages) {
+    size_t cap = 64 + nstages * 8;
+    char* line = malloc(cap);
+    int len = snprintf(line, cap, "head -c %lld /dev/zero", pipeline_bytes);
+    for (int i = 1; i < nstages; i++) {
+        len += snprintf(line + len, cap - len, " | cat");
+    }
+    snprintf(line + len, cap - len, " > /dev/null");
+
+    double elapsed = timeLines(shell, line, 1);
+    free(line);
+    return elapsed > 0 ? pipeline_bytes / elapsed / 1e6 : -1;
+}
+
+/**
+ * @brief Prints a JSON number, or null for a failed measurement.
+*/
+static void printMetric(const char* name, double value, int valid, int last) {
+    if (!valid) {
+        printf("      \"%s\": null%s\n", name, last ? "" : ",");
+    }
+    else {
+        printf("      \"%s\": %.2f%s\n", name, value, last ? "" : ",");
+    }
+}
+
+/**
+ * @brief Runs every measurement against one shell and prints its JSON object.
+*/
+static void benchShell(const Shell* shell, int last) {
+    int builtins = commands * 100;
+    double startup = timeLines(shell, ":", 0);
+    double external = timeLines(shell, "/bin/true", commands);
+    double builtin = timeLines(shell, ":", builtins);
+    double redirected = timeLines(shell, "/bin/true > /dev/null", commands);
+    double pipe2 = pipelineThroughput(shell, 2);
+    double pipen = pipelineThroughput(shell, stages);
+    double p50 = -1;
+    double p99 = -1;
+    int latency_ok = spawnLatency(shell, commands, &p50, &p99) == 0;
+    int ok = startup > 0 && external > 0 && builtin > 0 && redirected > 0;
+
+    //Take the shell's own startup out of the per-command numbers
+    if (ok) {
+        external = external > startup ? external - startup : DBL_MIN;
+        builtin = builtin > startup ? builtin - startup : DBL_MIN;
+        redirected = redirected > startup ? redirected - startup : DBL_MIN;
+    }
+
+    printf("    {\n");
+    printf("      \"name\": \"%s\",\n", shell->name);
+    printf("      \"path\": \"%s\",\n", shell->path);
+    printMetric("startup_ms", startup * 1e3, ok, 0);
+    printMetric("external_cmds_per_sec", commands / external, ok, 0);
+    printMetric("builtin_cmds_per_sec", builtins / builtin, ok, 0);
+    printMetric("pipeline_2_mb_per_sec", pipe2, pipe2 > 0, 0);
+    printMetric("pipeline_n_mb_per_sec", pipen, pipen > 0, 0);
+    printMetric("redirect_overhead_us", (redirected - external) * 1e6 / commands, ok, 0);
+    printMetric("spawn_p50_us", p50, latency_ok, 0);
+    printMetric("spawn_p99_us", p99, latency_ok, 1);
+    printf("    }%s\n", last ? "" : ",");
+}
+
+int main(int argc, char* argv[]) {
+    const char* seashell = argc > 1 ? argv[1] : "./a.out";
+    commands = argc > 2 ? atoi(argv[2]) : 2000;
+    pipeline_bytes = (argc > 3 ? atoll(argv[3]) : 1024) << 20;
+    stages = argc > 4 ? atoi(argv[4]) : 4;
+
+    if (access(seashell, X_OK) != 0) {
+        fprintf(stderr, "%s: not executable\n", seashell);
+        return 1;
+    }
+
+    //SeaShell first, then whichever baselines are installed
+    Shell shells[3];
+    int nshells = 0;
+    shells[nshells++] = (Shell){ "seashell", seashell };
+    char* dash = findInPath("dash");
+    char* bash = findInPath("bash");
+    if (dash != NULL) {
+        shells[nshells++] = (Shell){ "dash", dash };
+    }
+    if (bash != NULL) {
+        shells[nshells++] = (Shell){ "bash", bash };
+    }
+
+    printf("{\n");
+    printf("  \"commands\": %d,\n", commands);
+    printf("  \"pipeline_bytes\": %lld,\n", pipeline_bytes);
+    printf("  \"pipeline_stages\": %d,\n", stages);
+    printf("  \"shells\": [\n");
+    for (int i = 0; i < nshells; i++) {
+        benchShell(&shells[i], i == nshells - 1);
+        fflush(stdout);
+    }
+    printf("  ]\n");
+    printf("}\n");
+
+    free(dash);
+    free(bash);
+    return 0;
+}
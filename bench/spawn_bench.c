@@ -0,0 +1,88 @@
+/**
+ * @file spawn_bench.c
+ * @brief Microbenchmark comparing spawn latency of the posix_spawn and fork launch paths.
+ * @details Builds against the shell source directly so both paths are exactly the ones
+ * SeaShell uses. Optionally touches a large heap first, since fork() cost grows with the
+ * size of the parent's address space while posix_spawn stays flat.
+ *
+ * Build: gcc -O2 bench/spawn_bench.c -o spawn_bench
+ * Run:   ./spawn_bench [iterations] [resident MiB]
+*/
+
+#define main seashell_main
+#include "../Seashell.c"
+#undef main
+
+/**
+ * @brief Returns a monotonic timestamp in nanoseconds.
+*/
+static long long nowNs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/**
+ * @brief qsort comparator for latencies.
+*/
+static int compareLatency(const void* a, const void* b) {
+    long long x = *(const long long*)a;
+    long long y = *(const long long*)b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * @brief Spawns and reaps /bin/true repeatedly with the given launch strategy.
+ * @param mode SPAWN_POSIX or SPAWN_FORK.
+ * @param iterations Number of spawns to time.
+ * @param name Label printed with the results.
+*/
+static void runMode(int mode, int iterations, const char* name) {
+    char* argv[] = { "/bin/true", NULL };
+    long long* samples = malloc(sizeof(long long) * iterations);
+    long long total = 0;
+    RedirPlan plan;
+
+    initRedirPlan(&plan);
+    spawn_mode = mode;
+
+    for (int i = 0; i < iterations; i++) {
+        long long start = nowNs();
+        pid_t pid = spawnCmd(argv, NULL, &plan, 0);
+        if (pid == -1) {
+            fprintf(stderr, "spawn failed\n");
+            exit(1);
+        }
+        //posix_spawn returns after the exec while fork returns before it, so time the round trip
+        waitpid(pid, NULL, 0);
+        samples[i] = nowNs() - start;
+        total += samples[i];
+    }
+
+    qsort(samples, iterations, sizeof(long long), compareLatency);
+    printf("%-6s mean %8.1f us  p50 %8.1f us  p99 %8.1f us\n", name,
+        total / 1000.0 / iterations,
+        samples[iterations / 2] / 1000.0,
+        samples[(iterations * 99) / 100] / 1000.0);
+    free(samples);
+}
+
+int main(int argc, char* argv[]) {
+    int iterations = argc > 1 ? atoi(argv[1]) : 2000;
+    size_t resident = (argc > 2 ? strtoul(argv[2], NULL, 10) : 256) << 20;
+
+    //Give the benchmark process a realistic resident set to copy on fork
+    char* heap = malloc(resident);
+    if (heap != NULL) {
+        for (size_t off = 0; off < resident; off += 4096) {
+            heap[off] = 1;
+        }
+    }
+
+    printf("%d spawns, %zu MiB resident\n", iterations, resident >> 20);
+    runMode(SPAWN_POSIX, iterations, "spawn");
+    runMode(SPAWN_FORK, iterations, "fork");
+
+    free(heap);
+    return 0;
+}
@@ -0,0 +1,216 @@
+/**
+ * @file startup_bench.c
+ * @brief Cold-start benchmark with regression thresholds.
+ * @details Measures, as the median of many runs:
+ *   - exit_ms: "seashell -c true" from spawn to exit, the cost every automated invocation pays
+ *   - prompt_ms: an interactive shell on a pseudo-terminal, from spawn until the prompt appears,
+ *     with the banner (-q left off) and without it
+ * dash -c true is timed too when it is installed, for reference. The program exits with status 1
+ * when a median goes over its threshold, so it can gate a CI job.
+ *
+ * Build: gcc -O2 bench/startup_bench.c -o startup_bench
+ * Run:   ./startup_bench [path to seashell] [runs] [max exit ms] [max prompt ms]
+*/
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+extern char** environ;
+
+/**
+ * @brief Returns a monotonic timestamp in nanoseconds.
+*/
+static long long nowNs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/**
+ * @brief qsort comparator for timings.
+*/
+static int compareTimes(const void* a, const void* b) {
+    long long x = *(const long long*)a;
+    long long y = *(const long long*)b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * @brief Finds an executable in PATH.
+ * @param name The command name.
+ * @return A malloc'd path, or NULL if it is not installed.
+*/
+static char* findInPath(const char* name) {
+    const char* path = getenv("PATH");
+    if (path == NULL) {
+        return NULL;
+    }
+    while (*path) {
+        size_t dir_len = strcspn(path, ":");
+        char* candidate = malloc(dir_len + strlen(name) + 2);
+        sprintf(candidate, "%.*s/%s", (int)dir_len, path, name);
+        if (access(candidate, X_OK) == 0) {
+            return candidate;
+        }
+        free(candidate);
+        path += dir_len + (path[dir_len] == ':');
+    }
+    return NULL;
+}
+
+/**
+ * @brief Times one "shell -c true" from spawn to exit.
+ * @param shell The shell's path.
+ * @return Nanoseconds, or -1 if it failed.
+*/
+static long long timeExit(const char* shell) {
+    char* argv[] = { (char*)shell, "-c", "true", NULL };
+    pid_t pid;
+    int status;
+
+    long long start = nowNs();
+    if (posix_spawn(&pid, shell, NULL, NULL, argv, environ) != 0) {
+        return -1;
+    }
+    waitpid(pid, &status, 0);
+    long long elapsed = nowNs() - start;
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0 ? elapsed : -1;
+}
+
+/**
+ * @brief Times an interactive shell on a pseudo-terminal until its prompt is printed.
+ * @param shell The shell's path.
+ * @param quiet Whether to pass -q.
+ * @return Nanoseconds, or -1 if no prompt appeared.
+ * @details The shell gets TERM=xterm, so the line editor and everything it starts are included,
+ * and an empty HISTFILE, so the "exit" sent to end each run stays out of the real history.
+*/
+static long long timePrompt(const char* shell, int quiet) {
+    static const char prompt[] = "SeaShell> ";
+    int master = posix_openpt(O_RDWR | O_NOCTTY | O_CLOEXEC);
+    if (master < 0 || grantpt(master) != 0 || unlockpt(master) != 0) {
+        return -1;
+    }
+    char* slave = ptsname(master);
+
+    long long start = nowNs();
+    pid_t pid = fork();
+    if (pid == 0) {
+        setsid();
+        int fd = open(slave, O_RDWR);
+        dup2(fd, STDIN_FILENO);
+        dup2(fd, STDOUT_FILENO);
+        dup2(fd, STDERR_FILENO);
+        setenv("TERM", "xterm", 1);
+        setenv("HISTFILE", "", 1);
+        execl(shell, shell, quiet ? "-q" : NULL, (char*)NULL);
+        _exit(127);
+    }
+
+    //Everything the shell prints is kept until the prompt shows up in it
+    char output[8192];
+    size_t len = 0;
+    long long elapsed = -1;
+    while (len < sizeof(output) - 1) {
+        struct pollfd pfd = { master, POLLIN, 0 };
+        if (poll(&pfd, 1, 5000) <= 0) {
+            break;
+        }
+        ssize_t n = read(master, output + len, sizeof(output) - 1 - len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            break;
+        }
+        len += n;
+        output[len] = '\0';
+        if (strstr(output, prompt) != NULL) {
+            elapsed = nowNs() - start;
+            break;
+        }
+    }
+
+    if (write(master, "exit\r", 5) != 5) {
+        kill(pid, SIGKILL);
+    }
+    waitpid(pid, NULL, 0);
+    close(master);
+    return elapsed;
+}
+
+/**
+ * @brief Runs a measurement repeatedly and returns its median in milliseconds.
+ * @return The median, or -1 if any run failed.
+*/
+static double median(long long (*measure)(const char*, int), const char* shell, int arg, int runs) {
+    long long* times = malloc(sizeof(long long) * runs);
+    for (int i = 0; i < runs; i++) {
+        times[i] = measure(shell, arg);
+        if (times[i] < 0) {
+            free(times);
+            return -1;
+        }
+    }
+    qsort(times, runs, sizeof(long long), compareTimes);
+    double result = times[runs / 2] / 1e6;
+    free(times);
+    return result;
+}
+
+/**
+ * @brief Adapts timeExit() to the signature median() takes.
+*/
+static long long timeExitRun(const char* shell, int unused) {
+    (void)unused;
+    return timeExit(shell);
+}
+
+int main(int argc, char* argv[]) {
+    const char* seashell = argc > 1 ? argv[1] : "./a.out";
+    int runs = argc > 2 ? atoi(argv[2]) : 200;
+    double max_exit = argc > 3 ? atof(argv[3]) : 5.0;
+    double max_prompt = argc > 4 ? atof(argv[4]) : 20.0;
+
+    if (access(seashell, X_OK) != 0) {
+        fprintf(stderr, "%s: not executable\n", seashell);
+        return 1;
+    }
+    if (runs < 1) {
+        runs = 1;
+    }
+
+    double exit_ms = median(timeExitRun, seashell, 0, runs);
+    double prompt_ms = median(timePrompt, seashell, 0, runs / 4 + 1);
+    double quiet_ms = median(timePrompt, seashell, 1, runs / 4 + 1);
+
+    printf("seashell -c true      %8.3f ms  (limit %.3f)\n", exit_ms, max_exit);
+    printf("seashell first prompt %8.3f ms  (limit %.3f)\n", prompt_ms, max_prompt);
+    printf("seashell -q prompt    %8.3f ms\n", quiet_ms);
+    char* dash = findInPath("dash");
+    if (dash != NULL) {
+        printf("dash -c true          %8.3f ms\n", median(timeExitRun, dash, 0, runs));
+        free(dash);
+    }
+
+    int failed = 0;
+    if (exit_ms < 0 || exit_ms > max_exit) {
+        printf("FAIL: -c true startup %s\n", exit_ms < 0 ? "did not run" : "is over the limit");
+        failed = 1;
+    }
+    if (prompt_ms < 0 || prompt_ms > max_prompt) {
+        printf("FAIL: time to first prompt %s\n", prompt_ms < 0 ? "could not be measured" : "is over the limit");
+        failed = 1;
+    }
+    return failed;
+}